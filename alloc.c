@@ -0,0 +1,213 @@
+// alloc.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define ALLOC_BUCKETS 65536
+#define ALLOC_SITES   1024
+
+#ifdef SG_ALLOC_TRACKING
+
+typedef struct AllocEntry {
+    void              *ptr;
+    size_t            size;
+    int               site;
+    struct AllocEntry *next;
+} AllocEntry;
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static AllocEntry *alloc_entries[ALLOC_BUCKETS];
+static AllocSite  alloc_sites[ALLOC_SITES];
+
+static size_t alloc_hash(const void *ptr) {
+    return (((uintptr_t)ptr >> 4) * 2654435761u) % ALLOC_BUCKETS;
+}
+
+/**
+ * @brief find or add site of source line, file names are compared by pointer
+ *        since __FILE__ of one translation unit is a single literal, hashing and
+ *        probing never reach the last slot which is kept for sites that don't fit
+ */
+static int alloc_site(const char *file, int line) {
+    size_t index = ((((uintptr_t)file >> 3) * 31 + line) * 2654435761u) % (ALLOC_SITES - 1);
+    size_t i;
+    
+    for (i = 0; i < ALLOC_SITES - 1; i++, index = (index + 1) % (ALLOC_SITES - 1)) {
+        if (!alloc_sites[index].file) {
+            alloc_sites[index].file = file;
+            alloc_sites[index].line = line;
+        }
+        
+        if (alloc_sites[index].file == file && alloc_sites[index].line == line) {
+            return index;
+        }
+    }
+    
+    // table is full, last slot collects the rest
+    alloc_sites[ALLOC_SITES - 1].file = "(other)";
+    
+    return ALLOC_SITES - 1;
+}
+
+static void alloc_track(void *ptr, size_t size, const char *file, int line) {
+    AllocEntry *entry = (AllocEntry*)malloc(sizeof(AllocEntry));
+    size_t     bucket = alloc_hash(ptr);
+    
+    if (!entry) {
+        return;
+    }
+    
+    pthread_mutex_lock(&alloc_lock);
+    
+    entry->ptr  = ptr;
+    entry->size = size;
+    entry->site = alloc_site(file, line);
+    entry->next = alloc_entries[bucket];
+    
+    alloc_entries[bucket] = entry;
+    
+    alloc_sites[entry->site].count++;
+    alloc_sites[entry->site].bytes += size;
+    alloc_sites[entry->site].total++;
+    
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/**
+ * @brief forget allocation, pointers allocated outside of tracking are ignored
+ */
+static void alloc_untrack(void *ptr) {
+    AllocEntry **entry, *_entry = NULL;
+    
+    pthread_mutex_lock(&alloc_lock);
+    
+    for (entry = &alloc_entries[alloc_hash(ptr)]; *entry; entry = &(*entry)->next) {
+        if ((*entry)->ptr == ptr) {
+            _entry = *entry;
+            *entry = _entry->next;
+            
+            alloc_sites[_entry->site].count--;
+            alloc_sites[_entry->site].bytes -= _entry->size;
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&alloc_lock);
+    
+    free(_entry);
+}
+
+void* sg_alloc_malloc(size_t size, const char *file, int line) {
+    void *ptr = malloc(size);
+    
+    if (ptr) {
+        alloc_track(ptr, size, file, line);
+    }
+    
+    return ptr;
+}
+
+void* sg_alloc_calloc(size_t count, size_t size, const char *file, int line) {
+    void *ptr = calloc(count, size);
+    
+    if (ptr) {
+        alloc_track(ptr, count * size, file, line);
+    }
+    
+    return ptr;
+}
+
+void* sg_alloc_realloc(void *ptr, size_t size, const char *file, int line) {
+    void *_ptr = realloc(ptr, size);
+    
+    if (ptr && (_ptr || !size)) {
+        alloc_untrack(ptr);
+    }
+    
+    if (_ptr) {
+        alloc_track(_ptr, size, file, line);
+    }
+    
+    return _ptr;
+}
+
+char* sg_alloc_strdup(const char *str, const char *file, int line) {
+    char *ptr = strdup(str);
+    
+    if (ptr) {
+        alloc_track(ptr, strlen(ptr) + 1, file, line);
+    }
+    
+    return ptr;
+}
+
+char* sg_alloc_strndup(const char *str, size_t size, const char *file, int line) {
+    char *ptr = strndup(str, size);
+    
+    if (ptr) {
+        alloc_track(ptr, strlen(ptr) + 1, file, line);
+    }
+    
+    return ptr;
+}
+
+void sg_alloc_free(void *ptr) {
+    
+    if (ptr) {
+        alloc_untrack(ptr);
+    }
+    
+    free(ptr);
+}
+
+#endif
+
+/**
+ * @brief copy sites with live allocations
+ * @param sites output array, should be freed by caller
+ * @return number of sites (always 0 without SG_ALLOC_TRACKING), negative error code on failure
+ */
+int sg_alloc_snapshot(AllocSite **sites) {
+    int count = 0;
+    
+    *sites = NULL;
+    
+#ifdef SG_ALLOC_TRACKING
+    int i;
+    
+    if (!(*sites = (AllocSite*)malloc(ALLOC_SITES * sizeof(AllocSite)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    pthread_mutex_lock(&alloc_lock);
+    
+    for (i = 0; i < ALLOC_SITES; i++) {
+        if (alloc_sites[i].file) {
+            (*sites)[count++] = alloc_sites[i];
+        }
+    }
+    
+    pthread_mutex_unlock(&alloc_lock);
+#endif
+    
+    return count;
+}
@@ -0,0 +1,65 @@
+// alloc.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __SG_ALLOC__
+#define __SG_ALLOC__
+
+/**
+ * Live allocations of one source line, recorded when library is built
+ * with --enable-alloc-tracking (SG_ALLOC_TRACKING).
+ */
+typedef struct {
+    const char *file;
+    int        line;
+    
+    size_t     count;
+    size_t     bytes;
+    size_t     total;
+} AllocSite;
+
+#ifdef SG_ALLOC_TRACKING
+
+void* sg_alloc_malloc(size_t size, const char *file, int line);
+void* sg_alloc_calloc(size_t count, size_t size, const char *file, int line);
+void* sg_alloc_realloc(void *ptr, size_t size, const char *file, int line);
+char* sg_alloc_strdup(const char *str, const char *file, int line);
+char* sg_alloc_strndup(const char *str, size_t size, const char *file, int line);
+void  sg_alloc_free(void *ptr);
+
+#define sg_malloc(size)         sg_alloc_malloc(size, __FILE__, __LINE__)
+#define sg_calloc(count, size)  sg_alloc_calloc(count, size, __FILE__, __LINE__)
+#define sg_realloc(ptr, size)   sg_alloc_realloc(ptr, size, __FILE__, __LINE__)
+#define sg_strdup(str)          sg_alloc_strdup(str, __FILE__, __LINE__)
+#define sg_strndup(str, size)   sg_alloc_strndup(str, size, __FILE__, __LINE__)
+#define sg_free(ptr)            sg_alloc_free(ptr)
+
+#else
+
+#define sg_malloc(size)         malloc(size)
+#define sg_calloc(count, size)  calloc(count, size)
+#define sg_realloc(ptr, size)   realloc(ptr, size)
+#define sg_strdup(str)          strdup(str)
+#define sg_strndup(str, size)   strndup(str, size)
+#define sg_free(ptr)            free(ptr)
+
+#endif
+
+int sg_alloc_snapshot(AllocSite **sites);
+
+#endif
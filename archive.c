@@ -0,0 +1,289 @@
+// archive.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "archive.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define ARCHIVE_ENTRY_SIZE 512
+
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+static const char kArchiveEndList[] = "#EXT-X-ENDLIST\n";
+
+/**
+ * @brief create parent directory of archived file
+ */
+static int archive_make_dir(SegmenterArchive *archive, const char *name) {
+    const char *slash = strrchr(name, '/');
+    char       dir[ARCHIVE_ENTRY_SIZE];
+    
+    if (!slash || slash - name >= sizeof(dir)) {
+        return -1;
+    }
+    
+    memcpy(dir, name, slash - name);
+    dir[slash - name] = '\0';
+    
+    return mkdirat(archive->dir, dir, 0755) && errno != EEXIST ? -1 : 0;
+}
+
+/**
+ * @brief share data of file with archive copy, FICLONE shares extents on filesystems
+ *        with reflinks, otherwise data is copied without leaving kernel
+ */
+static int archive_clone(SegmenterArchive *archive, const char *name) {
+    struct stat st;
+    off_t       offset = 0;
+    ssize_t     size;
+    int         in, out;
+    int         ret = 0;
+    
+    if ((in = openat(archive->source, name, O_RDONLY | O_CLOEXEC)) < 0) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if ((out = openat(archive->dir, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0) {
+        close(in);
+        return errno == EEXIST ? SGERROR(SGERROR_EXISTS) : SGERROR(SGERROR_FILE_WRITE);
+    }
+
+#ifdef FICLONE
+    if (!ioctl(out, FICLONE, in)) {
+        archive->cloned++;
+        goto done;
+    }
+#endif
+    
+    if (fstat(in, &st)) {
+        ret = SGERROR(SGERROR_FILE_WRITE);
+        goto done;
+    }
+    
+    while (offset < st.st_size) {
+        if ((size = sendfile(out, in, &offset, st.st_size - offset)) <= 0) {
+            ret = SGERROR(SGERROR_FILE_WRITE);
+            goto done;
+        }
+    }
+    
+    archive->copied++;
+
+done:
+    close(in);
+    
+    if (close(out) && !ret) {
+        ret = SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    return ret;
+}
+
+/**
+ * @brief write fixed size playlist header, the rest of header line is padded with comment
+ */
+static int archive_write_header(SegmenterArchive *archive) {
+    char header[SG_ARCHIVE_HEADER_SIZE];
+    int  length;
+    
+    length = snprintf(header, sizeof(header), "#EXTM3U\n"
+                                              "#EXT-X-TARGETDURATION:%ld\n"
+                                              "#EXT-X-VERSION:3\n"
+                                              "#EXT-X-MEDIA-SEQUENCE:%u\n"
+                                              "#EXT-X-PLAYLIST-TYPE:VOD\n"
+                                              "#", archive->target_duration, archive->sequence);
+    
+    memset(header + length, ' ', sizeof(header) - length - 1);
+    header[sizeof(header) - 1] = '\n';
+    
+    if (pwrite(archive->playlist, header, sizeof(header), 0) != sizeof(header)) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief open archive of output directory, archive directory is created when missing.
+ *        Restarted segmenter numbers segments from the start again, so archive which
+ *        already lists segments is refused rather than overwritten
+ * @param archive output archive
+ * @param source output directory of segmenter
+ * @param path archive directory
+ * @param playlist archive playlist name
+ * @return 0 on success, SGERROR_EXISTS when archive playlist isn't empty,
+ *         other negative error code on failure
+ */
+int sg_archive_open(SegmenterArchive **archive, const char *source, const char *path, const char *playlist) {
+    SegmenterArchive *_archive;
+    struct stat      st;
+    
+    if (!(_archive = (SegmenterArchive*)sg_calloc(1, sizeof(SegmenterArchive)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _archive->source   = -1;
+    _archive->dir      = -1;
+    _archive->playlist = -1;
+    _archive->size     = SG_ARCHIVE_HEADER_SIZE;
+    
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        sg_archive_close(_archive);
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if ((_archive->source = open(*source ? source : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        (_archive->dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        (_archive->playlist = openat(_archive->dir, playlist, O_WRONLY | O_CREAT | O_CLOEXEC, 0666)) < 0 ||
+        fstat(_archive->playlist, &st)) {
+        sg_archive_close(_archive);
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (st.st_size) {
+        sg_archive_close(_archive);
+        return SGERROR(SGERROR_EXISTS);
+    }
+    
+    *archive = _archive;
+    
+    return 0;
+}
+
+/**
+ * @brief link file of output directory into archive, file already archived is never replaced
+ * @param archive archive
+ * @param name file name relative to output directory
+ * @return 0 on success, SGERROR_EXISTS when archive has file of that name,
+ *         other negative error code on failure
+ */
+int sg_archive_add_file(SegmenterArchive *archive, const char *name) {
+    int ret;
+    
+    if (!(ret = linkat(archive->source, name, archive->dir, name, 0))) {
+        archive->linked++;
+        return 0;
+    }
+    
+    if (errno == ENOENT && !archive_make_dir(archive, name)) {
+        ret = linkat(archive->source, name, archive->dir, name, 0);
+    }
+    
+    if (!ret) {
+        archive->linked++;
+        return 0;
+    }
+    
+    if (errno == EEXIST) {
+        return SGERROR(SGERROR_EXISTS);
+    }
+    
+    // cross device or filesystem without hard links
+    if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (strchr(name, '/')) {
+        archive_make_dir(archive, name);
+    }
+    
+    return archive_clone(archive, name);
+}
+
+/**
+ * @brief archive finished segment and append it to archive playlist
+ * @param archive archive
+ * @param name segment name relative to output directory, also used as uri
+ * @param index segment index
+ * @param duration segment duration
+ * @param key_uri uri of encryption key when it changes with this segment, NULL otherwise
+ * @return 0 on success, negative error code on failure
+ */
+int sg_archive_add_segment(SegmenterArchive *archive, const char *name, unsigned int index, double duration, const char *key_uri) {
+    char entry[ARCHIVE_ENTRY_SIZE];
+    int  length = 0;
+    int  ret;
+    
+    if ((ret = sg_archive_add_file(archive, name))) {
+        return ret;
+    }
+    
+    if (key_uri) {
+        length = snprintf(entry, sizeof(entry), "#EXT-X-KEY:METHOD=AES-128,URI=\"%s\"\n", key_uri);
+    }
+    
+    length += snprintf(entry + length, sizeof(entry) - length, "#EXTINF:%.6f,\n"
+                                                               "%s\n", duration, name);
+    
+    if (length + sizeof(kArchiveEndList) > sizeof(entry)) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    // entry replaces end list of previous one, so playlist stays complete
+    memcpy(entry + length, kArchiveEndList, sizeof(kArchiveEndList) - 1);
+    
+    if (pwrite(archive->playlist, entry, length + sizeof(kArchiveEndList) - 1, archive->size) != length + sizeof(kArchiveEndList) - 1) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    archive->size += length;
+    
+    if (archive->count++ && lround(duration) <= archive->target_duration) {
+        return 0;
+    }
+    
+    if (archive->count == 1) {
+        archive->sequence = index;
+    }
+    
+    archive->target_duration = max(archive->target_duration, lround(duration));
+    
+    return archive_write_header(archive);
+}
+
+/**
+ * @brief close archive, archived files and playlist are kept
+ * @param archive archive
+ */
+void sg_archive_close(SegmenterArchive *archive) {
+    
+    if (archive->playlist >= 0) {
+        close(archive->playlist);
+    }
+    
+    if (archive->dir >= 0) {
+        close(archive->dir);
+    }
+    
+    if (archive->source >= 0) {
+        close(archive->source);
+    }
+    
+    sg_free(archive);
+}
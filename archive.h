@@ -0,0 +1,52 @@
+// archive.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __SG_ARCHIVE__
+#define __SG_ARCHIVE__
+
+#define SG_ARCHIVE_HEADER_SIZE 128
+
+/**
+ * Live-to-VOD archive. Finished segments are hard linked from output directory into
+ * archive directory (reflinked with FICLONE when they can't be linked, copied by kernel
+ * as the last resort) and appended to VOD playlist, so archiving costs constant I/O per
+ * segment. Playlist has fixed size header rewritten in place and always ends with
+ * #EXT-X-ENDLIST, so it is a complete VOD index after every segment.
+ */
+typedef struct {
+    int           source;
+    int           dir;
+    int           playlist;
+    
+    off_t         size;
+    unsigned int  sequence;
+    unsigned int  count;
+    long          target_duration;
+    
+    unsigned long linked;
+    unsigned long cloned;
+    unsigned long copied;
+} SegmenterArchive;
+
+int  sg_archive_open(SegmenterArchive **archive, const char *source, const char *path, const char *playlist);
+int  sg_archive_add_file(SegmenterArchive *archive, const char *name);
+int  sg_archive_add_segment(SegmenterArchive *archive, const char *name, unsigned int index, double duration, const char *key_uri);
+void sg_archive_close(SegmenterArchive *archive);
+
+#endif
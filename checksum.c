@@ -0,0 +1,272 @@
+// checksum.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "checksum.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SG_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t       crc32c_table[8][256];
+static int            crc32c_sse42 = 0;
+static pthread_once_t crc32c_once  = PTHREAD_ONCE_INIT;
+
+static void crc32c_init() {
+    uint32_t i, j, crc;
+    
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        
+        for (j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        
+        crc32c_table[0][i] = crc;
+    }
+    
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+        }
+    }
+    
+#ifdef SG_CRC32C_SSE42
+    __builtin_cpu_init();
+    crc32c_sse42 = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+/**
+ * @brief table driven crc32c (slicing by 8), used when crc32 instruction is not available
+ */
+uint32_t sg_crc32c_portable(uint32_t crc, const uint8_t *buf, size_t size) {
+    pthread_once(&crc32c_once, crc32c_init);
+    
+    crc = ~crc;
+    
+    while (size && ((uintptr_t)buf & 7)) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+        size--;
+    }
+    
+    while (size >= 8) {
+        uint32_t lo, hi;
+        
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+        
+        lo ^= crc;
+        
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        
+        buf  += 8;
+        size -= 8;
+    }
+    
+    while (size--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+    }
+    
+    return ~crc;
+}
+
+#ifdef SG_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_update(uint32_t crc, const uint8_t *buf, size_t size) {
+    crc = ~crc;
+    
+    while (size && ((uintptr_t)buf & 7)) {
+        crc = _mm_crc32_u8(crc, *buf++);
+        size--;
+    }
+    
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    
+    while (size >= 8) {
+        uint64_t word;
+        
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        
+        buf  += 8;
+        size -= 8;
+    }
+    
+    crc = (uint32_t)crc64;
+#endif
+    
+    while (size >= 4) {
+        uint32_t word;
+        
+        memcpy(&word, buf, 4);
+        crc = _mm_crc32_u32(crc, word);
+        
+        buf  += 4;
+        size -= 4;
+    }
+    
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+    
+    return ~crc;
+}
+#endif
+
+/**
+ * @brief whether crc32c is computed with SSE 4.2 crc32 instruction
+ */
+int sg_crc32c_accelerated() {
+    pthread_once(&crc32c_once, crc32c_init);
+    
+    return crc32c_sse42;
+}
+
+/**
+ * @brief update crc32c (Castagnoli) checksum
+ * @param crc previous checksum value, 0 for first block
+ * @param buf data
+ * @param size data size
+ * @return updated checksum
+ */
+uint32_t sg_crc32c(uint32_t crc, const uint8_t *buf, size_t size) {
+#ifdef SG_CRC32C_SSE42
+    if (sg_crc32c_accelerated()) {
+        return crc32c_sse42_update(crc, buf, size);
+    }
+#endif
+    
+    return sg_crc32c_portable(crc, buf, size);
+}
+
+/**
+ * @brief allocate segment checksum context
+ * @param checksum output context
+ * @param types ChecksumType flags
+ * @return 0 on success, negative error code on failure
+ */
+int sg_checksum_alloc(SegmenterChecksum **checksum, int types) {
+    SegmenterChecksum *_checksum = (SegmenterChecksum*)sg_calloc(1, sizeof(SegmenterChecksum));
+    
+    if (!_checksum) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _checksum->types = types;
+    
+    if (types & ChecksumTypeSHA256) {
+#ifdef HAVE_LIBCRYPTO
+        if (!(_checksum->sha256 = EVP_MD_CTX_create())) {
+            sg_free(_checksum);
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+#else
+        sg_free(_checksum);
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+#endif
+    }
+    
+    *checksum = _checksum;
+    
+    return 0;
+}
+
+/**
+ * @brief free checksum context
+ * @param checksum checksum context
+ */
+void sg_checksum_free(SegmenterChecksum *checksum) {
+#ifdef HAVE_LIBCRYPTO
+    if (checksum->sha256) {
+        EVP_MD_CTX_destroy((EVP_MD_CTX*)checksum->sha256);
+    }
+#endif
+    sg_free(checksum);
+}
+
+/**
+ * @brief reset checksums for new segment
+ * @param checksum checksum context
+ * @return 0 on success, negative error code on failure
+ */
+int sg_checksum_start(SegmenterChecksum *checksum) {
+    checksum->crc32c = 0;
+    
+#ifdef HAVE_LIBCRYPTO
+    if (checksum->sha256 && EVP_DigestInit_ex((EVP_MD_CTX*)checksum->sha256, EVP_sha256(), NULL) != 1) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+#endif
+    
+    return 0;
+}
+
+/**
+ * @brief add segment data to checksums
+ * @param checksum checksum context
+ * @param buf data
+ * @param size data size
+ */
+void sg_checksum_update(SegmenterChecksum *checksum, const uint8_t *buf, size_t size) {
+    
+    if (checksum->types & ChecksumTypeCRC32C) {
+        checksum->crc32c = sg_crc32c(checksum->crc32c, buf, size);
+    }
+    
+#ifdef HAVE_LIBCRYPTO
+    if (checksum->sha256) {
+        EVP_DigestUpdate((EVP_MD_CTX*)checksum->sha256, buf, size);
+    }
+#endif
+}
+
+/**
+ * @brief finish segment checksums
+ * @param checksum checksum context
+ * @param out segment checksums, size is not touched
+ * @return 0 on success, negative error code on failure
+ */
+int sg_checksum_finish(SegmenterChecksum *checksum, SegmentChecksum *out) {
+    out->crc32c = checksum->crc32c;
+    
+    memset(out->sha256, 0, SG_SHA256_SIZE);
+    
+#ifdef HAVE_LIBCRYPTO
+    if (checksum->sha256 && EVP_DigestFinal_ex((EVP_MD_CTX*)checksum->sha256, out->sha256, NULL) != 1) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+#endif
+    
+    return 0;
+}
@@ -0,0 +1,54 @@
+// checksum.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __SG_CHECKSUM__
+#define __SG_CHECKSUM__
+
+#define SG_SHA256_SIZE 32
+
+typedef enum {
+    ChecksumTypeCRC32C = 0x01,
+    ChecksumTypeSHA256 = 0x02
+} ChecksumType;
+
+typedef struct {
+    size_t   size;
+    uint32_t crc32c;
+    uint8_t  sha256[SG_SHA256_SIZE];
+} SegmentChecksum;
+
+typedef struct {
+    int      types;
+    
+    uint32_t crc32c;
+    void     *sha256;
+} SegmenterChecksum;
+
+uint32_t sg_crc32c(uint32_t crc, const uint8_t *buf, size_t size);
+uint32_t sg_crc32c_portable(uint32_t crc, const uint8_t *buf, size_t size);
+int      sg_crc32c_accelerated(void);
+
+int  sg_checksum_alloc(SegmenterChecksum **checksum, int types);
+void sg_checksum_free(SegmenterChecksum *checksum);
+
+int  sg_checksum_start(SegmenterChecksum *checksum);
+void sg_checksum_update(SegmenterChecksum *checksum, const uint8_t *buf, size_t size);
+int  sg_checksum_finish(SegmenterChecksum *checksum, SegmentChecksum *out);
+
+#endif
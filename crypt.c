@@ -0,0 +1,221 @@
+// crypt.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "crypt.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#endif
+
+/**
+ * @brief allocate AES-128-CBC segment encryption context
+ * @param crypt output context
+ * @param key static key, NULL to generate new random key for every rotation period
+ * @param rotation number of segments encrypted with one key, 0 to never rotate
+ * @return 0 on success, negative error code on failure
+ */
+int sg_crypt_alloc(SegmenterCrypt **crypt, const uint8_t *key, unsigned int rotation) {
+#ifdef HAVE_LIBCRYPTO
+    SegmenterCrypt *_crypt = (SegmenterCrypt*)sg_calloc(1, sizeof(SegmenterCrypt));
+    
+    if (!_crypt) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (!(_crypt->cipher = EVP_CIPHER_CTX_new())) {
+        sg_free(_crypt);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (key) {
+        memcpy(_crypt->key, key, SG_CRYPT_KEY_SIZE);
+    }
+    
+    _crypt->random_key = key == NULL;
+    _crypt->rotation   = key ? 0 : rotation;
+    
+    *crypt = _crypt;
+    
+    return 0;
+#else
+    return SGERROR(SGERROR_CRYPT);
+#endif
+}
+
+/**
+ * @brief free encryption context
+ * @param crypt encryption context
+ */
+void sg_crypt_free(SegmenterCrypt *crypt) {
+#ifdef HAVE_LIBCRYPTO
+    EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*)crypt->cipher);
+#endif
+    memset(crypt->key, 0, SG_CRYPT_KEY_SIZE);
+    sg_free(crypt);
+}
+
+/**
+ * @brief key rotation period of segment
+ * @param crypt encryption context
+ * @param index segment index
+ * @return key period number
+ */
+unsigned int sg_crypt_period(SegmenterCrypt *crypt, unsigned int index) {
+    return crypt->rotation ? index / crypt->rotation : 0;
+}
+
+/**
+ * @brief start encryption of segment, IV is the segment media sequence number
+ *        so it can be omitted from EXT-X-KEY tag
+ * @param crypt encryption context
+ * @param index segment index
+ * @return 0 on success, 1 if new key was generated for segment, negative error code on failure
+ */
+int sg_crypt_start(SegmenterCrypt *crypt, unsigned int index) {
+#ifdef HAVE_LIBCRYPTO
+    uint8_t      iv[SG_CRYPT_BLOCK_SIZE];
+    unsigned int period = sg_crypt_period(crypt, index);
+    int          ret    = 0;
+    
+    if (!crypt->has_period || period != crypt->period) {
+        
+        if (crypt->random_key && RAND_bytes(crypt->key, SG_CRYPT_KEY_SIZE) != 1) {
+            return SGERROR(SGERROR_CRYPT);
+        }
+        
+        crypt->period     = period;
+        crypt->has_period = 1;
+        
+        ret = 1;
+    }
+    
+    memset(iv, 0, SG_CRYPT_BLOCK_SIZE);
+    
+    iv[12] = (index >> 24) & 0xff;
+    iv[13] = (index >> 16) & 0xff;
+    iv[14] = (index >> 8)  & 0xff;
+    iv[15] = index & 0xff;
+    
+    if (EVP_EncryptInit_ex((EVP_CIPHER_CTX*)crypt->cipher, EVP_aes_128_cbc(), NULL, crypt->key, iv) != 1) {
+        return SGERROR(SGERROR_CRYPT);
+    }
+    
+    return ret;
+#else
+    return SGERROR(SGERROR_CRYPT);
+#endif
+}
+
+/**
+ * @brief encrypt segment data
+ * @param crypt encryption context
+ * @param in plain data
+ * @param size plain data size
+ * @param out output buffer, at least size + SG_CRYPT_BLOCK_SIZE bytes
+ * @return number of bytes written to out, negative error code on failure
+ */
+int sg_crypt_update(SegmenterCrypt *crypt, const uint8_t *in, int size, uint8_t *out) {
+#ifdef HAVE_LIBCRYPTO
+    int length = 0;
+    
+    if (EVP_EncryptUpdate((EVP_CIPHER_CTX*)crypt->cipher, out, &length, in, size) != 1) {
+        return SGERROR(SGERROR_CRYPT);
+    }
+    
+    return length;
+#else
+    return SGERROR(SGERROR_CRYPT);
+#endif
+}
+
+/**
+ * @brief finish segment encryption, writes PKCS7 padding
+ * @param crypt encryption context
+ * @param out output buffer, at least SG_CRYPT_BLOCK_SIZE bytes
+ * @return number of bytes written to out, negative error code on failure
+ */
+int sg_crypt_finish(SegmenterCrypt *crypt, uint8_t *out) {
+#ifdef HAVE_LIBCRYPTO
+    int length = 0;
+    
+    if (EVP_EncryptFinal_ex((EVP_CIPHER_CTX*)crypt->cipher, out, &length) != 1) {
+        return SGERROR(SGERROR_CRYPT);
+    }
+    
+    return length;
+#else
+    return SGERROR(SGERROR_CRYPT);
+#endif
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    
+    return -1;
+}
+
+/**
+ * @brief parse key given as 32 hex digits or path to 16 byte key file
+ * @param str key string
+ * @param key output key
+ * @return 0 on success, negative error code on failure
+ */
+int sg_crypt_parse_key(const char *str, uint8_t *key) {
+    const char *hex = str;
+    int        i;
+    
+    if (!strncmp(hex, "0x", 2) || !strncmp(hex, "0X", 2)) {
+        hex += 2;
+    }
+    
+    if (strlen(hex) == SG_CRYPT_KEY_SIZE * 2) {
+        for (i = 0; i < SG_CRYPT_KEY_SIZE; i++) {
+            int hi = hex_value(hex[i * 2]), lo = hex_value(hex[i * 2 + 1]);
+            
+            if (hi < 0 || lo < 0) {
+                break;
+            }
+            
+            key[i] = (hi << 4) | lo;
+        }
+        
+        if (i == SG_CRYPT_KEY_SIZE) {
+            return 0;
+        }
+    }
+    
+    FILE *in = fopen(str, "rb");
+    
+    if (!in) {
+        return SGERROR(SGERROR_CRYPT);
+    }
+    
+    i = fread(key, 1, SG_CRYPT_KEY_SIZE, in) == SG_CRYPT_KEY_SIZE ? 0 : SGERROR(SGERROR_CRYPT);
+    
+    fclose(in);
+    
+    return i;
+}
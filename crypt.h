@@ -0,0 +1,48 @@
+// crypt.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __SG_CRYPT__
+#define __SG_CRYPT__
+
+#define SG_CRYPT_KEY_SIZE   16
+#define SG_CRYPT_BLOCK_SIZE 16
+
+typedef struct {
+    void         *cipher;
+    
+    uint8_t      key[SG_CRYPT_KEY_SIZE];
+    int          random_key;
+    
+    unsigned int rotation;
+    unsigned int period;
+    int          has_period;
+} SegmenterCrypt;
+
+int  sg_crypt_alloc(SegmenterCrypt **crypt, const uint8_t *key, unsigned int rotation);
+void sg_crypt_free(SegmenterCrypt *crypt);
+
+unsigned int sg_crypt_period(SegmenterCrypt *crypt, unsigned int index);
+
+int  sg_crypt_start(SegmenterCrypt *crypt, unsigned int index);
+int  sg_crypt_update(SegmenterCrypt *crypt, const uint8_t *in, int size, uint8_t *out);
+int  sg_crypt_finish(SegmenterCrypt *crypt, uint8_t *out);
+
+int  sg_crypt_parse_key(const char *str, uint8_t *key);
+
+#endif
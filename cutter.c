@@ -0,0 +1,373 @@
+// cutter.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "cutter.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+static const size_t kCutterBufferSize = 1024 * 1024;
+static const size_t kCutterMinData    = 65536;
+static const size_t kCutterProbeSize  = 16384;
+static const size_t kCutterTagSize    = 10;
+
+/**
+ * @brief read callback of input opened by name
+ */
+static int cutter_fd_read(void *opaque, uint8_t *buf, int size) {
+    SegmenterCutter *cutter = (SegmenterCutter*)opaque;
+    ssize_t         length;
+    
+    while ((length = read(cutter->fd, buf, size)) < 0) {
+        if (errno != EINTR) {
+            return AVERROR(errno);
+        }
+    }
+    
+    return length ? length : AVERROR_EOF;
+}
+
+/**
+ * @brief move unread data to the start of buffer and read until buffer is full or
+ *        input has no more data at hand, so live pipe isn't held until megabyte arrives
+ * @return 0 on success, negative error code on failure
+ */
+static int cutter_fill(SegmenterCutter *cutter) {
+    int size, length;
+    
+    if (cutter->start) {
+        memmove(cutter->buf, cutter->buf + cutter->start, cutter->end - cutter->start);
+        
+        cutter->end  -= cutter->start;
+        cutter->start = 0;
+    }
+    
+    while (!cutter->eof && cutter->end < cutter->buf_size) {
+        length = cutter->buf_size - cutter->end;
+        
+        if ((size = cutter->read(cutter->opaque, cutter->buf + cutter->end, length)) == AVERROR_EOF || !size) {
+            cutter->eof = 1;
+            break;
+        }
+        
+        if (size < 0) {
+            return SGERROR(SGERROR_INPUT);
+        }
+        
+        cutter->end += size;
+        
+        if (size < length) {
+            break;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief read until at least size bytes are buffered, input ends or buffer is full
+ * @return 0 on success, negative error code on failure
+ */
+static int cutter_need(SegmenterCutter *cutter, size_t size) {
+    int ret;
+    
+    while (cutter->end - cutter->start < size && !cutter->eof && (cutter->start || cutter->end < cutter->buf_size)) {
+        if ((ret = cutter_fill(cutter))) {
+            return ret;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief parse frame header at given offset of buffer
+ * @return 0 on success, negative value if there is no valid header
+ */
+static int cutter_frame(SegmenterCutter *cutter, size_t offset, AudioFrame *frame) {
+    const uint8_t *data = cutter->buf + offset;
+    size_t        size  = cutter->end - offset;
+    
+    return cutter->codec_id == AV_CODEC_ID_AAC ? sg_adts_frame(data, size, frame) : sg_mp3_frame(data, size, frame);
+}
+
+/**
+ * @brief detect ADTS or MPEG audio by two consecutive frame headers at the start of input
+ */
+static int cutter_probe(SegmenterCutter *cutter, enum AVCodecID codec_id) {
+    AudioFrame next;
+    
+    cutter->codec_id = codec_id;
+    
+    if (cutter_frame(cutter, cutter->start, &cutter->format)) {
+        return -1;
+    }
+    
+    if (cutter->start + cutter->format.size >= cutter->end) {
+        return cutter->eof ? 0 : -1;
+    }
+    
+    return cutter_frame(cutter, cutter->start + cutter->format.size, &next);
+}
+
+/**
+ * @brief allocate cutter reading its input through callback
+ * @param cutter output cutter
+ * @param read read callback, returns number of bytes read, AVERROR_EOF at the end of
+ *             input or other negative value on failure
+ * @param opaque callback argument
+ * @return 0 on success, negative error code on failure
+ */
+int sg_cutter_alloc(SegmenterCutter **cutter, int (*read)(void *opaque, uint8_t *buf, int size), void *opaque) {
+    SegmenterCutter *_cutter;
+    
+    if (!(_cutter = (SegmenterCutter*)sg_calloc(1, sizeof(SegmenterCutter)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _cutter->buf_size = kCutterBufferSize;
+    
+    if (!(_cutter->buf = (uint8_t*)sg_malloc(_cutter->buf_size))) {
+        sg_free(_cutter);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _cutter->read   = read;
+    _cutter->opaque = opaque;
+    _cutter->fd     = -1;
+    
+    *cutter = _cutter;
+    
+    return 0;
+}
+
+/**
+ * @brief open input file, fifo or standard input ("-") of cutter, sg_cutter_probe
+ *        tells whether it is raw audio
+ * @param cutter output cutter
+ * @param filename input name
+ * @return 0 on success, negative error code on failure
+ */
+int sg_cutter_open(SegmenterCutter **cutter, const char *filename) {
+    SegmenterCutter *_cutter;
+    struct stat     st;
+    int             ret;
+    
+    if ((ret = sg_cutter_alloc(&_cutter, cutter_fd_read, NULL))) {
+        return ret;
+    }
+    
+    _cutter->opaque = _cutter;
+    _cutter->fd     = strcmp(filename, "-") ? open(filename, O_RDONLY | O_CLOEXEC) : dup(STDIN_FILENO);
+    
+    if (_cutter->fd < 0 || fstat(_cutter->fd, &st)) {
+        sg_cutter_close(_cutter);
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    if ((_cutter->regular = S_ISREG(st.st_mode))) {
+        posix_fadvise(_cutter->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    
+    *cutter = _cutter;
+    
+    return 0;
+}
+
+/**
+ * @brief skip leading ID3 tags and detect raw ADTS or MPEG audio, buffered input
+ *        stays in cutter either way
+ * @param cutter cutter
+ * @return 0 on success, SGERROR_UNSUPPORTED_FORMAT when input isn't raw audio,
+ *         other negative error code on failure
+ */
+int sg_cutter_probe(SegmenterCutter *cutter) {
+    size_t tag;
+    int    ret;
+    
+    if ((ret = cutter_need(cutter, kCutterTagSize))) {
+        return ret;
+    }
+    
+    // tag may be larger than buffer
+    while ((tag = sg_id3_size(cutter->buf + cutter->start, cutter->end - cutter->start))) {
+        while (tag > cutter->end - cutter->start && !cutter->eof) {
+            tag          -= cutter->end - cutter->start;
+            cutter->start = cutter->end;
+            
+            if ((ret = cutter_fill(cutter))) {
+                return ret;
+            }
+        }
+        
+        cutter->start += min(tag, cutter->end - cutter->start);
+        
+        if ((ret = cutter_need(cutter, kCutterTagSize))) {
+            return ret;
+        }
+    }
+    
+    // input at hand may be shorter than two frames, live one is read further
+    while (cutter_probe(cutter, AV_CODEC_ID_AAC) && cutter_probe(cutter, AV_CODEC_ID_MP3)) {
+        if (cutter->eof || cutter->end - cutter->start >= kCutterProbeSize) {
+            return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+        }
+        
+        if ((ret = cutter_need(cutter, cutter->end - cutter->start + 1))) {
+            return ret;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief AVIO read callback handing input of cutter to libavformat when probe found
+ *        other format, buffered data comes first (without leading ID3 tags, which
+ *        libavformat skips anyway), then the rest of input
+ * @param opaque cutter
+ */
+int sg_cutter_read(void *opaque, uint8_t *buf, int size) {
+    SegmenterCutter *cutter = (SegmenterCutter*)opaque;
+    size_t          length  = min((size_t)size, cutter->end - cutter->start);
+    
+    if (!length) {
+        return cutter->eof ? AVERROR_EOF : cutter->read(cutter->opaque, buf, size);
+    }
+    
+    memcpy(buf, cutter->buf + cutter->start, length);
+    cutter->start += length;
+    
+    return length;
+}
+
+/**
+ * @brief write frames up to the next segment boundary or the end of buffered data,
+ *        bytes which aren't frames are skipped
+ * @param cutter cutter
+ * @param context segmenter context initialized with segmenter_init_frames
+ * @return 1 when frames were written, 0 at the end of input, negative error code on failure
+ */
+int sg_cutter_write(SegmenterCutter *cutter, SegmenterContext *context) {
+    AudioFrame frame;
+    size_t     pos;
+    double     duration = 0;
+    int        cut      = 0;
+    int        ret;
+    
+    while (1) {
+        
+        if (cutter->end - cutter->start < kCutterMinData && !cutter->eof && (ret = cutter_fill(cutter))) {
+            return ret;
+        }
+        
+        for (pos = cutter->start; pos < cutter->end; pos += frame.size) {
+            
+            if (cutter->segment_duration >= context->target_duration) {
+                if (pos > cutter->start) {
+                    break;
+                }
+                
+                cutter->segment_duration = 0;
+                cut = 1;
+            }
+            
+            if (cutter_frame(cutter, pos, &frame)) {
+                
+                // header can't be parsed until more data is read
+                if (cutter->end - pos < SG_ADTS_HEADER_SIZE && !cutter->eof) {
+                    break;
+                }
+                
+                // junk between frames is dropped, written run has to be contiguous
+                if (pos > cutter->start) {
+                    break;
+                }
+                
+                frame.size       = 1;
+                cutter->start    = pos + 1;
+                cutter->skipped += 1;
+                continue;
+            }
+            
+            if (pos + frame.size > cutter->end) {
+                if (cutter->eof) {
+                    cutter->skipped += cutter->end - pos;
+                    cutter->end      = pos;
+                }
+                
+                break;
+            }
+            
+            // Xing, Info or VBRI header at the start of MP3 file carries no audio
+            if (!cutter->frames && pos == cutter->start && cutter->codec_id == AV_CODEC_ID_MP3 &&
+                sg_mp3_info_frame(cutter->buf + pos, frame.size, &frame)) {
+                cutter->start    = pos + frame.size;
+                cutter->skipped += frame.size;
+                continue;
+            }
+            
+            duration                 += (double)frame.samples / frame.sample_rate;
+            cutter->segment_duration += (double)frame.samples / frame.sample_rate;
+            cutter->frames++;
+        }
+        
+        if (pos > cutter->start) {
+            ret = segmenter_write_frames(context, cutter->buf + cutter->start, pos - cutter->start, duration, cut);
+            
+            cutter->start = pos;
+            
+            return ret ? ret : 1;
+        }
+        
+        if (cutter->eof && cutter->start == cutter->end) {
+            return 0;
+        }
+        
+        // only partial frame is buffered
+        if (cutter->start == 0 && cutter->end == cutter->buf_size) {
+            return SGERROR(SGERROR_INPUT);
+        }
+        
+        if ((ret = cutter_fill(cutter))) {
+            return ret;
+        }
+    }
+}
+
+/**
+ * @brief close cutter input
+ * @param cutter cutter
+ */
+void sg_cutter_close(SegmenterCutter *cutter) {
+    
+    if (cutter->fd >= 0) {
+        close(cutter->fd);
+    }
+    
+    sg_free(cutter->buf);
+    sg_free(cutter);
+}
@@ -0,0 +1,60 @@
+// cutter.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libavcodec/avcodec.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "segmenter.h"
+
+#ifndef __SG_CUTTER__
+#define __SG_CUTTER__
+
+/**
+ * Native cutter of raw ADTS and MPEG audio input. Every frame is a valid cut point, so
+ * input is only walked header by header: frames are copied to segmenter in large runs,
+ * segments are cut at frame boundaries and their durations are exact sums of frame samples.
+ * Input is pulled through read callback with AVIO semantics, when probe finds other format
+ * data it buffered is handed on to libavformat with sg_cutter_read, so pipes work too.
+ */
+typedef struct {
+    int             (*read)(void *opaque, uint8_t *buf, int size);
+    void            *opaque;
+    int             fd;
+    int             regular;
+    
+    enum AVCodecID  codec_id;
+    AudioFrame      format;
+    
+    uint8_t         *buf;
+    size_t          buf_size;
+    size_t          start, end;
+    int             eof;
+    
+    double          segment_duration;
+    
+    unsigned long   frames;
+    unsigned long   skipped;
+} SegmenterCutter;
+
+int  sg_cutter_alloc(SegmenterCutter **cutter, int (*read)(void *opaque, uint8_t *buf, int size), void *opaque);
+int  sg_cutter_open(SegmenterCutter **cutter, const char *filename);
+int  sg_cutter_probe(SegmenterCutter *cutter);
+int  sg_cutter_read(void *opaque, uint8_t *buf, int size);
+int  sg_cutter_write(SegmenterCutter *cutter, SegmenterContext *context);
+void sg_cutter_close(SegmenterCutter *cutter);
+
+#endif
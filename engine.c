@@ -0,0 +1,943 @@
+// engine.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "engine.h"
+#include "alloc.h"
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+static const size_t   kEngineRingSize   = 1024 * 1024;
+static const size_t   kEngineReadSize   = 65536;
+static const size_t   kEngineReserve    = 65536;
+static const size_t   kEngineProbeSize  = 262144;
+static const uint64_t kEngineDelay      = 200000000;
+static const uint64_t kEngineProbeDelay = 1000000000;
+static const int      kEngineSweep      = 100;
+static const size_t   kEngineStackSize  = 512 * 1024;
+static const int      kEngineBufferSize = 32768;
+static const int      kEngineBatch      = 64;
+static const int      kEngineReport     = 10;
+static const int      kEngineSocketBuffer = 4 * 1024 * 1024;
+
+static void channel_job(void *opaque);
+
+static size_t ring_available(SegmenterChannel *channel) {
+    return __atomic_load_n(&channel->write_pos, __ATOMIC_SEQ_CST) - __atomic_load_n(&channel->read_pos, __ATOMIC_SEQ_CST);
+}
+
+static size_t ring_space(SegmenterChannel *channel) {
+    return channel->ring_size - ring_available(channel);
+}
+
+static void engine_wake(SegmenterEngine *engine) {
+    uint64_t value = 1;
+    
+    if (write(engine->wake, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        sg_log(SG_LOG_ERROR, "wake engine loop, %s", strerror(errno));
+    }
+}
+
+/**
+ * @brief input has enough buffered data to be worth a job, low bitrate input would take
+ *        long to fill the threshold, so data buffered for longer than a delay is taken too
+ */
+static int channel_ready(SegmenterChannel *channel) {
+    int      probing = __atomic_load_n(&channel->state, __ATOMIC_SEQ_CST) == ChannelStateProbing;
+    size_t   available;
+    uint64_t since;
+    
+    if (__atomic_load_n(&channel->eof, __ATOMIC_SEQ_CST)) {
+        return 1;
+    }
+    
+    if (!(available = ring_available(channel))) {
+        return 0;
+    }
+    
+    if (available >= (probing ? kEngineProbeSize : kEngineReserve)) {
+        return 1;
+    }
+    
+    since = __atomic_load_n(&channel->pending_since, __ATOMIC_SEQ_CST);
+    
+    return since && sg_metrics_now() - since >= (probing ? kEngineProbeDelay : kEngineDelay);
+}
+
+static void channel_schedule(SegmenterEngine *engine, SegmenterChannel *channel) {
+    int expected = 0;
+    int ret;
+    
+    if (__atomic_load_n(&channel->state, __ATOMIC_SEQ_CST) >= ChannelStateDone || !channel_ready(channel)) {
+        return;
+    }
+    
+    if (!__atomic_compare_exchange_n(&channel->scheduled, &expected, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+    if ((ret = sg_pool_submit(engine->pool, channel->id, channel_job, channel))) {
+        sg_log(SG_LOG_ERROR, "schedule channel '%s', %s", channel->name, sg_strerror(SGUNERROR(ret)));
+        __atomic_store_n(&channel->scheduled, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * @brief stop polling input which ring buffer can't take, event loop side
+ */
+static void channel_pause(SegmenterEngine *engine, SegmenterChannel *channel) {
+    struct epoll_event event = { .events = 0, .data.ptr = channel };
+    
+    pthread_mutex_lock(&channel->lock);
+    
+    __atomic_store_n(&channel->paused, 1, __ATOMIC_SEQ_CST);
+    
+    // job may have drained ring before it could see the flag
+    if (ring_space(channel) >= kEngineReadSize) {
+        __atomic_store_n(&channel->paused, 0, __ATOMIC_SEQ_CST);
+    } else if (!channel->regular) {
+        epoll_ctl(engine->epoll, EPOLL_CTL_MOD, channel->fd, &event);
+    }
+    
+    pthread_mutex_unlock(&channel->lock);
+}
+
+/**
+ * @brief poll paused input again once job has freed enough space, worker side
+ */
+static void channel_resume(SegmenterChannel *channel) {
+    SegmenterEngine    *engine = (SegmenterEngine*)channel->engine;
+    struct epoll_event event   = { .events = EPOLLIN, .data.ptr = channel };
+    
+    if (!__atomic_load_n(&channel->paused, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    
+    pthread_mutex_lock(&channel->lock);
+    
+    if (channel->paused && ring_space(channel) >= kEngineReadSize) {
+        __atomic_store_n(&channel->paused, 0, __ATOMIC_SEQ_CST);
+        
+        if (channel->regular) {
+            engine_wake(engine);
+        } else {
+            epoll_ctl(engine->epoll, EPOLL_CTL_MOD, channel->fd, &event);
+        }
+    }
+    
+    pthread_mutex_unlock(&channel->lock);
+}
+
+/**
+ * @brief read input into ring buffer until it would block or ring is full
+ * @return 1 if input is still open, 0 at end of input, -1 on read error
+ */
+static int channel_fill(SegmenterChannel *channel) {
+    
+    while (ring_space(channel) >= kEngineReadSize) {
+        size_t       pos   = channel->write_pos & (channel->ring_size - 1);
+        size_t       space = ring_space(channel);
+        struct iovec iov[2];
+        ssize_t      ret;
+        
+        // datagrams must not be truncated at the end of ring, so read wraps around
+        iov[0].iov_base = channel->ring + pos;
+        iov[0].iov_len  = min(space, channel->ring_size - pos);
+        iov[1].iov_base = channel->ring;
+        iov[1].iov_len  = space - iov[0].iov_len;
+        
+        if ((ret = readv(channel->fd, iov, 2)) > 0) {
+            __atomic_store_n(&channel->write_pos, channel->write_pos + ret, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        
+        if (!ret && channel->datagram) {
+            continue;
+        }
+        
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        
+        return ret ? -1 : 0;
+    }
+    
+    return 1;
+}
+
+/**
+ * @brief note when data not yet taken by a job started to wait
+ */
+static void channel_pending(SegmenterChannel *channel) {
+    uint64_t expected = 0;
+    
+    if (ring_available(channel)) {
+        __atomic_compare_exchange_n(&channel->pending_since, &expected, sg_metrics_now(), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void channel_detach(SegmenterEngine *engine, SegmenterChannel *channel) {
+    
+    if (channel->fd < 0) {
+        return;
+    }
+    
+    if (!channel->regular) {
+        epoll_ctl(engine->epoll, EPOLL_CTL_DEL, channel->fd, NULL);
+    }
+    
+    close(channel->fd);
+    channel->fd = -1;
+}
+
+/**
+ * @brief close input, job finishes channel once it has taken what is left in ring
+ */
+static void channel_end(SegmenterEngine *engine, SegmenterChannel *channel) {
+    
+    channel_detach(engine, channel);
+    
+    __atomic_store_n(&channel->eof, 1, __ATOMIC_SEQ_CST);
+    
+    channel_schedule(engine, channel);
+}
+
+static void channel_input(SegmenterEngine *engine, SegmenterChannel *channel) {
+    int ret = channel_fill(channel);
+    
+    if (ret <= 0) {
+        if (ret < 0) {
+            sg_log(SG_LOG_ERROR, "channel '%s' input, %s", channel->name, strerror(errno));
+        }
+        
+        channel_end(engine, channel);
+        return;
+    }
+    
+    if (ring_space(channel) < kEngineReadSize) {
+        channel_pause(engine, channel);
+    }
+    
+    channel_pending(channel);
+    channel_schedule(engine, channel);
+}
+
+/**
+ * @brief suspend demuxing of channel and give worker back to pool
+ */
+static void channel_yield(SegmenterChannel *channel) {
+    swapcontext(&channel->context, &channel->caller);
+}
+
+/**
+ * @brief AVIO read callback, takes data from ring buffer, when event loop has not read
+ *        enough yet demuxer is suspended until a later job resumes it with more data
+ */
+static int channel_read(void *opaque, uint8_t *buf, int size) {
+    SegmenterChannel *channel = (SegmenterChannel*)opaque;
+    size_t           available, pos, length, first;
+    
+    while (!(available = ring_available(channel))) {
+        // eof is set after the last write, so ring is checked once more after it is seen
+        if (__atomic_load_n(&channel->eof, __ATOMIC_SEQ_CST)) {
+            if (!(available = ring_available(channel))) {
+                return AVERROR_EOF;
+            }
+            
+            break;
+        }
+        
+        channel_yield(channel);
+    }
+    
+    pos    = channel->read_pos & (channel->ring_size - 1);
+    length = min((size_t)size, available);
+    first  = min(length, channel->ring_size - pos);
+    
+    memcpy(buf, channel->ring + pos, first);
+    memcpy(buf + first, channel->ring, length - first);
+    
+    __atomic_store_n(&channel->read_pos, channel->read_pos + length, __ATOMIC_SEQ_CST);
+    
+    channel_resume(channel);
+    
+    return length;
+}
+
+static void channel_finish(SegmenterEngine *engine, SegmenterChannel *channel, ChannelState state) {
+    __atomic_store_n(&channel->state, state, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&engine->active, 1, __ATOMIC_SEQ_CST);
+    
+    engine_wake(engine);
+}
+
+/**
+ * @brief open libavformat demuxer of channel, when raw audio probe ran first it reads
+ *        through cutter which hands over what probe buffered
+ * @return 0 on success, negative error code on failure
+ */
+static int channel_demuxer(SegmenterEngine *engine, SegmenterChannel *channel) {
+    AVFormatContext *source;
+    uint8_t         *buf;
+    
+    if (!(buf = (uint8_t*)av_malloc(kEngineBufferSize))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (channel->cutter) {
+        channel->pb = avio_alloc_context(buf, kEngineBufferSize, 0, channel->cutter, sg_cutter_read, NULL, NULL);
+    } else {
+        channel->pb = avio_alloc_context(buf, kEngineBufferSize, 0, channel, channel_read, NULL, NULL);
+    }
+    
+    if (!channel->pb) {
+        av_free(buf);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (!(source = avformat_alloc_context())) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    // probing reads from ring too, keep it within what event loop has buffered
+    source->pb                   = channel->pb;
+    source->flags               |= AVFMT_FLAG_CUSTOM_IO;
+    source->probesize            = kEngineProbeSize;
+    source->max_analyze_duration = AV_TIME_BASE;
+    
+    if (avformat_open_input(&source, channel->input, NULL, NULL) < 0) {
+        sg_log(SG_LOG_ERROR, "channel '%s' can't open input '%s'", channel->name, channel->input);
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    channel->source = source;
+    
+    if (avformat_find_stream_info(source, NULL) < 0) {
+        sg_log(SG_LOG_WARNING, "channel '%s' can't load input info", channel->name);
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief probe buffered input and open segmenter output of channel, raw ADTS or
+ *        MPEG audio is cut natively when engine is configured to
+ * @return 0 on success, negative error code on failure
+ */
+static int channel_open(SegmenterEngine *engine, SegmenterChannel *channel) {
+    int ret = SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    
+    if (engine->config.cut_audio) {
+        if ((ret = sg_cutter_alloc(&channel->cutter, channel_read, channel))) {
+            return ret;
+        }
+        
+        ret = sg_cutter_probe(channel->cutter);
+    }
+    
+    if (ret == SGERROR(SGERROR_UNSUPPORTED_FORMAT)) {
+        ret = channel_demuxer(engine, channel);
+    }
+    
+    if (ret || (ret = engine->config.open_output(engine->config.opaque, channel)) || (ret = segmenter_open(channel->output))) {
+        return ret;
+    }
+    
+    __atomic_store_n(&channel->state, ChannelStateRunning, __ATOMIC_SEQ_CST);
+    
+    return 0;
+}
+
+/**
+ * @brief finish last segment and publish final index at end of input
+ */
+static int channel_close(SegmenterEngine *engine, SegmenterChannel *channel) {
+    int ret;
+    
+    if ((ret = segmenter_close(channel->output)) ||
+        (ret = segmenter_write_playlist(channel->output, engine->config.type, channel->base_url, engine->config.index_file))) {
+        return ret;
+    }
+    
+    channel_finish(engine, channel, ChannelStateDone);
+    
+    return 0;
+}
+
+/**
+ * @brief demux and segment one packet of channel, or one run of frames of raw audio
+ * @return 0 on success, negative error code on failure
+ */
+static int channel_process(SegmenterEngine *engine, SegmenterChannel *channel) {
+    SegmenterEngineConfig *config  = &engine->config;
+    SegmenterContext      *context = channel->output;
+    AVPacket              pkt;
+    int                   ret;
+    
+    if (channel->source) {
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        
+        if ((ret = av_read_frame(channel->source, &pkt)) < 0) {
+            if (ret != AVERROR_EOF) {
+                sg_log(SG_LOG_WARNING, "channel '%s' stopped on demuxer error", channel->name);
+            }
+            
+            return channel_close(engine, channel);
+        }
+        
+        ret = segmenter_write_pkt(context, channel->source, &pkt);
+        
+        av_packet_unref(&pkt);
+    } else if (!(ret = sg_cutter_write(channel->cutter, context))) {
+        return channel_close(engine, channel);
+    }
+    
+    if (ret < 0) {
+        return ret;
+    }
+    
+    if (channel->prev_index < context->segment_index) {
+        channel->prev_index = context->segment_index;
+        
+        if (config->playlist_entries && config->type == IndexTypeLive) {
+            segmenter_set_sequence(context, context->segment_index - config->playlist_entries, config->del);
+        }
+        
+        if ((ret = segmenter_write_playlist(context, config->type, channel->base_url, config->index_file))) {
+            return ret;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief memory held by buffers of channel, heap of the process is shared
+ *        so this counts what channel allocated rather than what it touched
+ */
+static size_t channel_memory(SegmenterChannel *channel) {
+    SegmenterContext *context = channel->output;
+    size_t           memory   = sizeof(SegmenterChannel) + sizeof(SegmenterContext) + channel->ring_size + kEngineStackSize;
+    
+    if (channel->pb) {
+        memory += channel->pb->buffer_size;
+    }
+    
+    if (channel->cutter) {
+        memory += channel->cutter->buf_size;
+    }
+    
+    memory += context->durations_size * sizeof(double) + context->buf_size;
+    
+    if (context->checksums) {
+        memory += context->durations_size * sizeof(SegmentChecksum);
+    }
+    
+    return memory;
+}
+
+/**
+ * @brief demuxing of channel, runs on channel stack until channel is done or failed,
+ *        worker is given back after every batch of packets and whenever input runs dry
+ */
+static void channel_main(unsigned int high, unsigned int low) {
+    SegmenterChannel *channel = (SegmenterChannel*)(uintptr_t)(((uint64_t)high << 32) | low);
+    SegmenterEngine  *engine  = (SegmenterEngine*)channel->engine;
+    int              ret, i;
+    
+    ret = channel_open(engine, channel);
+    
+    while (!ret && channel->state == ChannelStateRunning) {
+        // bounded batch keeps one busy channel from holding worker while others wait
+        for (i = 0; !ret && channel->state == ChannelStateRunning && i < kEngineBatch; i++) {
+            ret = channel_process(engine, channel);
+        }
+        
+        if (!ret && channel->state == ChannelStateRunning) {
+            channel_yield(channel);
+        }
+    }
+    
+    if (ret) {
+        sg_log(SG_LOG_ERROR, "channel '%s' failed, %s", channel->name, sg_strerror(SGUNERROR(ret)));
+        channel_finish(engine, channel, ChannelStateFailed);
+    }
+    
+    // finished channel is never resumed, job that ran it continues
+    setcontext(&channel->caller);
+}
+
+static void channel_job(void *opaque) {
+    SegmenterChannel *channel = (SegmenterChannel*)opaque;
+    SegmenterEngine  *engine  = (SegmenterEngine*)channel->engine;
+    struct timespec  start, end;
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    
+    if (!channel->started) {
+        if (getcontext(&channel->context)) {
+            sg_log(SG_LOG_ERROR, "channel '%s' failed, %s", channel->name, strerror(errno));
+            channel_finish(engine, channel, ChannelStateFailed);
+            return;
+        }
+        
+        channel->context.uc_stack.ss_sp   = (uint8_t*)channel->stack + sysconf(_SC_PAGESIZE);
+        channel->context.uc_stack.ss_size = kEngineStackSize;
+        channel->context.uc_link          = NULL;
+        
+        makecontext(&channel->context, (void (*)(void))channel_main, 2, (unsigned int)((uint64_t)(uintptr_t)channel >> 32),
+                    (unsigned int)(uintptr_t)channel);
+        channel->started = 1;
+    }
+    
+    // demuxing continues where it was suspended, possibly on another worker than before
+    swapcontext(&channel->caller, &channel->context);
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    
+    sg_metrics_add(&channel->output->metrics.cpu_time, (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+    sg_metrics_set(&channel->output->metrics.memory, channel_memory(channel));
+    
+    // what is left in ring waits from now on
+    __atomic_store_n(&channel->pending_since, 0, __ATOMIC_SEQ_CST);
+    channel_pending(channel);
+    
+    __atomic_store_n(&channel->scheduled, 0, __ATOMIC_SEQ_CST);
+    
+    channel_schedule(engine, channel);
+}
+
+/**
+ * @brief open udp://[host]:port for listening or connect to tcp://host:port
+ * @return socket, -1 on failure
+ */
+static int channel_socket(const char *address, int type) {
+    struct addrinfo hints, *addresses, *addr;
+    char            host[256], *port;
+    int             fd    = -1;
+    int             value = 1;
+    
+    snprintf(host, sizeof(host), "%s", address);
+    
+    if (!(port = strrchr(host, ':'))) {
+        return -1;
+    }
+    
+    *port++ = '\0';
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = type;
+    hints.ai_flags    = type == SOCK_DGRAM ? AI_PASSIVE : 0;
+    
+    if (getaddrinfo(*host ? host : NULL, port, &hints, &addresses)) {
+        return -1;
+    }
+    
+    for (addr = addresses; addr; addr = addr->ai_next) {
+        if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0) {
+            continue;
+        }
+        
+        if (type == SOCK_DGRAM) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &kEngineSocketBuffer, sizeof(kEngineSocketBuffer));
+            
+            if (!bind(fd, addr->ai_addr, addr->ai_addrlen)) {
+                break;
+            }
+        } else if (!connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+            break;
+        }
+        
+        close(fd);
+        fd = -1;
+    }
+    
+    freeaddrinfo(addresses);
+    
+    return fd;
+}
+
+/**
+ * @brief open non-blocking input descriptor of channel
+ * @return 0 on success, negative error code on failure
+ */
+static int channel_open_input(SegmenterChannel *channel) {
+    struct stat st;
+    
+    if (!strncmp(channel->input, "udp://", 6)) {
+        channel->fd       = channel_socket(channel->input + 6, SOCK_DGRAM);
+        channel->datagram = 1;
+    } else if (!strncmp(channel->input, "tcp://", 6)) {
+        channel->fd = channel_socket(channel->input + 6, SOCK_STREAM);
+    } else if (!strcmp(channel->input, "-")) {
+        channel->fd = dup(STDIN_FILENO);
+    } else if (!stat(channel->input, &st) && S_ISFIFO(st.st_mode)) {
+        // keeping write end open lets stream survive restart of its writer
+        channel->fd = open(channel->input, O_RDWR | O_NONBLOCK);
+    } else {
+        channel->fd = open(channel->input, O_RDONLY | O_NONBLOCK);
+    }
+    
+    if (channel->fd < 0 || fstat(channel->fd, &st)) {
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    fcntl(channel->fd, F_SETFL, fcntl(channel->fd, F_GETFL) | O_NONBLOCK);
+    fcntl(channel->fd, F_SETFD, FD_CLOEXEC);
+    
+    channel->regular = S_ISREG(st.st_mode);
+    
+    return 0;
+}
+
+/**
+ * @brief map demuxing stack of channel with guard page below it, pages are committed when touched
+ */
+static void* channel_stack(void) {
+    size_t page  = sysconf(_SC_PAGESIZE);
+    void   *stack = mmap(NULL, kEngineStackSize + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    
+    if (stack == MAP_FAILED) {
+        return NULL;
+    }
+    
+    if (mprotect(stack, page, PROT_NONE)) {
+        munmap(stack, kEngineStackSize + page);
+        return NULL;
+    }
+    
+    return stack;
+}
+
+static void channel_free(SegmenterEngine *engine, SegmenterChannel *channel) {
+    
+    channel_detach(engine, channel);
+    
+    if (channel->source) {
+        avformat_close_input(&channel->source);
+    }
+    
+    if (channel->pb) {
+        av_free(channel->pb->buffer);
+        av_free(channel->pb);
+    }
+    
+    if (channel->cutter) {
+        sg_cutter_close(channel->cutter);
+    }
+    
+    if (channel->output) {
+        segmenter_free_context(channel->output);
+    }
+    
+    pthread_mutex_destroy(&channel->lock);
+    
+    if (channel->stack) {
+        munmap(channel->stack, kEngineStackSize + sysconf(_SC_PAGESIZE));
+    }
+    
+    sg_free(channel->ring);
+    sg_free(channel->name);
+    sg_free(channel->input);
+    sg_free(channel->file_base);
+    sg_free(channel->base_url);
+    sg_free(channel);
+}
+
+/**
+ * @brief resident set size of the whole process
+ */
+static double engine_rss() {
+    FILE *file;
+    long pages = 0;
+    
+    if ((file = fopen("/proc/self/statm", "r"))) {
+        if (fscanf(file, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        
+        fclose(file);
+    }
+    
+    return (double)pages * sysconf(_SC_PAGESIZE);
+}
+
+static void engine_report(SegmenterEngine *engine, int level) {
+    static const char *states[] = { "probing", "running", "done", "failed" };
+    
+    double rss = engine_rss();
+    int    i;
+    
+    sg_log(SG_LOG_INFO, "channels: %d, active: %d, rss %.1f MB, %.2f MB per channel, pool steals %lu",
+           engine->channels_count, __atomic_load_n(&engine->active, __ATOMIC_SEQ_CST), rss / 1048576,
+           engine->channels_count ? rss / 1048576 / engine->channels_count : 0,
+           __atomic_load_n(&engine->pool->steals, __ATOMIC_RELAXED));
+    
+    for (i = 0; i < engine->channels_count; i++) {
+        SegmenterChannel *channel = engine->channels[i];
+        SegmenterMetrics *metrics = &channel->output->metrics;
+        double           memory;
+        
+        __atomic_load(&metrics->memory, &memory, __ATOMIC_RELAXED);
+        
+        sg_log(level, "channel '%s': %s, segments %lu, cpu %.3f s, memory %.1f KB",
+               channel->name, states[__atomic_load_n(&channel->state, __ATOMIC_SEQ_CST)],
+               (unsigned long)__atomic_load_n(&metrics->segments, __ATOMIC_RELAXED),
+               __atomic_load_n(&metrics->cpu_time, __ATOMIC_RELAXED) / 1e9, memory / 1024);
+    }
+}
+
+/**
+ * @brief allocate engine with its thread pool and event loop
+ * @param engine output engine
+ * @param config engine configuration, threads <= 0 means one per online cpu
+ * @return 0 on success, negative error code on failure
+ */
+int sg_engine_alloc(SegmenterEngine **engine, const SegmenterEngineConfig *config) {
+    SegmenterEngine    *_engine;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    int                ret;
+    
+    if (!(_engine = (SegmenterEngine*)sg_calloc(1, sizeof(SegmenterEngine)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _engine->config = *config;
+    _engine->epoll  = -1;
+    _engine->wake   = -1;
+    
+    if (_engine->config.threads <= 0) {
+        _engine->config.threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    }
+    
+    // ring is indexed by mask and must hold probe data with room for one more read
+    if (!_engine->config.ring_size) {
+        _engine->config.ring_size = kEngineRingSize;
+    }
+    
+    while (_engine->config.ring_size & (_engine->config.ring_size - 1) || _engine->config.ring_size < kEngineProbeSize + kEngineReadSize) {
+        _engine->config.ring_size = (_engine->config.ring_size | (_engine->config.ring_size - 1)) + 1;
+    }
+    
+    if ((ret = sg_pool_alloc(&_engine->pool, _engine->config.threads))) {
+        sg_engine_free(_engine);
+        return ret;
+    }
+    
+    if ((_engine->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (_engine->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        epoll_ctl(_engine->epoll, EPOLL_CTL_ADD, _engine->wake, &event)) {
+        sg_engine_free(_engine);
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    *engine = _engine;
+    
+    return 0;
+}
+
+/**
+ * @brief add channel to engine before it runs, input is a file or fifo path,
+ *        "-" for stdin, udp://[host]:port to listen on or tcp://host:port to connect to
+ * @param engine engine
+ * @param name channel name, used in logs and by open_output callback
+ * @param input channel input
+ * @param channel output channel, may be NULL
+ * @return 0 on success, negative error code on failure
+ */
+int sg_engine_add_channel(SegmenterEngine *engine, const char *name, const char *input, SegmenterChannel **channel) {
+    SegmenterChannel   *_channel;
+    SegmenterChannel   **channels;
+    struct epoll_event event;
+    int                ret;
+    
+    if (!(_channel = (SegmenterChannel*)sg_calloc(1, sizeof(SegmenterChannel)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    pthread_mutex_init(&_channel->lock, NULL);
+    
+    _channel->fd        = -1;
+    _channel->id        = engine->channels_count;
+    _channel->engine    = engine;
+    _channel->ring_size = engine->config.ring_size;
+    _channel->state     = ChannelStateProbing;
+    
+    if (!(_channel->name = sg_strdup(name)) || !(_channel->input = sg_strdup(input)) || !(_channel->ring = (uint8_t*)sg_malloc(_channel->ring_size)) ||
+        !(_channel->stack = channel_stack()) || !(channels = (SegmenterChannel**)sg_realloc(engine->channels, (engine->channels_count + 1) * sizeof(SegmenterChannel*)))) {
+        channel_free(engine, _channel);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    engine->channels = channels;
+    
+    if ((ret = segmenter_alloc_context(&_channel->output)) || (ret = channel_open_input(_channel))) {
+        channel_free(engine, _channel);
+        return ret;
+    }
+    
+    event.events   = EPOLLIN;
+    event.data.ptr = _channel;
+    
+    // regular files are always readable and can't be polled, event loop reads them on every pass
+    if (!_channel->regular && epoll_ctl(engine->epoll, EPOLL_CTL_ADD, _channel->fd, &event)) {
+        channel_free(engine, _channel);
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    engine->channels[engine->channels_count++] = _channel;
+    engine->active++;
+    
+    if (channel) {
+        *channel = _channel;
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief run event loop until every channel is done or failed
+ * @return 0 on success, negative error code on failure
+ */
+int sg_engine_run(SegmenterEngine *engine) {
+    struct epoll_event events[64];
+    time_t             report = time(NULL) + kEngineReport;
+    int                count, timeout, i;
+    
+    while (__atomic_load_n(&engine->active, __ATOMIC_SEQ_CST)) {
+        timeout = kEngineSweep;
+        
+        for (i = 0; i < engine->channels_count; i++) {
+            SegmenterChannel *channel = engine->channels[i];
+            
+            if (channel->regular && channel->fd >= 0 && !__atomic_load_n(&channel->paused, __ATOMIC_SEQ_CST)) {
+                channel_input(engine, channel);
+                timeout = 0;
+            } else if (channel->fd >= 0) {
+                // quiet input brings no events, data it left in ring is taken once it waited long enough
+                channel_pending(channel);
+                channel_schedule(engine, channel);
+            }
+        }
+        
+        if ((count = epoll_wait(engine->epoll, events, sizeof(events) / sizeof(events[0]), timeout)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            
+            sg_log(SG_LOG_ERROR, "wait for input, %s", strerror(errno));
+            return SGERROR(SGERROR_INPUT);
+        }
+        
+        for (i = 0; i < count; i++) {
+            uint64_t value;
+            
+            if (events[i].data.ptr) {
+                channel_input(engine, (SegmenterChannel*)events[i].data.ptr);
+            } else if (read(engine->wake, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                sg_log(SG_LOG_ERROR, "read engine wake event, %s", strerror(errno));
+            }
+        }
+        
+        // inputs of channels stopped by a job are closed here, only event loop touches descriptors
+        for (i = 0; i < engine->channels_count; i++) {
+            SegmenterChannel *channel = engine->channels[i];
+            
+            if (channel->fd < 0) {
+                continue;
+            }
+            
+            if (__atomic_load_n(&channel->state, __ATOMIC_SEQ_CST) >= ChannelStateDone) {
+                channel_detach(engine, channel);
+            } else if (engine->stop) {
+                channel_end(engine, channel);
+            }
+        }
+        
+        if (time(NULL) >= report) {
+            engine_report(engine, SG_LOG_VERBOSE);
+            report = time(NULL) + kEngineReport;
+        }
+    }
+    
+    engine_report(engine, SG_LOG_INFO);
+    
+    return 0;
+}
+
+/**
+ * @brief end all inputs, channels are closed with their final index and
+ *        sg_engine_run returns, safe to call from signal handler
+ */
+void sg_engine_stop(SegmenterEngine *engine) {
+    uint64_t value = 1;
+    
+    engine->stop = 1;
+    
+    if (write(engine->wake, &value, sizeof(value)) < 0) {
+        return;
+    }
+}
+
+/**
+ * @brief stop pool and free engine with all its channels
+ */
+void sg_engine_free(SegmenterEngine *engine) {
+    int i;
+    
+    if (engine->pool) {
+        sg_pool_free(engine->pool);
+    }
+    
+    for (i = 0; i < engine->channels_count; i++) {
+        channel_free(engine, engine->channels[i]);
+    }
+    
+    if (engine->epoll >= 0) {
+        close(engine->epoll);
+    }
+    
+    if (engine->wake >= 0) {
+        close(engine->wake);
+    }
+    
+    sg_free(engine->channels);
+    sg_free(engine);
+}
@@ -0,0 +1,118 @@
+// engine.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libavformat/avformat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "cutter.h"
+#include "pool.h"
+#include "segmenter.h"
+
+#ifndef __SG_ENGINE__
+#define __SG_ENGINE__
+
+typedef enum {
+    ChannelStateProbing,
+    ChannelStateRunning,
+    ChannelStateDone,
+    ChannelStateFailed
+} ChannelState;
+
+/**
+ * One live stream hosted by engine. Event loop reads input into ring buffer,
+ * pool jobs demux it and drive segmenter context. At most one job of a channel
+ * runs at a time, so context needs no further locking. Demuxing runs on its own
+ * stack: when ring runs dry it is suspended and the job returns to the pool,
+ * next job resumes it where it stopped.
+ */
+typedef struct {
+    char             *name;
+    char             *input;
+    int              id;
+    
+    int              fd;
+    int              regular;
+    int              datagram;
+    int              paused;
+    
+    uint8_t          *ring;
+    size_t           ring_size;
+    size_t           read_pos, write_pos;
+    uint64_t         pending_since;
+    int              eof;
+    pthread_mutex_t  lock;
+    
+    ucontext_t       context, caller;
+    void             *stack;
+    int              started;
+    
+    AVFormatContext  *source;
+    AVIOContext      *pb;
+    SegmenterCutter  *cutter;
+    SegmenterContext *output;
+    char             *file_base;
+    char             *base_url;
+    
+    ChannelState     state;
+    int              scheduled;
+    unsigned int     prev_index;
+    
+    void             *engine;
+} SegmenterChannel;
+
+typedef struct {
+    int         threads;
+    size_t      ring_size;
+    
+    IndexType   type;
+    int         playlist_entries;
+    int         del;
+    char        *index_file;
+    int         cut_audio;
+    
+    /**
+     * Called from pool worker once input is probed, sets up sink and options of
+     * channel->output, calls segmenter_init (segmenter_init_frames with channel->cutter
+     * when cut_audio found raw audio, channel->source is NULL then) and sets
+     * channel->file_base and channel->base_url (malloc'ed, freed with channel).
+     * Returns 0 on success or negative error code on failure.
+     */
+    int         (*open_output)(void *opaque, SegmenterChannel *channel);
+    void        *opaque;
+} SegmenterEngineConfig;
+
+typedef struct {
+    SegmenterEngineConfig config;
+    
+    SegmenterChannel **channels;
+    int              channels_count;
+    int              active;
+    
+    SegmenterPool    *pool;
+    int              epoll;
+    int              wake;
+    volatile int     stop;
+} SegmenterEngine;
+
+int  sg_engine_alloc(SegmenterEngine **engine, const SegmenterEngineConfig *config);
+int  sg_engine_add_channel(SegmenterEngine *engine, const char *name, const char *input, SegmenterChannel **channel);
+int  sg_engine_run(SegmenterEngine *engine);
+void sg_engine_stop(SegmenterEngine *engine);
+void sg_engine_free(SegmenterEngine *engine);
+
+#endif
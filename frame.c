@@ -0,0 +1,147 @@
+// frame.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "frame.h"
+
+#include <string.h>
+
+static const int kAdtsSampleRates[16] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0, 0, 0
+};
+
+static const int kMp3SampleRates[4][3] = {
+    { 11025, 12000,  8000 },    // MPEG 2.5
+    {     0,     0,     0 },
+    { 22050, 24000, 16000 },    // MPEG 2
+    { 44100, 48000, 32000 }     // MPEG 1
+};
+
+// kbit/s by [lsf][layer - 1][index], lsf is set for MPEG 2 and 2.5
+static const int kMp3Bitrates[2][3][15] = {
+    {
+        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+        { 0, 32, 48, 56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320, 384 },
+        { 0, 32, 40, 48,  56,  64,  80,  96, 112, 128, 160, 192, 224, 256, 320 }
+    },
+    {
+        { 0, 32, 48, 56,  64,  80,  96, 112, 128, 144, 160, 176, 192, 224, 256 },
+        { 0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 },
+        { 0,  8, 16, 24,  32,  40,  48,  56,  64,  80,  96, 112, 128, 144, 160 }
+    }
+};
+
+/**
+ * @brief parse ADTS frame header
+ * @param buf data starting at frame
+ * @param size available data
+ * @param frame output frame description
+ * @return 0 on success, negative value if data doesn't start with valid header
+ */
+int sg_adts_frame(const uint8_t *buf, size_t size, AudioFrame *frame) {
+    
+    if (size < SG_ADTS_HEADER_SIZE || buf[0] != 0xff || (buf[1] & 0xf6) != 0xf0) {
+        return -1;
+    }
+    
+    frame->sample_rate = kAdtsSampleRates[(buf[2] >> 2) & 0x0f];
+    frame->channels    = ((buf[2] & 0x01) << 2) | (buf[3] >> 6);
+    frame->size        = ((buf[3] & 0x03) << 11) | (buf[4] << 3) | (buf[5] >> 5);
+    frame->samples     = 1024 * ((buf[6] & 0x03) + 1);
+    
+    return frame->sample_rate && frame->size >= SG_ADTS_HEADER_SIZE ? 0 : -1;
+}
+
+/**
+ * @brief parse MPEG audio (layer I, II, III) frame header, free format is not supported
+ * @param buf data starting at frame
+ * @param size available data
+ * @param frame output frame description
+ * @return 0 on success, negative value if data doesn't start with valid header
+ */
+int sg_mp3_frame(const uint8_t *buf, size_t size, AudioFrame *frame) {
+    int version, layer, lsf, bitrate, padding;
+    
+    if (size < SG_MP3_HEADER_SIZE || buf[0] != 0xff || (buf[1] & 0xe0) != 0xe0) {
+        return -1;
+    }
+    
+    version = (buf[1] >> 3) & 0x03;
+    layer   = 4 - ((buf[1] >> 1) & 0x03);
+    
+    if (version == 1 || layer == 4 || (buf[2] >> 4) == 0x0f || ((buf[2] >> 2) & 0x03) == 0x03) {
+        return -1;
+    }
+    
+    lsf     = version != 3;
+    bitrate = kMp3Bitrates[lsf][layer - 1][buf[2] >> 4] * 1000;
+    padding = (buf[2] >> 1) & 0x01;
+    
+    if (!bitrate) {
+        return -1;
+    }
+    
+    frame->sample_rate = kMp3SampleRates[version][(buf[2] >> 2) & 0x03];
+    frame->channels    = (buf[3] >> 6) == 0x03 ? 1 : 2;
+    
+    switch (layer) {
+        case 1:
+            frame->samples = 384;
+            frame->size    = (12 * bitrate / frame->sample_rate + padding) * 4;
+            break;
+        case 2:
+            frame->samples = 1152;
+            frame->size    = 144 * bitrate / frame->sample_rate + padding;
+            break;
+        default:
+            frame->samples = lsf ? 576 : 1152;
+            frame->size    = (lsf ? 72 : 144) * bitrate / frame->sample_rate + padding;
+            break;
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief check whether MPEG audio frame is Xing, Info or VBRI header rather than audio
+ * @param buf data starting at frame
+ * @param size available data
+ * @param frame parsed frame header
+ * @return 1 for information frame, 0 otherwise
+ */
+int sg_mp3_info_frame(const uint8_t *buf, size_t size, const AudioFrame *frame) {
+    int lsf    = (buf[1] & 0x08) == 0;
+    int offset = SG_MP3_HEADER_SIZE + (lsf ? (frame->channels == 1 ? 9 : 17) : (frame->channels == 1 ? 17 : 32));
+    
+    if (size >= offset + 4 && (!memcmp(buf + offset, "Xing", 4) || !memcmp(buf + offset, "Info", 4))) {
+        return 1;
+    }
+    
+    return size >= 40 && !memcmp(buf + 36, "VBRI", 4);
+}
+
+/**
+ * @brief size of ID3v2 tag at the start of data
+ * @return tag size including header and footer, 0 if there is no tag
+ */
+size_t sg_id3_size(const uint8_t *buf, size_t size) {
+    
+    if (size < 10 || memcmp(buf, "ID3", 3) || ((buf[6] | buf[7] | buf[8] | buf[9]) & 0x80)) {
+        return 0;
+    }
+    
+    return 10 + ((buf[6] << 21) | (buf[7] << 14) | (buf[8] << 7) | buf[9]) + (buf[5] & 0x10 ? 10 : 0);
+}
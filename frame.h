@@ -0,0 +1,41 @@
+// frame.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __SG_FRAME__
+#define __SG_FRAME__
+
+#define SG_ADTS_HEADER_SIZE 7
+#define SG_MP3_HEADER_SIZE  4
+
+/**
+ * Elementary audio frame described by its header.
+ */
+typedef struct {
+    int size;
+    int samples;
+    int sample_rate;
+    int channels;
+} AudioFrame;
+
+int    sg_adts_frame(const uint8_t *buf, size_t size, AudioFrame *frame);
+int    sg_mp3_frame(const uint8_t *buf, size_t size, AudioFrame *frame);
+int    sg_mp3_info_frame(const uint8_t *buf, size_t size, const AudioFrame *frame);
+size_t sg_id3_size(const uint8_t *buf, size_t size);
+
+#endif
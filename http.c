@@ -0,0 +1,570 @@
+// http.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "http.h"
+#include "alloc.h"
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define HTTP_BUFFER_SIZE 4096
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+static const char* kHttpScheme      = "http://";
+static const char* kHttpDefaultPort = "80";
+
+static const int   kHttpRetries     = 3;
+static const int   kHttpRetryDelay  = 100000;
+static const int   kHttpTimeout     = 10;
+static const size_t kHttpMaxRetained = 64 * 1024 * 1024;
+
+typedef struct {
+    int     fd;
+    int     busy;
+} HttpConnection;
+
+typedef struct {
+    int     fd;
+    char    *buf;
+    size_t  pos, size;
+} HttpReader;
+
+typedef struct {
+    char           *host;
+    char           *port;
+    char           *path;
+    
+    HttpConnection *connections;
+    int            nb_connections;
+    
+    HttpConnection *segment;
+    uint8_t        *data;
+    size_t         data_size, data_capacity;
+    int            overflow;
+} HttpSink;
+
+/**
+ * @brief check whether output location is http url
+ */
+int sg_is_http_url(const char *url) {
+    return !strncmp(url, kHttpScheme, strlen(kHttpScheme));
+}
+
+static int send_all(int fd, const void *buf, size_t size) {
+    const char *data = (const char*)buf;
+    ssize_t    length;
+    
+    while (size) {
+        if ((length = send(fd, data, size, MSG_NOSIGNAL)) <= 0) {
+            return -1;
+        }
+        
+        data += length;
+        size -= length;
+    }
+    
+    return 0;
+}
+
+static int http_connect(HttpSink *sink) {
+    struct addrinfo hints, *result, *addr;
+    struct timeval  timeout = { kHttpTimeout, 0 };
+    int             fd = -1, one = 1;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    if (getaddrinfo(sink->host, sink->port, &hints, &result)) {
+        return -1;
+    }
+    
+    for (addr = result; addr; addr = addr->ai_next) {
+        if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0) {
+            continue;
+        }
+        
+        // bounded send timeout turns slow ingest into back-pressure instead of endless stall
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        
+        if (!connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+            break;
+        }
+        
+        close(fd);
+        fd = -1;
+    }
+    
+    freeaddrinfo(result);
+    
+    return fd;
+}
+
+/**
+ * @brief take idle connection from pool, connecting when there is no open one
+ */
+static HttpConnection* http_acquire(HttpSink *sink) {
+    HttpConnection *idle = NULL;
+    int            i;
+    
+    for (i = 0; i < sink->nb_connections; i++) {
+        HttpConnection *connection = &sink->connections[i];
+        
+        if (connection->busy) {
+            continue;
+        }
+        
+        if (connection->fd >= 0) {
+            idle = connection;
+            break;
+        }
+        
+        if (!idle) {
+            idle = connection;
+        }
+    }
+    
+    if (!idle) {
+        return NULL;
+    }
+    
+    if (idle->fd < 0 && (idle->fd = http_connect(sink)) < 0) {
+        sg_log(SG_LOG_WARNING, "can't connect to %s:%s", sink->host, sink->port);
+        return NULL;
+    }
+    
+    idle->busy = 1;
+    
+    return idle;
+}
+
+static void http_release(HttpConnection *connection, int keep_alive) {
+    
+    if (!keep_alive && connection->fd >= 0) {
+        close(connection->fd);
+        connection->fd = -1;
+    }
+    
+    connection->busy = 0;
+}
+
+static int http_send_head(HttpSink *sink, HttpConnection *connection, const char *method, const char *name, ssize_t size) {
+    char head[1024];
+    int  length;
+    
+    if (size < 0) {
+        length = snprintf(head, sizeof(head), "%s %s/%s HTTP/1.1\r\nHost: %s:%s\r\nTransfer-Encoding: chunked\r\n\r\n",
+                          method, sink->path, name, sink->host, sink->port);
+    } else {
+        length = snprintf(head, sizeof(head), "%s %s/%s HTTP/1.1\r\nHost: %s:%s\r\nContent-Length: %zd\r\n\r\n",
+                          method, sink->path, name, sink->host, sink->port, size);
+    }
+    
+    if (length >= sizeof(head)) {
+        return -1;
+    }
+    
+    return send_all(connection->fd, head, length);
+}
+
+static int http_send_chunk(HttpConnection *connection, const uint8_t *buf, size_t size) {
+    char         head[32];
+    struct iovec iov[3];
+    
+    iov[0].iov_base = head;
+    iov[0].iov_len  = snprintf(head, sizeof(head), "%zx\r\n", size);
+    iov[1].iov_base = (void*)buf;
+    iov[1].iov_len  = size;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len  = 2;
+    
+    size_t total = iov[0].iov_len + size + 2;
+    
+    ssize_t length = writev(connection->fd, iov, 3);
+    
+    if (length < 0) {
+        return -1;
+    }
+    
+    if (length < total) {
+        int i;
+        
+        for (i = 0; i < 3; i++) {
+            if (length >= iov[i].iov_len) {
+                length -= iov[i].iov_len;
+                continue;
+            }
+            
+            if (send_all(connection->fd, (char*)iov[i].iov_base + length, iov[i].iov_len - length)) {
+                return -1;
+            }
+            
+            length = 0;
+        }
+    }
+    
+    return 0;
+}
+
+static int reader_getc(HttpReader *reader) {
+    
+    if (reader->pos == reader->size) {
+        ssize_t length = recv(reader->fd, reader->buf, HTTP_BUFFER_SIZE, 0);
+        
+        if (length <= 0) {
+            return -1;
+        }
+        
+        reader->pos  = 0;
+        reader->size = length;
+    }
+    
+    return (unsigned char)reader->buf[reader->pos++];
+}
+
+static int reader_line(HttpReader *reader, char *line, size_t size) {
+    size_t length = 0;
+    int    c;
+    
+    while ((c = reader_getc(reader)) >= 0 && c != '\n') {
+        if (length + 1 < size && c != '\r') {
+            line[length++] = c;
+        }
+    }
+    
+    line[length] = '\0';
+    
+    return c < 0 ? -1 : 0;
+}
+
+static int reader_skip(HttpReader *reader, size_t size) {
+    
+    while (size--) {
+        if (reader_getc(reader) < 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief read response status and drain its body so the connection can be reused
+ * @return http status code, negative on failure
+ */
+static int http_read_response(HttpConnection *connection, int *keep_alive) {
+    char       buf[HTTP_BUFFER_SIZE], line[1024];
+    HttpReader reader = { connection->fd, buf, 0, 0 };
+    int        status, chunked = 0;
+    long long  length = 0;
+    
+    *keep_alive = 1;
+    
+    if (reader_line(&reader, line, sizeof(line)) || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1) {
+        *keep_alive = 0;
+        return -1;
+    }
+    
+    while (!reader_line(&reader, line, sizeof(line)) && line[0]) {
+        if (!strncasecmp(line, "Content-Length:", 15)) {
+            length = atoll(line + 15);
+        } else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line + 18, "chunked")) {
+            chunked = 1;
+        } else if (!strncasecmp(line, "Connection:", 11) && strstr(line + 11, "close")) {
+            *keep_alive = 0;
+        }
+    }
+    
+    if (chunked) {
+        do {
+            if (reader_line(&reader, line, sizeof(line))) {
+                *keep_alive = 0;
+                break;
+            }
+            
+            length = strtoll(line, NULL, 16);
+            
+            if (reader_skip(&reader, length) || reader_line(&reader, line, sizeof(line))) {
+                *keep_alive = 0;
+                break;
+            }
+        } while (length);
+    } else if (reader_skip(&reader, length)) {
+        *keep_alive = 0;
+    }
+    
+    // response must not leave unread bytes behind on persistent connection
+    if (reader.pos != reader.size) {
+        *keep_alive = 0;
+    }
+    
+    return status;
+}
+
+static int http_success(int status) {
+    return status >= 200 && status < 300;
+}
+
+/**
+ * @brief perform request with whole body, retrying on failures
+ * @return 0 on success, negative error code on failure
+ */
+static int http_request(HttpSink *sink, const char *method, const char *name, const uint8_t *buf, size_t size) {
+    HttpConnection *connection;
+    int            attempt, status = -1, keep_alive;
+    
+    for (attempt = 0; attempt <= kHttpRetries; attempt++) {
+        
+        if (attempt) {
+            usleep(kHttpRetryDelay << (attempt - 1));
+        }
+        
+        if (!(connection = http_acquire(sink))) {
+            continue;
+        }
+        
+        if (http_send_head(sink, connection, method, name, size) || (size && send_all(connection->fd, buf, size))) {
+            http_release(connection, 0);
+            continue;
+        }
+        
+        status = http_read_response(connection, &keep_alive);
+        http_release(connection, keep_alive);
+        
+        if (http_success(status) || (status == 404 && !strcmp(method, "DELETE"))) {
+            return 0;
+        }
+        
+        if (status >= 400 && status < 500) {
+            break;
+        }
+    }
+    
+    sg_log(SG_LOG_ERROR, "%s %s/%s failed, status %d", method, sink->path, name, status);
+    
+    return SGERROR(SGERROR_NETWORK);
+}
+
+static void http_abort_segment(HttpSink *sink) {
+    
+    if (sink->segment) {
+        http_release(sink->segment, 0);
+        sink->segment = NULL;
+    }
+}
+
+static int http_sink_open_segment(void *opaque, const char *name, unsigned int index) {
+    HttpSink *sink = (HttpSink*)opaque;
+    
+    sink->data_size = 0;
+    sink->overflow  = 0;
+    
+    if (!(sink->segment = http_acquire(sink))) {
+        return 0;
+    }
+    
+    if (http_send_head(sink, sink->segment, "PUT", name, -1)) {
+        http_abort_segment(sink);
+    }
+    
+    return 0;
+}
+
+static int http_sink_write_segment(void *opaque, const uint8_t *buf, size_t size) {
+    HttpSink *sink = (HttpSink*)opaque;
+    
+    // copy of larger segment is dropped, such segment can't be sent again when streaming fails
+    if (sink->data_size + size > kHttpMaxRetained) {
+        sink->overflow  = 1;
+        sink->data_size = 0;
+    }
+    
+    if (!sink->overflow && sink->data_size + size > sink->data_capacity) {
+        size_t  capacity = min(max(sink->data_capacity * 2, sink->data_size + size), kHttpMaxRetained);
+        uint8_t *data    = (uint8_t*)sg_realloc(sink->data, capacity);
+        
+        if (!data) {
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        sink->data          = data;
+        sink->data_capacity = capacity;
+    }
+    
+    // segment copy is kept until server confirms upload to be able to retry it
+    if (!sink->overflow) {
+        memcpy(sink->data + sink->data_size, buf, size);
+        sink->data_size += size;
+    }
+    
+    if (sink->segment && size && http_send_chunk(sink->segment, buf, size)) {
+        http_abort_segment(sink);
+    }
+    
+    return 0;
+}
+
+static int http_sink_close_segment(void *opaque, const char *name, unsigned int index, double duration, size_t size) {
+    HttpSink *sink = (HttpSink*)opaque;
+    int      status, keep_alive;
+    
+    if (sink->segment) {
+        if (!send_all(sink->segment->fd, "0\r\n\r\n", 5)) {
+            status = http_read_response(sink->segment, &keep_alive);
+            
+            http_release(sink->segment, keep_alive);
+            sink->segment = NULL;
+            
+            if (http_success(status)) {
+                return 0;
+            }
+        }
+        
+        http_abort_segment(sink);
+    }
+    
+    if (sink->overflow) {
+        sg_log(SG_LOG_ERROR, "PUT %s/%s failed, segment is larger than %zu bytes kept for retry", sink->path, name, kHttpMaxRetained);
+        return SGERROR(SGERROR_NETWORK);
+    }
+    
+    return http_request(sink, "PUT", name, sink->data, sink->data_size);
+}
+
+static int http_sink_remove_segment(void *opaque, const char *name, unsigned int index) {
+    return http_request((HttpSink*)opaque, "DELETE", name, NULL, 0);
+}
+
+static int http_sink_write_playlist(void *opaque, const char *name, const uint8_t *buf, size_t size) {
+    return http_request((HttpSink*)opaque, "PUT", name, buf, size);
+}
+
+static void http_sink_free(void *opaque) {
+    HttpSink *sink = (HttpSink*)opaque;
+    int      i;
+    
+    for (i = 0; sink->connections && i < sink->nb_connections; i++) {
+        if (sink->connections[i].fd >= 0) {
+            close(sink->connections[i].fd);
+        }
+    }
+    
+    sg_free(sink->connections);
+    sg_free(sink->host);
+    sg_free(sink->port);
+    sg_free(sink->path);
+    sg_free(sink->data);
+    sg_free(sink);
+}
+
+/**
+ * @brief split http://host[:port][/path] into sink fields
+ */
+static int http_parse_url(HttpSink *sink, const char *url) {
+    const char *host = url + strlen(kHttpScheme), *path, *port;
+    size_t     length;
+    
+    path = strchr(host, '/');
+    
+    if (!path) {
+        path = host + strlen(host);
+    }
+    
+    port = memchr(host, ':', path - host);
+    
+    sink->host = sg_strndup(host, (port ? port : path) - host);
+    sink->port = port ? sg_strndup(port + 1, path - port - 1) : sg_strdup(kHttpDefaultPort);
+    
+    length = strlen(path);
+    
+    while (length && path[length - 1] == '/') {
+        length--;
+    }
+    
+    sink->path = sg_strndup(path, length);
+    
+    if (!sink->host || !sink->port || !sink->path) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    return sink->host[0] ? 0 : SGERROR(SGERROR_NETWORK);
+}
+
+/**
+ * @brief initialize sink uploading segments and playlists with HTTP PUT,
+ *        segments are streamed with chunked transfer encoding while they are muxed
+ * @param sink sink to initialize
+ * @param url base url, http://host[:port][/path]
+ * @param connections number of persistent connections, SG_HTTP_MIN_CONNECTIONS to SG_HTTP_MAX_CONNECTIONS
+ * @return 0 on success, negative error code on failure
+ */
+int sg_http_sink_init(SegmenterSink *sink, const char *url, int connections) {
+    HttpSink *_sink;
+    int      i, ret;
+    
+    if (connections < SG_HTTP_MIN_CONNECTIONS || connections > SG_HTTP_MAX_CONNECTIONS) {
+        return SGERROR(SGERROR_INVALID);
+    }
+    
+    if (!(_sink = (HttpSink*)sg_calloc(1, sizeof(HttpSink)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _sink->nb_connections = connections;
+    
+    if (!(_sink->connections = (HttpConnection*)sg_malloc(_sink->nb_connections * sizeof(HttpConnection)))) {
+        http_sink_free(_sink);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    for (i = 0; i < _sink->nb_connections; i++) {
+        _sink->connections[i].fd   = -1;
+        _sink->connections[i].busy = 0;
+    }
+    
+    if ((ret = http_parse_url(_sink, url))) {
+        http_sink_free(_sink);
+        return ret;
+    }
+    
+    sink->opaque         = _sink;
+    sink->open_segment   = http_sink_open_segment;
+    sink->write_segment  = http_sink_write_segment;
+    sink->close_segment  = http_sink_close_segment;
+    sink->remove_segment = http_sink_remove_segment;
+    sink->write_playlist = http_sink_write_playlist;
+    sink->free           = http_sink_free;
+    sink->create_dir     = NULL;
+    sink->remove_dir     = NULL;
+    
+    return 0;
+}
@@ -0,0 +1,29 @@
+// http.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "segmenter.h"
+
+#ifndef __SG_HTTP__
+#define __SG_HTTP__
+
+// one connection streams segment while others upload index and keys
+#define SG_HTTP_MIN_CONNECTIONS 2
+#define SG_HTTP_MAX_CONNECTIONS 64
+
+int sg_is_http_url(const char *url);
+int sg_http_sink_init(SegmenterSink *sink, const char *url, int connections);
+
+#endif
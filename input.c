@@ -0,0 +1,269 @@
+// input.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "input.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+static const int    kInputBufferSize = 262144;
+static const size_t kInputReadahead  = 8 * 1024 * 1024;
+
+typedef struct {
+    int      fd;
+    
+    uint8_t  *data;
+    size_t   size;
+    size_t   pos;
+    
+    size_t   readahead;
+} MappedInput;
+
+/**
+ * @brief ask kernel to start reading next window before demuxer gets there
+ */
+static void input_readahead(MappedInput *input) {
+    
+    while (input->readahead < input->size && input->readahead < input->pos + kInputReadahead) {
+        size_t length = min(kInputReadahead, input->size - input->readahead);
+        
+        madvise(input->data + input->readahead, length, MADV_WILLNEED);
+        input->readahead += length;
+    }
+}
+
+static int input_read(void *opaque, uint8_t *buf, int size) {
+    MappedInput *input  = (MappedInput*)opaque;
+    size_t      length  = min((size_t)size, input->size - input->pos);
+    
+    if (!length) {
+        return AVERROR_EOF;
+    }
+    
+    memcpy(buf, input->data + input->pos, length);
+    input->pos += length;
+    
+    input_readahead(input);
+    
+    return length;
+}
+
+static int64_t input_seek(void *opaque, int64_t offset, int whence) {
+    MappedInput *input = (MappedInput*)opaque;
+    int64_t     pos;
+    
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return input->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = input->pos + offset;
+            break;
+        case SEEK_END:
+            pos = input->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    
+    if (pos < 0 || pos > input->size) {
+        return AVERROR(EINVAL);
+    }
+    
+    input->pos       = pos;
+    input->readahead = max(input->readahead, input->pos);
+    
+    input_readahead(input);
+    
+    return pos;
+}
+
+static void input_unmap(MappedInput *input) {
+    
+    if (input->data) {
+        munmap(input->data, input->size);
+    }
+    
+    close(input->fd);
+    sg_free(input);
+}
+
+/**
+ * @brief map regular file into memory
+ * @return mapped input, NULL if file can't be mapped
+ */
+static MappedInput* input_map(const char *filename) {
+    MappedInput *input;
+    struct stat st;
+    int         fd;
+    
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        return NULL;
+    }
+    
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size || !(input = (MappedInput*)sg_calloc(1, sizeof(MappedInput)))) {
+        close(fd);
+        return NULL;
+    }
+    
+    input->fd   = fd;
+    input->size = st.st_size;
+    input->data = (uint8_t*)mmap(NULL, input->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (input->data == MAP_FAILED) {
+        input->data = NULL;
+        input_unmap(input);
+        return NULL;
+    }
+    
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise(input->data, input->size, MADV_SEQUENTIAL);
+    
+    input_readahead(input);
+    
+    return input;
+}
+
+/**
+ * @brief open media input, regular files are read through memory mapping with
+ *        sequential readahead, other inputs (pipes, urls) use libavformat protocols
+ * @param context output format context
+ * @param filename input file name or url
+ * @param flags InputFlags
+ * @return 0 on success, negative AVERROR code on failure
+ */
+int sg_input_open(AVFormatContext **context, const char *filename, int flags) {
+    MappedInput     *input = NULL;
+    AVFormatContext *_context;
+    AVIOContext     *pb;
+    uint8_t         *buf;
+    int             ret;
+    
+    if (!(flags & InputFlagNoMap)) {
+        input = input_map(filename);
+    }
+    
+    if (!input) {
+        return avformat_open_input(context, filename, NULL, NULL);
+    }
+    
+    if (!(_context = avformat_alloc_context()) || !(buf = (uint8_t*)av_malloc(kInputBufferSize))) {
+        avformat_free_context(_context);
+        input_unmap(input);
+        return AVERROR(ENOMEM);
+    }
+    
+    if (!(pb = avio_alloc_context(buf, kInputBufferSize, 0, input, input_read, NULL, input_seek))) {
+        av_free(buf);
+        avformat_free_context(_context);
+        input_unmap(input);
+        return AVERROR(ENOMEM);
+    }
+    
+    _context->pb     = pb;
+    _context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    
+    if ((ret = avformat_open_input(&_context, filename, NULL, NULL)) < 0) {
+        av_free(pb->buffer);
+        av_free(pb);
+        input_unmap(input);
+        return ret;
+    }
+    
+    *context = _context;
+    
+    return 0;
+}
+
+/**
+ * @brief open media input read through callback, such as data already read from pipe
+ *        by probe followed by the rest of it
+ * @param context output format context
+ * @param filename input name, for format guess and messages
+ * @param read AVIO read callback
+ * @param opaque callback argument, stays owned by caller
+ * @return 0 on success, negative AVERROR code on failure
+ */
+int sg_input_open_read(AVFormatContext **context, const char *filename, int (*read)(void *opaque, uint8_t *buf, int size), void *opaque) {
+    AVFormatContext *_context;
+    AVIOContext     *pb;
+    uint8_t         *buf;
+    int             ret;
+    
+    if (!(_context = avformat_alloc_context()) || !(buf = (uint8_t*)av_malloc(kInputBufferSize))) {
+        avformat_free_context(_context);
+        return AVERROR(ENOMEM);
+    }
+    
+    if (!(pb = avio_alloc_context(buf, kInputBufferSize, 0, opaque, read, NULL, NULL))) {
+        av_free(buf);
+        avformat_free_context(_context);
+        return AVERROR(ENOMEM);
+    }
+    
+    _context->pb     = pb;
+    _context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    
+    if ((ret = avformat_open_input(&_context, filename, NULL, NULL)) < 0) {
+        av_free(pb->buffer);
+        av_free(pb);
+        return ret;
+    }
+    
+    *context = _context;
+    
+    return 0;
+}
+
+/**
+ * @brief close media input opened with sg_input_open or sg_input_open_read
+ * @param context input format context
+ */
+void sg_input_close(AVFormatContext **context) {
+    AVIOContext *pb = NULL;
+    
+    if (!*context) {
+        return;
+    }
+    
+    if ((*context)->flags & AVFMT_FLAG_CUSTOM_IO) {
+        pb = (*context)->pb;
+    }
+    
+    avformat_close_input(context);
+    
+    if (pb) {
+        if (pb->read_packet == input_read) {
+            input_unmap((MappedInput*)pb->opaque);
+        }
+        
+        av_free(pb->buffer);
+        av_free(pb);
+    }
+}
@@ -0,0 +1,30 @@
+// input.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libavformat/avformat.h>
+
+#ifndef __SG_INPUT__
+#define __SG_INPUT__
+
+typedef enum {
+    InputFlagNoMap = 0x01
+} InputFlags;
+
+int  sg_input_open(AVFormatContext **context, const char *filename, int flags);
+int  sg_input_open_read(AVFormatContext **context, const char *filename, int (*read)(void *opaque, uint8_t *buf, int size), void *opaque);
+void sg_input_close(AVFormatContext **context);
+
+#endif
@@ -0,0 +1,173 @@
+// layout.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "layout.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const unsigned int kLayoutMaxHashFanout = 4096;
+
+/**
+ * @brief spread consecutive indexes evenly over hash directories
+ */
+static unsigned int layout_hash(unsigned int index) {
+    index ^= index >> 16;
+    index *= 0x7feb352d;
+    index ^= index >> 15;
+    index *= 0x846ca68b;
+    index ^= index >> 16;
+    
+    return index;
+}
+
+/**
+ * @brief parse layout specification: flat, range:<fanout> or hash:<fanout>
+ * @param layout output layout
+ * @param spec layout specification
+ * @return 0 on success, negative error code on failure
+ */
+int sg_layout_parse(SegmentLayout *layout, const char *spec) {
+    const char *fanout = strchr(spec, ':');
+    size_t     length  = fanout ? (size_t)(fanout - spec) : strlen(spec);
+    char       *end;
+    
+    layout->type   = LayoutTypeFlat;
+    layout->fanout = 0;
+    
+    if (length == 4 && !strncmp(spec, "flat", length) && !fanout) {
+        return 0;
+    }
+    
+    if (!fanout || !*(fanout + 1)) {
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    if (length == 5 && !strncmp(spec, "range", length)) {
+        layout->type = LayoutTypeRange;
+    } else if (length == 4 && !strncmp(spec, "hash", length)) {
+        layout->type = LayoutTypeHash;
+    } else {
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    layout->fanout = strtoul(fanout + 1, &end, 10);
+    
+    if (*end || layout->fanout < 2 || (layout->type == LayoutTypeHash && layout->fanout > kLayoutMaxHashFanout)) {
+        layout->type = LayoutTypeFlat;
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief directory of segment relative to output root
+ * @return length of directory name written to buf like snprintf, 0 for flat layout
+ */
+int sg_layout_dir(const SegmentLayout *layout, unsigned int index, char *buf, size_t size) {
+    
+    switch (layout->type) {
+        case LayoutTypeRange:
+            return snprintf(buf, size, "%u", index / layout->fanout);
+        case LayoutTypeHash:
+            return snprintf(buf, size, "%02x", layout_hash(index) % layout->fanout);
+        default:
+            if (size) {
+                *buf = '\0';
+            }
+            
+            return 0;
+    }
+}
+
+/**
+ * @brief segment file name relative to output root, also used as relative uri in index
+ * @return length of name like snprintf
+ */
+int sg_layout_name(const SegmentLayout *layout, const char *base_name, unsigned int index, const char *extension, char *buf, size_t size) {
+    char dir[SG_LAYOUT_DIR_SIZE];
+    
+    if (!sg_layout_dir(layout, index, dir, sizeof(dir))) {
+        return snprintf(buf, size, "%s%u.%s", base_name, index, extension);
+    }
+    
+    return snprintf(buf, size, "%s/%s%u.%s", dir, base_name, index, extension);
+}
+
+/**
+ * @brief create directories before segments need them: all of them for hash layout
+ *        with the first segment, current and next range when segment starts a range
+ * @param layout segment layout
+ * @param index index of segment being started
+ * @param create_dir directory callback
+ * @param opaque callback argument
+ * @return 0 on success, negative error code on failure
+ */
+int sg_layout_prepare(const SegmentLayout *layout, unsigned int index, LayoutDirFunc create_dir, void *opaque) {
+    char         dir[SG_LAYOUT_DIR_SIZE];
+    unsigned int i;
+    int          ret;
+    
+    if (!create_dir) {
+        return 0;
+    }
+    
+    if (layout->type == LayoutTypeHash && !index) {
+        for (i = 0; i < layout->fanout; i++) {
+            snprintf(dir, sizeof(dir), "%02x", i);
+            
+            if ((ret = create_dir(opaque, dir))) {
+                return ret;
+            }
+        }
+    }
+    
+    if (layout->type == LayoutTypeRange && index % layout->fanout == 0) {
+        for (i = index / layout->fanout; i <= index / layout->fanout + 1; i++) {
+            snprintf(dir, sizeof(dir), "%u", i);
+            
+            if ((ret = create_dir(opaque, dir))) {
+                return ret;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief remove range directory once its last segment was removed
+ * @param layout segment layout
+ * @param index index of removed segment
+ * @param remove_dir directory callback
+ * @param opaque callback argument
+ * @return 0 on success, negative error code on failure
+ */
+int sg_layout_release(const SegmentLayout *layout, unsigned int index, LayoutDirFunc remove_dir, void *opaque) {
+    char dir[SG_LAYOUT_DIR_SIZE];
+    
+    if (!remove_dir || layout->type != LayoutTypeRange || (index + 1) % layout->fanout) {
+        return 0;
+    }
+    
+    snprintf(dir, sizeof(dir), "%u", index / layout->fanout);
+    
+    return remove_dir(opaque, dir);
+}
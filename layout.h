@@ -0,0 +1,55 @@
+// layout.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stddef.h>
+
+#ifndef __SG_LAYOUT__
+#define __SG_LAYOUT__
+
+#define SG_LAYOUT_DIR_SIZE 16
+
+typedef enum {
+    LayoutTypeFlat,
+    LayoutTypeRange,
+    LayoutTypeHash
+} LayoutType;
+
+/**
+ * Placement of segment files under output root. Range layout puts every fanout
+ * consecutive segments into one directory (0/, 1/, ...), so old directories empty
+ * out as live window moves, hash layout spreads segments over fanout directories
+ * (00/ .. ff/) which are all created up front.
+ */
+typedef struct {
+    LayoutType   type;
+    unsigned int fanout;
+} SegmentLayout;
+
+/**
+ * Directory callback, name is relative to output root.
+ * Returns 0 on success or negative error code on failure.
+ */
+typedef int (*LayoutDirFunc)(void *opaque, const char *name);
+
+int  sg_layout_parse(SegmentLayout *layout, const char *spec);
+
+int  sg_layout_dir(const SegmentLayout *layout, unsigned int index, char *buf, size_t size);
+int  sg_layout_name(const SegmentLayout *layout, const char *base_name, unsigned int index, const char *extension, char *buf, size_t size);
+
+int  sg_layout_prepare(const SegmentLayout *layout, unsigned int index, LayoutDirFunc create_dir, void *opaque);
+int  sg_layout_release(const SegmentLayout *layout, unsigned int index, LayoutDirFunc remove_dir, void *opaque);
+
+#endif
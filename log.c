@@ -14,22 +14,361 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include "config.h"
 #include "log.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
-static char* sg_log_app   = NULL;
-static int   sg_log_level = SG_LOG_INFO;
+#define LOG_RING_SIZE    1024
+#define LOG_MESSAGE_SIZE 512
+#define LOG_RATE_SLOTS   256
 
-void sg_vlog(int level, const char* fmt, va_list vl) {
-    if (level <= sg_log_level) {
+static const unsigned int kLogRateLimit   = 20;
+static const long         kLogIdleSleep   = 10000000;
+static const time_t       kLogReport      = 1;
+static const size_t       kLogFileSize    = 16 * 1024 * 1024;
+static const int          kLogFiles       = 4;
+
+static const char *kLogLevels[] = { "fatal", "error", "warning", "info", "verbose", "debug" };
+
+typedef struct {
+    uint64_t        sequence;
+    int             level;
+    struct timespec time;
+    char            message[LOG_MESSAGE_SIZE];
+} LogEntry;
+
+typedef struct {
+    LogEntry    *ring;
+    uint64_t    head, tail;
+    
+    uint64_t    dropped, limited;
+    uint64_t    rate[LOG_RATE_SLOTS];
+    
+    char        *filename;
+    FILE        *file;
+    size_t      file_size, max_size;
+    int         files;
+    
+    int         running, stop;
+    int         users;
+    pthread_t   thread;
+} LogWriter;
+
+static char*     sg_log_app    = NULL;
+static int       sg_log_level  = SG_LOG_INFO;
+static LogWriter sg_log_writer;
+
+static const char* level_name(int level) {
+    int index = level / 8 - 1;
+    
+    if (index < 0) {
+        index = 0;
+    }
+    
+    return index < sizeof(kLogLevels) / sizeof(kLogLevels[0]) ? kLogLevels[index] : "trace";
+}
+
+/**
+ * @brief per message rate limit, messages are identified by their format string
+ * @return 1 if message may be logged, 0 if limit for current second was reached
+ */
+static int rate_allow(LogWriter *writer, const char *fmt, time_t now) {
+    uint64_t *slot = &writer->rate[((uintptr_t)fmt >> 3) % LOG_RATE_SLOTS];
+    uint64_t old   = __atomic_load_n(slot, __ATOMIC_RELAXED), value;
+    
+    do {
+        if ((uint32_t)(old >> 32) != (uint32_t)now) {
+            value = ((uint64_t)(uint32_t)now << 32) | 1;
+        } else if ((uint32_t)old >= kLogRateLimit) {
+            return 0;
+        } else {
+            value = old + 1;
+        }
+    } while (!__atomic_compare_exchange_n(slot, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    
+    return 1;
+}
+
+/**
+ * @brief reserve ring entry, multiple producers never wait for each other or for writer
+ * @return entry to fill and publish, NULL if ring is full
+ */
+static LogEntry* ring_reserve(LogWriter *writer, uint64_t *position) {
+    uint64_t pos = __atomic_load_n(&writer->head, __ATOMIC_RELAXED);
+    LogEntry *entry;
+    int64_t  diff;
+    
+    while (1) {
+        entry = &writer->ring[pos % LOG_RING_SIZE];
+        diff  = (int64_t)(__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) - pos);
+        
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&writer->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&writer->head, __ATOMIC_RELAXED);
+        }
+    }
+    
+    *position = pos;
+    
+    return entry;
+}
+
+static void ring_publish(LogEntry *entry, uint64_t position) {
+    __atomic_store_n(&entry->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief rename log files one generation up, oldest file is overwritten,
+ *        single log file is truncated instead
+ */
+static void rotate_file(LogWriter *writer) {
+    char from[PATH_MAX], to[PATH_MAX];
+    int  i;
+    
+    fclose(writer->file);
+    
+    for (i = writer->files - 1; i > 0; i--) {
+        snprintf(from, sizeof(from), i > 1 ? "%s.%d" : "%s", writer->filename, i - 1);
+        snprintf(to, sizeof(to), "%s.%d", writer->filename, i);
+        rename(from, to);
+    }
+    
+    writer->file      = fopen(writer->filename, writer->files > 1 ? "a" : "w");
+    writer->file_size = 0;
+}
+
+static void write_line(LogWriter *writer, int level, struct timespec *time, const char *message) {
+    char      stamp[32];
+    struct tm tm;
+    int       length;
+    
+    if (!writer->file) {
+        fprintf(stderr, "%s%s%s\n", sg_log_app ? sg_log_app : "", sg_log_app ? ": " : "", message);
+        return;
+    }
+    
+    localtime_r(&time->tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    
+    length = fprintf(writer->file, "%s.%03ld %s: %s\n", stamp, time->tv_nsec / 1000000, level_name(level), message);
+    
+    if (length > 0) {
+        writer->file_size += length;
+    }
+    
+    if (level <= SG_LOG_FATAL) {
+        fprintf(stderr, "%s%s%s\n", sg_log_app ? sg_log_app : "", sg_log_app ? ": " : "", message);
+    }
+    
+    if (writer->file_size >= writer->max_size) {
+        rotate_file(writer);
+    }
+}
+
+/**
+ * @brief report messages lost since last report
+ */
+static void write_dropped(LogWriter *writer, uint64_t *dropped, uint64_t *limited) {
+    uint64_t        _dropped = __atomic_load_n(&writer->dropped, __ATOMIC_RELAXED);
+    uint64_t        _limited = __atomic_load_n(&writer->limited, __ATOMIC_RELAXED);
+    struct timespec now;
+    char            message[128];
+    
+    if (_dropped == *dropped && _limited == *limited) {
+        return;
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(message, sizeof(message), "log: %llu messages dropped, %llu rate limited",
+             (unsigned long long)(_dropped - *dropped), (unsigned long long)(_limited - *limited));
+    write_line(writer, SG_LOG_WARNING, &now, message);
+    
+    *dropped = _dropped;
+    *limited = _limited;
+}
+
+/**
+ * @brief write all published entries
+ * @return number of written entries
+ */
+static int drain(LogWriter *writer) {
+    LogEntry *entry;
+    int      count = 0;
+    
+    while (1) {
+        entry = &writer->ring[writer->tail % LOG_RING_SIZE];
+        
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != writer->tail + 1) {
+            break;
+        }
+        
+        write_line(writer, entry->level, &entry->time, entry->message);
+        
+        __atomic_store_n(&entry->sequence, writer->tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        writer->tail++;
+        count++;
+    }
+    
+    return count;
+}
+
+static void* writer_run(void *opaque) {
+    LogWriter       *writer  = (LogWriter*)opaque;
+    struct timespec idle     = { 0, kLogIdleSleep }, now;
+    uint64_t        dropped  = 0, limited = 0;
+    time_t          report   = 0;
+    int             stop;
+    
+    while (1) {
+        if (drain(writer)) {
+            continue;
+        }
+        
+        stop = __atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE);
+        
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        
+        if (stop || now.tv_sec >= report + kLogReport) {
+            write_dropped(writer, &dropped, &limited);
+            report = now.tv_sec;
+        }
         
-        if(sg_log_app) {
-            fprintf(stderr, "%s: ", sg_log_app);
+        if (writer->file) {
+            fflush(writer->file);
         }
         
-        vfprintf(stderr, fmt, vl);
-        fprintf(stderr, "\n");
+        // entries published between last drain and stop flag are written before exit
+        if (stop && !drain(writer)) {
+            break;
+        }
+        
+        nanosleep(&idle, NULL);
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief queue message for background writer, never blocks
+ */
+static void log_enqueue(LogWriter *writer, int level, const char *fmt, va_list vl, void *avcl) {
+    struct timespec now;
+    LogEntry        *entry;
+    uint64_t        position;
+    int             prefix = 1;
+    size_t          length;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    
+    if (level > SG_LOG_FATAL && !rate_allow(writer, fmt, now.tv_sec)) {
+        __atomic_fetch_add(&writer->limited, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    if (!(entry = ring_reserve(writer, &position))) {
+        __atomic_fetch_add(&writer->dropped, 1, __ATOMIC_RELAXED);
+        
+        if (level <= SG_LOG_FATAL) {
+            vfprintf(stderr, fmt, vl);
+            fprintf(stderr, "\n");
+        }
+        
+        return;
+    }
+    
+    if (avcl) {
+        av_log_format_line(avcl, level, fmt, vl, entry->message, LOG_MESSAGE_SIZE, &prefix);
+    } else {
+        vsnprintf(entry->message, LOG_MESSAGE_SIZE, fmt, vl);
+    }
+    
+    length = strlen(entry->message);
+    
+    while (length && entry->message[length - 1] == '\n') {
+        entry->message[--length] = 0;
+    }
+    
+    entry->level = level;
+    entry->time  = now;
+    
+    ring_publish(entry, position);
+}
+
+/**
+ * @brief register caller as producer, writer is not freed while it has producers
+ * @return 1 if background writer is running, 0 if message should be written synchronously
+ */
+static int writer_acquire(void) {
+    
+    // store of users and load of running pair with the reverse in sg_log_stop, only sequential
+    // consistency guarantees that at least one side sees the other's store
+    __atomic_fetch_add(&sg_log_writer.users, 1, __ATOMIC_SEQ_CST);
+    
+    if (__atomic_load_n(&sg_log_writer.running, __ATOMIC_SEQ_CST)) {
+        return 1;
+    }
+    
+    __atomic_fetch_sub(&sg_log_writer.users, 1, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+static void writer_release(void) {
+    __atomic_fetch_sub(&sg_log_writer.users, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief libavformat and libavcodec messages go through the same ring
+ */
+static void av_log_callback(void *avcl, int level, const char *fmt, va_list vl) {
+    
+    if (level > av_log_get_level()) {
+        return;
+    }
+    
+    if (writer_acquire()) {
+        log_enqueue(&sg_log_writer, level, fmt, vl, avcl);
+        writer_release();
+    } else {
+        av_log_default_callback(avcl, level, fmt, vl);
+    }
+}
+
+void sg_vlog(int level, const char* fmt, va_list vl) {
+    char message[LOG_MESSAGE_SIZE];
+    
+    if (level > sg_log_level) {
+        return;
+    }
+    
+    if (writer_acquire()) {
+        log_enqueue(&sg_log_writer, level, fmt, vl, NULL);
+        writer_release();
+        return;
+    }
+    
+    vsnprintf(message, sizeof(message), fmt, vl);
+    
+    if(sg_log_app) {
+        fprintf(stderr, "%s: %s\n", sg_log_app, message);
+    } else {
+        fprintf(stderr, "%s\n", message);
     }
 }
 
@@ -49,3 +388,99 @@ void sg_log_set_level(int level) {
     sg_log_level = level;
     av_log_set_level(level);
 }
+
+/**
+ * @brief start background log writer, after this call logging never blocks caller,
+ *        messages are dropped when writer falls behind
+ * @param filename log file, NULL for stderr
+ * @param max_size rotate log file when it reaches max_size bytes, 0 for default (16MB)
+ * @param files number of kept log files including current one, 0 for default (4),
+ *        1 truncates the only file when it reaches max_size
+ * @return 0 on success, negative error code on failure
+ */
+int sg_log_start(const char *filename, size_t max_size, int files) {
+    LogWriter *writer = &sg_log_writer;
+    uint64_t  i;
+    
+    if (writer->running) {
+        return 0;
+    }
+    
+    if (files < 0) {
+        return SGERROR(SGERROR_INVALID);
+    }
+    
+    memset(writer, 0, sizeof(LogWriter));
+    
+    if (!(writer->ring = (LogEntry*)sg_malloc(LOG_RING_SIZE * sizeof(LogEntry)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        writer->ring[i].sequence = i;
+    }
+    
+    writer->max_size = max_size ? max_size : kLogFileSize;
+    writer->files    = files ? files : kLogFiles;
+    
+    if (filename && (!(writer->filename = sg_strdup(filename)) || !(writer->file = fopen(filename, "a")))) {
+        sg_free(writer->filename);
+        sg_free(writer->ring);
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (writer->file) {
+        writer->file_size = ftell(writer->file);
+    }
+    
+    if (pthread_create(&writer->thread, NULL, writer_run, writer)) {
+        if (writer->file) {
+            fclose(writer->file);
+        }
+        
+        sg_free(writer->filename);
+        sg_free(writer->ring);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    __atomic_store_n(&writer->running, 1, __ATOMIC_RELEASE);
+    av_log_set_callback(av_log_callback);
+    
+    return 0;
+}
+
+/**
+ * @brief write queued messages and stop background writer, logging becomes synchronous again
+ */
+void sg_log_stop(void) {
+    LogWriter       *writer = &sg_log_writer;
+    struct timespec idle    = { 0, 1000000 };
+    
+    if (!writer->running) {
+        return;
+    }
+    
+    av_log_set_callback(av_log_default_callback);
+    __atomic_store_n(&writer->running, 0, __ATOMIC_SEQ_CST);
+    
+    while (__atomic_load_n(&writer->users, __ATOMIC_SEQ_CST)) {
+        nanosleep(&idle, NULL);
+    }
+    
+    __atomic_store_n(&writer->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(writer->thread, NULL);
+    
+    if (writer->file) {
+        fclose(writer->file);
+    }
+    
+    sg_free(writer->filename);
+    sg_free(writer->ring);
+}
+
+/**
+ * @brief number of messages lost because ring was full or rate limit was reached
+ */
+uint64_t sg_log_dropped(void) {
+    return __atomic_load_n(&sg_log_writer.dropped, __ATOMIC_RELAXED) + __atomic_load_n(&sg_log_writer.limited, __ATOMIC_RELAXED);
+}
@@ -15,6 +15,8 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <libavutil/avutil.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifndef __SG_LOG__
 #define __SG_LOG__
@@ -32,5 +34,9 @@ void sg_vlog(int level, const char* fmt, va_list vl);
 void sg_log_init(char*);
 void sg_log_set_level(int);
 
+int      sg_log_start(const char *filename, size_t max_size, int files);
+void     sg_log_stop(void);
+uint64_t sg_log_dropped(void);
+
 
 #endif
@@ -15,10 +15,22 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "config.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
+#include <sys/stat.h>
 #include <libavformat/avformat.h>
 #include "segmenter.h"
+#include "cutter.h"
+#include "engine.h"
+#include "http.h"
+#include "shm.h"
+#include "rebuild.h"
+#include "sink.h"
+#include "input.h"
 #include "util.h"
 #include "log.h"
 
@@ -26,22 +38,28 @@
 #define DEFAULT_FILE_BASE            ""
 #define DEFAULT_BASE_MEDIA_FILE_NAME "fileSequence"
 #define DEFAULT_INDEX_FILE           "prog_index.m3u8"
+#define DEFAULT_MASTER_INDEX_FILE    "master.m3u8"
+#define DEFAULT_BOUNDARY_TOLERANCE   0.05
+#define DEFAULT_SHM_SLOT_SIZE        16
+#define SHM_SPARE_SLOTS              3
 
 void print_version() {
     printf("%s: %s\n", PACKAGE, PACKAGE_VERSION);
 }
 
 void print_usage(char* name) {
-    printf("Usage:%s [options] <file> where options are:\n"
+    printf("Usage:%s [options] <file> [<file> ...] where options are:\n"
            "\t" "-h        | --help                        : print this help message\n"
            "\t" "-v        | --version                     : print version number\n"
            "\t" "-b <url>  | --base-url=<url>              : base url (omit for relative URLs)\n"
            "\t" "-t <dur>  | --target-duration=<dur>       : target duration for each segment\n"
-           "\t" "-f <path> | --file-base=<path>            : path at which to store index and media files\n"
+           "\t" "-f <path> | --file-base=<path>            : path, http:// url or shm:<name> store at which to keep index and media files\n"
            "\t" "-i <name> | --index-file=<name>           : index file name (default prog_index.m3u8)\n"
-           "\t" "-I        | --generate-variant-plist      : generate plist file for variantplaylistcreator\n"
+           "\t" "-I        | --generate-variant-plist      : write master playlist (master.m3u8) with measured bandwidth\n"
            "\t" "-B <name> | --base-media-file-name=<name> : base media file name (default fileSequence)\n"
-           "\t" "-l <path> | --log-file=<path>             : enable log file\n"
+           "\t" "-s <spec> | --shard=<spec>                : segment directory layout, flat, range:<num> or hash:<num> (default flat)\n"
+           "\t" "-o <path> | --archive=<path>              : link every segment into directory and keep VOD index of them there\n"
+           "\t" "-L <path> | --log-file=<path>             : write log to rotated file instead of stderr\n"
            "\t" "-q        | --quiet                       : only output errors\n"
            "\t" "-a        | --audio-only                  : only use audio from the stream\n"
            "\t" "-A        | --video-only                  : only use video from the stream\n"
@@ -49,15 +67,50 @@ void print_usage(char* name) {
            "\t" "-e        | --live-event                  : write live event stream index file\n"
            "\t" "-w <num>  | --sliding-window-entries      : maximum number of entries in index file\n"
            "\t" "-D        | --delete-files                : delete files after they expire\n"
+           "\t" "-E        | --encrypt                     : encrypt segments with AES-128 using random key\n"
+           "\t" "-k <key>  | --encrypt-key=<key>           : encryption key, 32 hex digits or path to 16 byte key file\n"
+           "\t" "-K <url>  | --encrypt-key-url=<url>       : url prefix of key files (omit for base url)\n"
+           "\t" "-r <num>  | --encrypt-rotate-keys=<num>   : generate new random key every <num> segments\n"
+           "\t" "-c <list> | --checksum=<list>             : write segment manifest with crc32c and/or sha256 checksums\n"
+           "\t" "-C <num>  | --http-connections=<num>      : number of persistent connections for http output, 2-64 (default 2)\n"
+           "\t" "-Z <MB>   | --shm-slot-size=<MB>          : maximum segment size of shm output, larger segments are skipped (default 16)\n"
+           "\t" "-m <path> | --metrics=<path>              : export Prometheus metrics to file, or to unix:<path> socket\n"
+           "\t" "-M <sec>  | --metrics-interval=<sec>      : metrics file update interval (default 5)\n"
+           "\t" "-n <path> | --channels=<path>             : segment channels listed in file (\"<name> <input>\" lines) in one process\n"
+           "\t" "-T <num>  | --threads=<num>               : worker threads for channels and rebuild (default one per cpu)\n"
+           "\t" "-U        | --audit                       : check segments in file base for gaps and missing files\n"
+           "\t" "-R        | --rebuild                     : write index again from segments in file base\n"
            , name);
 }
 
+int parse_checksum(char *list) {
+    int  types = 0;
+    char *type;
+    
+    for (type = strtok(list, ","); type; type = strtok(NULL, ",")) {
+        if (!strcmp(type, "crc32c")) {
+            types |= ChecksumTypeCRC32C;
+        } else if (!strcmp(type, "sha256")) {
+            types |= ChecksumTypeSHA256;
+        } else {
+            return 0;
+        }
+    }
+    
+    return types;
+}
+
 struct config {
     char *base_url;
     char *file_base;
     char *media_file_name;
     char *index_file;
-    char *source_file;
+    char **source_files;
+    int  sources;
+    char *log_file;
+    
+    SegmentLayout layout;
+    char          *archive;
     
     int          media;
     IndexType    type;
@@ -66,9 +119,523 @@ struct config {
     int playlist_entries;
     int delete;
     
+    int          encrypt;
+    char         *key;
+    char         *key_url;
+    unsigned int key_rotation;
+    
+    int checksum;
+    int http_connections;
+    
+    size_t shm_slot_size;
+    
+    char   *metrics;
+    double metrics_interval;
+    
+    char *channels;
+    int  threads;
+    
+    int audit;
+    int rebuild;
+    
     double duration;
 };
 
+struct rendition {
+    char             *file_base;
+    char             *base_url;
+    char             *uri;
+    
+    AVFormatContext  *source;
+    SegmenterCutter  *cutter;
+    SegmenterContext *output;
+    
+    AVPacket         pkt;
+    int              pending;
+    double           time;
+    
+    unsigned int     prev_index;
+};
+
+char* format_path(const char *format, ...) {
+    va_list args;
+    char    *buf;
+    int     size;
+    
+    va_start(args, format);
+    size = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    
+    if ((buf = (char*)malloc(size + 1))) {
+        va_start(args, format);
+        vsnprintf(buf, size + 1, format, args);
+        va_end(args);
+    }
+    
+    return buf;
+}
+
+/**
+ * @brief set up sink, encryption and checksums of output and initialize it for source
+ * @return 0 on success, negative error code on failure
+ */
+int configure_output(struct config *config, SegmenterContext *output, AVFormatContext *source, SegmenterCutter *cutter, char *file_base) {
+    int ret;
+    
+    if (sg_is_http_url(file_base)) {
+        SegmenterSink sink;
+        
+        if ((ret = sg_http_sink_init(&sink, file_base, config->http_connections)) || (ret = segmenter_set_sink(output, &sink))) {
+            sg_log(SG_LOG_ERROR, "http output, %s", sg_strerror(SGUNERROR(ret)));
+            return ret;
+        }
+    } else if (sg_is_shm_url(file_base)) {
+        SegmenterSink sink;
+        
+        if ((ret = sg_shm_sink_init(&sink, file_base, config->playlist_entries + SHM_SPARE_SLOTS, config->shm_slot_size)) ||
+            (ret = segmenter_set_sink(output, &sink))) {
+            sg_log(SG_LOG_ERROR, "shared memory output, %s", sg_strerror(SGUNERROR(ret)));
+            return ret;
+        }
+    }
+    
+    if (cutter) {
+        ret = segmenter_init_frames(output, cutter->codec_id, file_base, config->media_file_name, config->duration);
+    } else {
+        ret = segmenter_init(output, source, file_base, config->media_file_name, config->duration, config->media);
+    }
+    
+    if (ret) {
+        sg_log(SG_LOG_ERROR, "initialize context, %s", sg_strerror(SGUNERROR(ret)));
+        return ret;
+    }
+    
+    if (config->encrypt) {
+        uint8_t key[SG_CRYPT_KEY_SIZE];
+        
+        if (config->key && sg_crypt_parse_key(config->key, key)) {
+            sg_log(SG_LOG_ERROR, "can't read encryption key '%s'", config->key);
+            return SGERROR(SGERROR_CRYPT);
+        }
+        
+        if ((ret = segmenter_set_encryption(output, config->key ? key : NULL, config->key_rotation, config->key_url))) {
+            sg_log(SG_LOG_ERROR, "enable encryption, %s", sg_strerror(SGUNERROR(ret)));
+            return ret;
+        }
+    }
+    
+    if (config->checksum && (ret = segmenter_set_checksums(output, config->checksum))) {
+        sg_log(SG_LOG_ERROR, "enable checksums, %s", sg_strerror(SGUNERROR(ret)));
+        return ret;
+    }
+    
+    segmenter_set_layout(output, &config->layout);
+    
+    if (config->archive) {
+        // renditions and channels are archived into the same subdirectories they are written to
+        char *archive = format_path("%s%s", config->archive, file_base + strlen(config->file_base));
+        
+        if (!archive || (ret = segmenter_set_archive(output, archive, config->index_file))) {
+            ret = archive ? ret : SGERROR(SGERROR_MEM_ALLOC);
+            sg_log(SG_LOG_ERROR, "archive to '%s', %s", archive ? archive : config->archive, sg_strerror(SGUNERROR(ret)));
+            free(archive);
+            return ret;
+        }
+        
+        free(archive);
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief open input and segmenter of one rendition, several renditions are written
+ *        into numbered subdirectories of file base
+ */
+void open_rendition(struct config *config, struct rendition *rendition, int index, SegmenterScheduler *scheduler) {
+    char *source_file = config->source_files[index];
+    int  ret;
+    
+    if (config->sources == 1) {
+        rendition->file_base = config->file_base;
+        rendition->base_url  = config->base_url;
+        rendition->uri       = config->index_file;
+    } else {
+        rendition->file_base = format_path("%s/%d", config->file_base, index);
+        rendition->base_url  = format_path(*config->base_url ? "%s%d/" : "%s", config->base_url, index);
+        rendition->uri       = format_path("%2$d/%1$s", config->index_file, index);
+        
+        if (!rendition->file_base || !rendition->base_url || !rendition->uri) {
+            sg_log(SG_LOG_FATAL, "allocate rendition, %s", sg_strerror(SGERROR_MEM_ALLOC));
+            exit(EXIT_FAILURE);
+        }
+        
+        if (!sg_is_http_url(rendition->file_base) && !sg_is_shm_url(rendition->file_base) && mkdir(rendition->file_base, 0755) && errno != EEXIST) {
+            sg_log(SG_LOG_FATAL, "can't create directory '%s'", rendition->file_base);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // pipe read by raw audio probe goes on with data probe buffered
+    if (rendition->cutter) {
+        ret = sg_input_open_read(&rendition->source, source_file, sg_cutter_read, rendition->cutter);
+    } else {
+        ret = sg_input_open(&rendition->source, source_file, 0);
+    }
+    
+    if (ret) {
+        sg_log(SG_LOG_FATAL, "can't open input file '%s'", source_file);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (avformat_find_stream_info(rendition->source, NULL)) {
+        sg_log(SG_LOG_WARNING, "Warning: can't load input file info");
+    }
+    
+    if ((ret = segmenter_alloc_context(&rendition->output))) {
+        sg_log(SG_LOG_FATAL, "allocate context, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    if (configure_output(config, rendition->output, rendition->source, NULL, rendition->file_base)) {
+        exit(EXIT_FAILURE);
+    }
+    
+    if (scheduler) {
+        segmenter_set_scheduler(rendition->output, scheduler);
+    }
+    
+    if((ret = segmenter_open(rendition->output))){
+        sg_log(SG_LOG_FATAL, "open output, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief read next packet of rendition and remember its decoding time
+ */
+void read_rendition(struct rendition *rendition) {
+    int64_t timestamp;
+    
+    if (!(rendition->pending = av_read_frame(rendition->source, &rendition->pkt) >= 0)) {
+        return;
+    }
+    
+    timestamp = rendition->pkt.dts != AV_NOPTS_VALUE ? rendition->pkt.dts : rendition->pkt.pts;
+    
+    if (timestamp != AV_NOPTS_VALUE) {
+        rendition->time = timestamp * av_q2d(rendition->source->streams[rendition->pkt.stream_index]->time_base);
+    }
+}
+
+/**
+ * @brief master playlist needs measured bitrate of every rendition
+ */
+int master_ready(struct rendition *renditions, int count) {
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        if (!renditions[i].output->segment_index) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+/**
+ * @brief engine callback, channel output goes into subdirectory named after channel
+ */
+int open_channel(void *opaque, SegmenterChannel *channel) {
+    struct config *config = (struct config*)opaque;
+    
+    if (!(channel->file_base = format_path("%s/%s", config->file_base, channel->name)) ||
+        !(channel->base_url = format_path(*config->base_url ? "%s%s/" : "%s", config->base_url, channel->name))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    return configure_output(config, channel->output, channel->source, channel->source ? NULL : channel->cutter, channel->file_base);
+}
+
+/**
+ * @brief read channel list, one "<name> <input>" pair per line, '#' starts a comment
+ */
+void add_channels(struct config *config, SegmenterEngine *engine, SegmenterMetricsExporter *exporter) {
+    FILE             *file;
+    SegmenterChannel *channel;
+    char             line[4096], name[256], input[4096];
+    int              number = 0;
+    int              ret;
+    
+    if (!(file = fopen(config->channels, "r"))) {
+        sg_log(SG_LOG_FATAL, "can't open channel list '%s'", config->channels);
+        exit(EXIT_FAILURE);
+    }
+    
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        
+        if (sscanf(line, " %255s", name) != 1 || *name == '#') {
+            continue;
+        }
+        
+        if (sscanf(line, " %255s %4095s", name, input) != 2 || strchr(name, '/') || !strcmp(name, "..")) {
+            sg_log(SG_LOG_FATAL, "invalid channel at line %d of '%s'", number, config->channels);
+            exit(EXIT_FAILURE);
+        }
+        
+        char *file_base = format_path("%s/%s", config->file_base, name);
+        
+        if (!file_base) {
+            sg_log(SG_LOG_FATAL, "allocate channel, %s", sg_strerror(SGERROR_MEM_ALLOC));
+            exit(EXIT_FAILURE);
+        }
+        
+        if (!sg_is_http_url(file_base) && !sg_is_shm_url(file_base) && mkdir(file_base, 0755) && errno != EEXIST) {
+            sg_log(SG_LOG_FATAL, "can't create directory '%s'", file_base);
+            exit(EXIT_FAILURE);
+        }
+        
+        free(file_base);
+        
+        if ((ret = sg_engine_add_channel(engine, name, input, &channel))) {
+            sg_log(SG_LOG_FATAL, "channel '%s' input '%s', %s", name, input, sg_strerror(SGUNERROR(ret)));
+            exit(EXIT_FAILURE);
+        }
+        
+        if (exporter) {
+            char label[300];
+            
+            snprintf(label, sizeof(label), "channel=\"%s\"", name);
+            
+            if ((ret = sg_metrics_exporter_add(exporter, &channel->output->metrics, label))) {
+                sg_log(SG_LOG_FATAL, "export metrics, %s", sg_strerror(SGUNERROR(ret)));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    
+    fclose(file);
+    
+    if (!engine->channels_count) {
+        sg_log(SG_LOG_FATAL, "no channels in '%s'", config->channels);
+        exit(EXIT_FAILURE);
+    }
+}
+
+SegmenterEngine *channels_engine = NULL;
+
+void stop_channels(int signal) {
+    sg_engine_stop(channels_engine);
+}
+
+/**
+ * @brief segment all channels of list in this process
+ */
+int run_channels(struct config *config) {
+    SegmenterEngine          *engine;
+    SegmenterEngineConfig    engine_config;
+    SegmenterMetricsExporter *exporter = NULL;
+    int                      ret;
+    
+    av_register_all();
+    
+    memset(&engine_config, 0, sizeof(engine_config));
+    
+    engine_config.threads          = config->threads;
+    engine_config.type             = config->type;
+    engine_config.playlist_entries = config->playlist_entries;
+    engine_config.del              = config->delete;
+    engine_config.index_file       = config->index_file;
+    engine_config.cut_audio        = config->media == MediaTypeAudio;
+    engine_config.open_output      = open_channel;
+    engine_config.opaque           = config;
+    
+    if ((ret = sg_engine_alloc(&engine, &engine_config))) {
+        sg_log(SG_LOG_FATAL, "allocate engine, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    if (config->metrics && (ret = sg_metrics_exporter_start(&exporter, config->metrics, config->metrics_interval))) {
+        sg_log(SG_LOG_FATAL, "export metrics to '%s', %s", config->metrics, sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    add_channels(config, engine, exporter);
+    
+    channels_engine = engine;
+    
+    signal(SIGINT, stop_channels);
+    signal(SIGTERM, stop_channels);
+    
+    ret = sg_engine_run(engine);
+    
+    if (exporter) {
+        sg_metrics_exporter_stop(exporter);
+    }
+    
+    sg_engine_free(engine);
+    
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief audit segments left in output directory, with rebuild index is written again from
+ *        their timing without segmenting source
+ */
+int rebuild_index(struct config *config) {
+    SegmenterRebuild *rebuild;
+    SegmenterContext *output;
+    uint64_t         start = sg_metrics_now();
+    unsigned int     i;
+    int              ret;
+    
+    if (sg_is_http_url(config->file_base) || sg_is_shm_url(config->file_base)) {
+        sg_log(SG_LOG_FATAL, "only segments in local directory can be audited");
+        exit(EXIT_FAILURE);
+    }
+    
+    if ((ret = sg_rebuild_scan(&rebuild, config->file_base, config->media_file_name, &config->layout, config->threads))) {
+        sg_log(SG_LOG_FATAL, "scan segments in '%s', %s", *config->file_base ? config->file_base : ".", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    for (i = 0; i < rebuild->count; i++) {
+        RebuildSegment *segment = &rebuild->segments[i];
+        
+        if (segment->flags & RebuildFlagMissing) {
+            sg_log(SG_LOG_WARNING, "segment %u is missing", rebuild->sequence + i);
+        } else if (segment->flags & RebuildFlagUnreadable) {
+            sg_log(SG_LOG_WARNING, "segment %u is unreadable", rebuild->sequence + i);
+        } else if (segment->flags & RebuildFlagDiscontinuity) {
+            sg_log(SG_LOG_WARNING, "segment %u is discontinuous, gap %.3f s", rebuild->sequence + i, segment->gap);
+        }
+    }
+    
+    sg_log(SG_LOG_INFO, "segments %u-%u (%s): %.3f s, missing %u, unreadable %u, discontinuities %u, scanned in %.3f s",
+           rebuild->sequence, rebuild->sequence + rebuild->count - 1, rebuild->extension, rebuild->duration,
+           rebuild->missing, rebuild->unreadable, rebuild->discontinuities, (sg_metrics_now() - start) / 1e9);
+    
+    if (!config->rebuild) {
+        ret = rebuild->missing || rebuild->unreadable || rebuild->discontinuities;
+        sg_rebuild_free(rebuild);
+        
+        return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    
+    if (rebuild->missing || rebuild->unreadable) {
+        sg_log(SG_LOG_FATAL, "index can't be rebuilt from incomplete segments");
+        exit(EXIT_FAILURE);
+    }
+    
+    if ((ret = segmenter_alloc_context(&output))) {
+        sg_log(SG_LOG_FATAL, "allocate context, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    segmenter_set_layout(output, &config->layout);
+    
+    if ((ret = segmenter_restore(output, config->file_base, config->media_file_name, rebuild->extension, config->duration,
+                                 rebuild->sequence, rebuild->durations, rebuild->count))) {
+        sg_log(SG_LOG_FATAL, "restore context, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    // same window segmenter leaves after the last segment
+    if (config->playlist_entries && config->type == IndexTypeLive && output->segment_index > config->playlist_entries + 1) {
+        segmenter_set_sequence(output, output->segment_index - 1 - config->playlist_entries, 0);
+    }
+    
+    if ((ret = segmenter_write_playlist(output, config->type, config->base_url, config->index_file))) {
+        sg_log(SG_LOG_FATAL, "write index, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    segmenter_free_context(output);
+    sg_rebuild_free(rebuild);
+    
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief report how segments were archived
+ */
+void log_archive(SegmenterContext *output) {
+    SegmenterArchive *archive = output->archive;
+    
+    if (archive) {
+        sg_log(SG_LOG_INFO, "archived segments: %u, linked: %lu, cloned: %lu, copied: %lu",
+               archive->count, archive->linked, archive->cloned, archive->copied);
+    }
+}
+
+/**
+ * @brief segment raw ADTS or MPEG audio input frame by frame, without demuxer and muxer
+ */
+int cut_audio(struct config *config, SegmenterCutter *cutter) {
+    SegmenterContext         *output;
+    SegmenterMetricsExporter *exporter   = NULL;
+    unsigned int             prev_index = 0;
+    int                      ret;
+    
+    if ((ret = segmenter_alloc_context(&output))) {
+        sg_log(SG_LOG_FATAL, "allocate context, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    if (configure_output(config, output, NULL, cutter, config->file_base)) {
+        exit(EXIT_FAILURE);
+    }
+    
+    if (config->metrics && ((ret = sg_metrics_exporter_start(&exporter, config->metrics, config->metrics_interval)) ||
+                            (ret = sg_metrics_exporter_add(exporter, &output->metrics, NULL)))) {
+        sg_log(SG_LOG_FATAL, "export metrics to '%s', %s", config->metrics, sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    if ((ret = segmenter_open(output))) {
+        sg_log(SG_LOG_FATAL, "open output, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    while ((ret = sg_cutter_write(cutter, output)) > 0) {
+        
+        if (prev_index < output->segment_index) {
+            prev_index = output->segment_index;
+            
+            if (config->playlist_entries && config->type == IndexTypeLive) {
+                segmenter_set_sequence(output, output->segment_index - config->playlist_entries, config->delete);
+            }
+            
+            segmenter_write_playlist(output, config->type, config->base_url, config->index_file);
+        }
+    }
+    
+    if (ret < 0) {
+        sg_log(SG_LOG_FATAL, "write frames, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    segmenter_close(output);
+    
+    if ((ret = segmenter_write_playlist(output, config->type, config->base_url, config->index_file))) {
+        sg_log(SG_LOG_FATAL, "write index, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
+    }
+    
+    sg_log(SG_LOG_INFO, "audio frames: %lu, skipped bytes: %lu", cutter->frames, cutter->skipped);
+    log_archive(output);
+    
+    if (exporter) {
+        sg_metrics_exporter_stop(exporter);
+    }
+    
+    segmenter_free_context(output);
+    sg_cutter_close(cutter);
+    
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
     
     sg_log_init(argv[0]);
@@ -82,6 +649,9 @@ int main(int argc, char **argv) {
         {"index-file",                 required_argument, NULL, 'i'},
         {"generate-variant-plist",     no_argument,       NULL, 'I'},
         {"base-media-file-name",       required_argument, NULL, 'B'},
+        {"shard",                      required_argument, NULL, 's'},
+        {"archive",                    required_argument, NULL, 'o'},
+        {"log-file",                   required_argument, NULL, 'L'},
         {"quiet",                      no_argument,       NULL, 'q'},
         {"audio-only",                 no_argument,       NULL, 'a'},
         {"video-only",                 no_argument,       NULL, 'A'},
@@ -89,10 +659,23 @@ int main(int argc, char **argv) {
         {"live-event",                 no_argument,       NULL, 'e'},
         {"sliding-window-entries",     required_argument, NULL, 'w'},
         {"delete-files",               no_argument,       NULL, 'D'},
+        {"encrypt",                    no_argument,       NULL, 'E'},
+        {"encrypt-key",                required_argument, NULL, 'k'},
+        {"encrypt-key-url",            required_argument, NULL, 'K'},
+        {"encrypt-rotate-keys",        required_argument, NULL, 'r'},
+        {"checksum",                   required_argument, NULL, 'c'},
+        {"http-connections",           required_argument, NULL, 'C'},
+        {"shm-slot-size",              required_argument, NULL, 'Z'},
+        {"metrics",                    required_argument, NULL, 'm'},
+        {"metrics-interval",           required_argument, NULL, 'M'},
+        {"channels",                   required_argument, NULL, 'n'},
+        {"threads",                    required_argument, NULL, 'T'},
+        {"audit",                      no_argument,       NULL, 'U'},
+        {"rebuild",                    no_argument,       NULL, 'R'},
         {0, 0, 0, 0}
     };
     
-    char* options_short = "vhb:t:f:i:IB:qaAlew:D";
+    char* options_short = "vhb:t:f:i:IB:s:o:L:qaAlew:DEk:K:r:c:C:Z:m:M:n:T:UR";
     
     struct config config;
     
@@ -100,14 +683,39 @@ int main(int argc, char **argv) {
     config.file_base            = DEFAULT_FILE_BASE;
     config.media_file_name = DEFAULT_BASE_MEDIA_FILE_NAME;
     config.index_file           = DEFAULT_INDEX_FILE;
-    config.source_file          = NULL;
+    config.source_files         = NULL;
+    config.sources              = 0;
+    config.log_file             = NULL;
     
+    config.layout.type   = LayoutTypeFlat;
+    config.layout.fanout = 0;
+    config.archive       = NULL;
+    
+    config.stat  = 0;
     config.media = MediaTypeAudio | MediaTypeVideo;
     config.type  = IndexTypeVOD;
     
     config.playlist_entries = 0;
     config.delete           = 0;
     
+    config.encrypt      = 0;
+    config.key          = NULL;
+    config.key_url      = NULL;
+    config.key_rotation = 0;
+    
+    config.checksum         = 0;
+    config.http_connections = 2;
+    config.shm_slot_size    = (size_t)DEFAULT_SHM_SLOT_SIZE * 1024 * 1024;
+    
+    config.metrics          = NULL;
+    config.metrics_interval = 5;
+    
+    config.channels = NULL;
+    config.threads  = 0;
+    
+    config.audit   = 0;
+    config.rebuild = 0;
+    
     config.duration = 10;
     
     int ret;
@@ -122,14 +730,23 @@ int main(int argc, char **argv) {
         switch (c) {
             case 'v': print_version();      exit(EXIT_SUCCESS); break;
             case 'h': print_usage(argv[0]); exit(EXIT_SUCCESS); break;
-                
+            
             case 'b': config.base_url        = optarg;       break;
             case 't': config.duration        = atof(optarg); break;
             case 'f': config.file_base       = optarg;       break;
             case 'i': config.index_file      = optarg;       break;
             case 'I': config.stat            = 1;            break;
             case 'B': config.media_file_name = optarg;       break;
-                
+            
+            case 's':
+                if (sg_layout_parse(&config.layout, optarg)) {
+                    fprintf(stderr ,"%s: invalid shard layout '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            
+            case 'o': config.archive  = optarg;                 break;
+            case 'L': config.log_file = optarg;                 break;
             case 'q': sg_log_set_level(SG_LOG_FATAL);           break;
             case 'a': config.media            = MediaTypeAudio; break;
             case 'A': config.media            = MediaTypeVideo; break;
@@ -138,6 +755,27 @@ int main(int argc, char **argv) {
             case 'w': config.playlist_entries = atoi(optarg);   break;
             case 'D': config.delete           = 1;              break;
             
+            case 'E': config.encrypt      = 1;                         break;
+            case 'k': config.encrypt      = 1; config.key = optarg;    break;
+            case 'K': config.key_url      = optarg;                    break;
+            case 'r': config.encrypt      = 1; config.key_rotation = atoi(optarg); break;
+            
+            case 'c':
+                if (!(config.checksum = parse_checksum(optarg))) {
+                    fprintf(stderr ,"%s: invalid checksum list '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            
+            case 'C': config.http_connections = atoi(optarg); break;
+            case 'Z': config.shm_slot_size    = (size_t)(atof(optarg) * 1024 * 1024); break;
+            case 'm': config.metrics          = optarg;       break;
+            case 'M': config.metrics_interval = atof(optarg); break;
+            case 'n': config.channels         = optarg;       break;
+            case 'T': config.threads          = atoi(optarg); break;
+            case 'U': config.audit            = 1;            break;
+            case 'R': config.rebuild          = 1;            break;
+            
             case '?':
                 fprintf(stderr ,"%s: invalid option '%s'\n", argv[0], argv[optind - 1]);
                 exit(EXIT_FAILURE);
@@ -146,76 +784,243 @@ int main(int argc, char **argv) {
     } while (c!= -1);
     
     if (optind < argc) {
-        config.source_file = argv[optind];
+        config.source_files = argv + optind;
+        config.sources      = argc - optind;
     }
     
-    if (!config.source_file){
+    if (sg_log_start(config.log_file, 0, 0)) {
+        fprintf(stderr, "%s: can't open log file '%s'\n", argv[0], config.log_file);
+        exit(EXIT_FAILURE);
+    }
+    
+    atexit(sg_log_stop);
+    
+    if (sg_is_shm_url(config.file_base) && (config.type != IndexTypeLive || !config.playlist_entries || !config.shm_slot_size)) {
+        sg_log(SG_LOG_FATAL, "shared memory output needs live index with sliding window");
+        exit(EXIT_FAILURE);
+    }
+    
+    // index, manifest and keys of every segment slot share SG_SHM_FILES file entries
+    if (sg_is_shm_url(config.file_base) && config.encrypt && !config.key && config.key_rotation &&
+        (config.playlist_entries + SHM_SPARE_SLOTS + config.key_rotation - 1) / config.key_rotation + 3 > SG_SHM_FILES) {
+        sg_log(SG_LOG_FATAL, "shared memory output keeps at most %d keys, rotate keys less often", SG_SHM_FILES - 3);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (sg_is_http_url(config.file_base) && (config.http_connections < SG_HTTP_MIN_CONNECTIONS || config.http_connections > SG_HTTP_MAX_CONNECTIONS)) {
+        sg_log(SG_LOG_FATAL, "http output needs %d to %d connections", SG_HTTP_MIN_CONNECTIONS, SG_HTTP_MAX_CONNECTIONS);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (config.archive && (sg_is_http_url(config.file_base) || sg_is_shm_url(config.file_base))) {
+        sg_log(SG_LOG_FATAL, "only segments in local directory can be archived");
+        exit(EXIT_FAILURE);
+    }
+    
+    if (config.archive && mkdir(config.archive, 0755) && errno != EEXIST) {
+        sg_log(SG_LOG_FATAL, "can't create directory '%s'", config.archive);
+        exit(EXIT_FAILURE);
+    }
+    
+    if (config.audit || config.rebuild) {
+        return rebuild_index(&config);
+    }
+    
+    if (config.channels) {
+        if (config.sources) {
+            sg_log(SG_LOG_FATAL, "source files can't be used with channel list");
+            exit(EXIT_FAILURE);
+        }
+        
+        return run_channels(&config);
+    }
+    
+    if (!config.sources){
         sg_log(SG_LOG_FATAL, "no source file was supplied");
         exit(EXIT_FAILURE);
     }
+    
+    SegmenterCutter *cutter = NULL;
+    
+    // raw ADTS or MPEG audio is cut at frame headers, other inputs go through libavformat
+    if (config.sources == 1 && config.media == MediaTypeAudio && !config.stat && !sg_cutter_open(&cutter, config.source_files[0])) {
+        if (!(ret = sg_cutter_probe(cutter))) {
+            return cut_audio(&config, cutter);
+        }
         
-    AVFormatContext  *source_context = NULL;
-    SegmenterContext *output_context = NULL;
+        if (ret != SGERROR(SGERROR_UNSUPPORTED_FORMAT) && !cutter->regular) {
+            sg_log(SG_LOG_FATAL, "can't read input file '%s', %s", config.source_files[0], sg_strerror(SGUNERROR(ret)));
+            exit(EXIT_FAILURE);
+        }
+        
+        // regular file is mapped by libavformat input again, pipe can't be read twice
+        if (cutter->regular) {
+            sg_cutter_close(cutter);
+            cutter = NULL;
+        }
+    }
     
     av_register_all();
     
-    if(avformat_open_input(&source_context, config.source_file, NULL, NULL)) {
-        sg_log(SG_LOG_FATAL, "can't open input file '%s'", config.source_file);
+    struct rendition   *renditions = (struct rendition*)calloc(config.sources, sizeof(struct rendition));
+    SegmenterContext   **contexts  = (SegmenterContext**)calloc(config.sources, sizeof(SegmenterContext*));
+    char               **uris      = (char**)calloc(config.sources, sizeof(char*));
+    SegmenterScheduler *scheduler  = NULL;
+    SegmenterSink      master;
+    int                i;
+    
+    if (!renditions || !contexts || !uris) {
+        sg_log(SG_LOG_FATAL, "allocate renditions, %s", sg_strerror(SGERROR_MEM_ALLOC));
         exit(EXIT_FAILURE);
     }
     
-    if (avformat_find_stream_info(source_context, NULL)) {
-        sg_log(SG_LOG_WARNING, "Warning: can't load input file info");
+    if (config.sources > 1 && (ret = sg_scheduler_alloc(&scheduler, DEFAULT_BOUNDARY_TOLERANCE))) {
+        sg_log(SG_LOG_FATAL, "allocate scheduler, %s", sg_strerror(SGUNERROR(ret)));
+        exit(EXIT_FAILURE);
     }
     
-    if ((ret = segmenter_alloc_context(&output_context))) {
-        sg_log(SG_LOG_FATAL, "allocate context, %s", sg_strerror(SGUNERROR(ret)));
-        exit(EXIT_FAILURE);
+    if (config.stat || config.sources > 1) {
+        if (sg_is_http_url(config.file_base)) {
+            ret = sg_http_sink_init(&master, config.file_base, 1);
+        } else if (sg_is_shm_url(config.file_base)) {
+            // renditions use stores named after their subdirectory, master playlist gets its own
+            ret = config.sources > 1 ? sg_shm_sink_init(&master, config.file_base, 0, 0) : SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+        } else {
+            ret = sg_file_sink_init(&master, config.file_base);
+        }
+        
+        if (ret) {
+            sg_log(SG_LOG_FATAL, "master playlist output, %s", sg_strerror(SGUNERROR(ret)));
+            exit(EXIT_FAILURE);
+        }
     }
     
+    renditions[0].cutter = cutter;
     
-    if ((ret = segmenter_init(output_context, source_context, config.file_base, config.media_file_name, config.duration, config.media))) {
-        sg_log(SG_LOG_FATAL, "initialize context, %s", sg_strerror(SGUNERROR(ret)));
-        exit(EXIT_FAILURE);
+    for (i = 0; i < config.sources; i++) {
+        open_rendition(&config, &renditions[i], i, scheduler);
+        
+        contexts[i] = renditions[i].output;
+        uris[i]     = renditions[i].uri;
     }
     
-    if((ret = segmenter_open(output_context))){
-        sg_log(SG_LOG_FATAL, "open output, %s", sg_strerror(SGUNERROR(ret)));
+    SegmenterMetricsExporter *exporter = NULL;
+    
+    if (config.metrics && (ret = sg_metrics_exporter_start(&exporter, config.metrics, config.metrics_interval))) {
+        sg_log(SG_LOG_FATAL, "export metrics to '%s', %s", config.metrics, sg_strerror(SGUNERROR(ret)));
         exit(EXIT_FAILURE);
     }
     
-    AVPacket pkt;
-    unsigned int prev_index = 0;
+    for (i = 0; exporter && i < config.sources; i++) {
+        char label[32];
+        
+        snprintf(label, sizeof(label), "rendition=\"%d\"", i);
+        
+        if ((ret = sg_metrics_exporter_add(exporter, &contexts[i]->metrics, config.sources > 1 ? label : NULL))) {
+            sg_log(SG_LOG_FATAL, "export metrics, %s", sg_strerror(SGUNERROR(ret)));
+            exit(EXIT_FAILURE);
+        }
+    }
     
-    while (av_read_frame(source_context, &pkt) >= 0) {
+    for (i = 0; i < config.sources; i++) {
+        read_rendition(&renditions[i]);
+    }
+    
+    while (1) {
+        struct rendition *rendition = NULL;
+        
+        // renditions are read in timestamp order, so boundaries are scheduled before any rendition passes them
+        for (i = 0; i < config.sources; i++) {
+            if (renditions[i].pending && (!rendition || renditions[i].time < rendition->time)) {
+                rendition = &renditions[i];
+            }
+        }
         
-        if ((ret = segmenter_write_pkt(output_context, source_context, &pkt))) {
+        if (!rendition) {
+            break;
+        }
+        
+        SegmenterContext *output_context = rendition->output;
+        
+        ret = segmenter_write_pkt(output_context, rendition->source, &rendition->pkt);
+        
+        av_packet_unref(&rendition->pkt);
+        
+        if (ret) {
             sg_log(SG_LOG_FATAL, "write packet, %s", sg_strerror(SGUNERROR(ret)));
             exit(EXIT_FAILURE);
         }
         
-        if (prev_index < output_context->segment_index) {
-            prev_index = output_context->segment_index;
+        if (rendition->prev_index < output_context->segment_index) {
+            rendition->prev_index = output_context->segment_index;
             
             if (config.playlist_entries && config.type == IndexTypeLive) {
                 segmenter_set_sequence(output_context, output_context->segment_index - config.playlist_entries, config.delete);
             }
             
-            segmenter_write_playlist(output_context, config.type, config.base_url, config.index_file);
+            segmenter_write_playlist(output_context, config.type, rendition->base_url, config.index_file);
+            
+            if ((config.stat || config.sources > 1) && config.type != IndexTypeVOD && master_ready(renditions, config.sources)) {
+                segmenter_write_master_playlist(contexts, uris, config.sources, &master, DEFAULT_MASTER_INDEX_FILE);
+            }
         }
+        
+        read_rendition(rendition);
     }
     
-    segmenter_close(output_context);
+    for (i = 0; i < config.sources; i++) {
+        SegmenterContext *output_context = renditions[i].output;
+        
+        segmenter_close(output_context);
+        
+        if ((ret = segmenter_write_playlist(output_context, config.type, renditions[i].base_url, config.index_file))) {
+            sg_log(SG_LOG_FATAL, "write index, %s", sg_strerror(SGUNERROR(ret)));
+            exit(EXIT_FAILURE);
+        }
+        
+        log_archive(output_context);
+    }
     
-    if ((ret = segmenter_write_playlist(output_context, config.type, config.base_url, config.index_file))) {
-        sg_log(SG_LOG_FATAL, "write index, %s", sg_strerror(SGUNERROR(ret)));
-        exit(EXIT_FAILURE);
+    if (config.stat || config.sources > 1) {
+        if ((ret = segmenter_write_master_playlist(contexts, uris, config.sources, &master, DEFAULT_MASTER_INDEX_FILE))) {
+            sg_log(SG_LOG_FATAL, "write master index, %s", sg_strerror(SGUNERROR(ret)));
+            exit(EXIT_FAILURE);
+        }
+        
+        master.free(master.opaque);
+    }
+    
+    if (scheduler) {
+        sg_log(SG_LOG_INFO, "rendition boundaries: %lu, aligned: %lu, skew max %.1f ms, average %.1f ms",
+               scheduler->boundaries, scheduler->aligned, scheduler->skew_max * 1000,
+               scheduler->boundaries ? scheduler->skew_sum * 1000 / scheduler->boundaries : 0);
+        
+        sg_scheduler_free(scheduler);
     }
     
-    segmenter_free_context(output_context);
+    if (exporter) {
+        sg_metrics_exporter_stop(exporter);
+    }
+    
+    for (i = 0; i < config.sources; i++) {
+        segmenter_free_context(renditions[i].output);
+        sg_input_close(&renditions[i].source);
+        
+        if (renditions[i].cutter) {
+            sg_cutter_close(renditions[i].cutter);
+        }
+        
+        if (config.sources > 1) {
+            free(renditions[i].file_base);
+            free(renditions[i].base_url);
+            free(renditions[i].uri);
+        }
+    }
     
-    avformat_close_input(&source_context);
+    free(renditions);
+    free(contexts);
+    free(uris);
     
     
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,445 @@
+// metrics.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "metrics.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const uint64_t kMetricsBuckets[SG_METRICS_BUCKETS] = {
+    5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 50000000, 100000000, 500000000, 1000000000
+};
+
+static const char *kMetricsUnixPrefix  = "unix:";
+static const int   kMetricsPollTimeout = 250;
+static const int   kMetricsRecvTimeout = 100;
+
+/**
+ * @brief monotonic clock in nanoseconds, start value for sg_metrics_observe
+ */
+uint64_t sg_metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sg_metrics_add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+void sg_metrics_set(double *gauge, double value) {
+    __atomic_store(gauge, &value, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_load(uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static double metrics_get(double *gauge) {
+    double value;
+    __atomic_load(gauge, &value, __ATOMIC_RELAXED);
+    
+    return value;
+}
+
+/**
+ * @brief record time elapsed since start
+ * @param histogram latency histogram
+ * @param start value returned by sg_metrics_now
+ */
+void sg_metrics_observe(SegmenterHistogram *histogram, uint64_t start) {
+    uint64_t elapsed = sg_metrics_now() - start;
+    int      i       = 0;
+    
+    while (i < SG_METRICS_BUCKETS && elapsed > kMetricsBuckets[i]) {
+        i++;
+    }
+    
+    sg_metrics_add(&histogram->buckets[i], 1);
+    sg_metrics_add(&histogram->count, 1);
+    sg_metrics_add(&histogram->sum, elapsed);
+}
+
+typedef enum {
+    MetricTypeCounter,
+    MetricTypeSeconds,
+    MetricTypeGauge,
+    MetricTypeHistogram,
+    MetricTypeLag
+} MetricType;
+
+static const struct {
+    MetricType type;
+    const char *name;
+    const char *help;
+    size_t     offset;
+} kMetrics[] = {
+    { MetricTypeCounter,   "segmenter_packets_total",          "Packets written to output.",              offsetof(SegmenterMetrics, packets) },
+    { MetricTypeCounter,   "segmenter_bytes_written_total",    "Segment bytes passed to output sink.",    offsetof(SegmenterMetrics, bytes) },
+    { MetricTypeCounter,   "segmenter_segments_total",         "Segments finished.",                      offsetof(SegmenterMetrics, segments) },
+    { MetricTypeCounter,   "segmenter_playlists_total",        "Index files written.",                    offsetof(SegmenterMetrics, playlists) },
+    { MetricTypeCounter,   "segmenter_segments_removed_total", "Expired segments removed.",               offsetof(SegmenterMetrics, removed) },
+    { MetricTypeCounter,   "segmenter_errors_total",           "Failed packet and index writes.",         offsetof(SegmenterMetrics, errors) },
+    { MetricTypeSeconds,   "segmenter_cpu_seconds_total",      "CPU time spent on stream by channel engine.", offsetof(SegmenterMetrics, cpu_time) },
+    
+    { MetricTypeHistogram, "segmenter_write_pkt_seconds",      "Time spent in segmenter_write_pkt.",      offsetof(SegmenterMetrics, write_pkt) },
+    { MetricTypeHistogram, "segmenter_finish_segment_seconds", "Time spent finishing segment.",           offsetof(SegmenterMetrics, finish_segment) },
+    { MetricTypeHistogram, "segmenter_write_playlist_seconds", "Time spent in segmenter_write_playlist.", offsetof(SegmenterMetrics, write_playlist) },
+    { MetricTypeHistogram, "segmenter_clear_segments_seconds", "Time spent removing expired segments.",   offsetof(SegmenterMetrics, clear_segments) },
+    
+    { MetricTypeGauge,     "segmenter_avg_bitrate_bits_per_second", "Average segment bitrate.",           offsetof(SegmenterMetrics, avg_bitrate) },
+    { MetricTypeGauge,     "segmenter_max_bitrate_bits_per_second", "Maximum segment bitrate.",           offsetof(SegmenterMetrics, max_bitrate) },
+    { MetricTypeGauge,     "segmenter_input_pts_seconds",      "Timestamp of last input packet.",         offsetof(SegmenterMetrics, input_pts) },
+    { MetricTypeLag,       "segmenter_pts_lag_seconds",        "Input timestamp not yet published in finished segments.", 0 },
+    { MetricTypeGauge,     "segmenter_boundary_skew_seconds",  "Distance of last segment boundary from boundary of rendition set.", offsetof(SegmenterMetrics, skew) },
+    { MetricTypeGauge,     "segmenter_memory_bytes",           "Memory held by stream buffers in channel engine.", offsetof(SegmenterMetrics, memory) }
+};
+
+static const char *kMetricTypes[] = { "counter", "counter", "gauge", "histogram", "gauge" };
+
+static void format_histogram(FILE *out, const char *name, const char *label, SegmenterHistogram *histogram) {
+    const char *separator = label ? "," : "";
+    uint64_t   count      = 0;
+    int        i;
+    
+    label = label ? label : "";
+    
+    for (i = 0; i < SG_METRICS_BUCKETS; i++) {
+        count += metrics_load(&histogram->buckets[i]);
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, separator, kMetricsBuckets[i] / 1e9, (unsigned long long)count);
+    }
+    
+    count += metrics_load(&histogram->buckets[SG_METRICS_BUCKETS]);
+    
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, separator, (unsigned long long)count);
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, *label ? "{" : "", label, *label ? "}" : "", metrics_load(&histogram->sum) / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, *label ? "{" : "", label, *label ? "}" : "", (unsigned long long)count);
+}
+
+static void format_sample(FILE *out, int index, SegmenterMetrics *metrics, const char *label) {
+    const char *name  = kMetrics[index].name;
+    void       *value = (uint8_t*)metrics + kMetrics[index].offset;
+    
+    if (kMetrics[index].type == MetricTypeHistogram) {
+        format_histogram(out, name, label, (SegmenterHistogram*)value);
+        return;
+    }
+    
+    fprintf(out, label ? "%s{%s} " : "%s ", name, label);
+    
+    switch (kMetrics[index].type) {
+        case MetricTypeCounter:
+            fprintf(out, "%llu\n", (unsigned long long)metrics_load((uint64_t*)value));
+            break;
+        case MetricTypeSeconds:
+            fprintf(out, "%.6f\n", metrics_load((uint64_t*)value) / 1e9);
+            break;
+        case MetricTypeLag:
+            fprintf(out, "%.6f\n", metrics_get(&metrics->input_pts) - metrics_get(&metrics->output_pts));
+            break;
+        default:
+            fprintf(out, "%.6f\n", metrics_get((double*)value));
+            break;
+    }
+}
+
+/**
+ * @brief render metrics in Prometheus text exposition format
+ * @param metrics metrics of segmenter contexts
+ * @param labels label of every context (e.g. channel="name"), NULL for single unlabeled context
+ * @param count number of contexts
+ * @param buf output text, should be freed by caller
+ * @param size output text size
+ * @return 0 on success, negative error code on failure
+ */
+int sg_metrics_format(SegmenterMetrics **metrics, char **labels, int count, char **buf, size_t *size) {
+    FILE *out = open_memstream(buf, size);
+    int  i, j;
+    
+    if (!out) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    for (i = 0; i < sizeof(kMetrics) / sizeof(kMetrics[0]); i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", kMetrics[i].name, kMetrics[i].help, kMetrics[i].name, kMetricTypes[kMetrics[i].type]);
+    
+        for (j = 0; j < count; j++) {
+            format_sample(out, i, metrics[j], labels ? labels[j] : NULL);
+        }
+    }
+    
+    return fclose(out) ? SGERROR(SGERROR_MEM_ALLOC) : 0;
+}
+
+static int exporter_format(SegmenterMetricsExporter *exporter, char **buf, size_t *size) {
+    int ret;
+    
+    pthread_mutex_lock(&exporter->lock);
+    ret = sg_metrics_format(exporter->metrics, exporter->labels, exporter->count, buf, size);
+    pthread_mutex_unlock(&exporter->lock);
+    
+    return ret;
+}
+
+/**
+ * @brief replace metrics file, readers never see partially written file
+ */
+static void export_file(SegmenterMetricsExporter *exporter) {
+    char   *buf, *tmp;
+    size_t size;
+    FILE   *out;
+    
+    if (exporter_format(exporter, &buf, &size)) {
+        return;
+    }
+    
+    if ((tmp = (char*)sg_malloc(strlen(exporter->path) + 5))) {
+        sprintf(tmp, "%s.tmp", exporter->path);
+        
+        if ((out = fopen(tmp, "w"))) {
+            if (fwrite(buf, 1, size, out) == size && !fclose(out)) {
+                rename(tmp, exporter->path);
+            } else {
+                unlink(tmp);
+            }
+        }
+        
+        sg_free(tmp);
+    }
+    
+    sg_free(buf);
+}
+
+/**
+ * @brief answer one client on unix socket, plain HTTP GET gets HTTP response
+ *        (curl --unix-socket), anything else gets bare text (nc -U)
+ */
+static void export_client(SegmenterMetricsExporter *exporter, int fd) {
+    struct timeval timeout = { 0, kMetricsRecvTimeout * 1000 };
+    char           request[1024], header[128];
+    char           *buf;
+    size_t         size;
+    ssize_t        length;
+    
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    length = recv(fd, request, sizeof(request), 0);
+    
+    if (exporter_format(exporter, &buf, &size)) {
+        return;
+    }
+    
+    if (length >= 4 && !memcmp(request, "GET ", 4)) {
+        length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+        send(fd, header, length, MSG_NOSIGNAL);
+    }
+    
+    send(fd, buf, size, MSG_NOSIGNAL);
+    
+    sg_free(buf);
+}
+
+static void export_socket(SegmenterMetricsExporter *exporter) {
+    struct pollfd pfd = { exporter->listener, POLLIN, 0 };
+    int           fd;
+    
+    if (poll(&pfd, 1, kMetricsPollTimeout) <= 0 || !(pfd.revents & POLLIN)) {
+        return;
+    }
+    
+    if ((fd = accept(exporter->listener, NULL, NULL)) >= 0) {
+        export_client(exporter, fd);
+        close(fd);
+    }
+}
+
+static void* exporter_run(void *opaque) {
+    SegmenterMetricsExporter *exporter = (SegmenterMetricsExporter*)opaque;
+    struct timespec          deadline;
+    double                   wait;
+    
+    pthread_mutex_lock(&exporter->lock);
+    
+    while (!exporter->stop) {
+        if (exporter->listener >= 0) {
+            pthread_mutex_unlock(&exporter->lock);
+            export_socket(exporter);
+            pthread_mutex_lock(&exporter->lock);
+            continue;
+        }
+        
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        
+        wait              = deadline.tv_nsec / 1e9 + exporter->interval;
+        deadline.tv_sec  += (time_t)wait;
+        deadline.tv_nsec  = (long)((wait - (time_t)wait) * 1e9);
+        
+        if (pthread_cond_timedwait(&exporter->cond, &exporter->lock, &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&exporter->lock);
+            export_file(exporter);
+            pthread_mutex_lock(&exporter->lock);
+        }
+    }
+    
+    pthread_mutex_unlock(&exporter->lock);
+    
+    return NULL;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un address;
+    int                fd;
+    
+    if (strlen(path) >= sizeof(address.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    
+    unlink(path);
+    
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) || listen(fd, 8)) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+/**
+ * @brief start background metrics export
+ * @param exporter output exporter
+ * @param target file replaced every interval, or unix:<path> for socket answering every connection
+ * @param interval file export interval in seconds
+ * @return 0 on success, negative error code on failure
+ */
+int sg_metrics_exporter_start(SegmenterMetricsExporter **exporter, const char *target, double interval) {
+    SegmenterMetricsExporter *_exporter;
+    int                      unix_socket = !strncmp(target, kMetricsUnixPrefix, strlen(kMetricsUnixPrefix));
+    
+    if (!(_exporter = (SegmenterMetricsExporter*)sg_calloc(1, sizeof(SegmenterMetricsExporter))) ||
+        !(_exporter->path = sg_strdup(unix_socket ? target + strlen(kMetricsUnixPrefix) : target))) {
+        sg_free(_exporter);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _exporter->interval = interval > 0 ? interval : 1;
+    _exporter->listener = -1;
+    
+    if (unix_socket && (_exporter->listener = listen_unix(_exporter->path)) < 0) {
+        sg_free(_exporter->path);
+        sg_free(_exporter);
+        return SGERROR(SGERROR_NETWORK);
+    }
+    
+    pthread_mutex_init(&_exporter->lock, NULL);
+    pthread_cond_init(&_exporter->cond, NULL);
+    
+    if (pthread_create(&_exporter->thread, NULL, exporter_run, _exporter)) {
+        _exporter->thread = 0;
+        sg_metrics_exporter_stop(_exporter);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    *exporter = _exporter;
+    
+    return 0;
+}
+
+/**
+ * @brief stop metrics export, file target receives final values
+ * @param exporter metrics exporter
+ */
+void sg_metrics_exporter_stop(SegmenterMetricsExporter *exporter) {
+    int i;
+    
+    if (exporter->thread) {
+        pthread_mutex_lock(&exporter->lock);
+        exporter->stop = 1;
+        pthread_cond_signal(&exporter->cond);
+        pthread_mutex_unlock(&exporter->lock);
+        
+        pthread_join(exporter->thread, NULL);
+    }
+    
+    if (exporter->listener >= 0) {
+        close(exporter->listener);
+        unlink(exporter->path);
+    } else {
+        export_file(exporter);
+    }
+    
+    pthread_mutex_destroy(&exporter->lock);
+    pthread_cond_destroy(&exporter->cond);
+    
+    for (i = 0; i < exporter->count; i++) {
+        sg_free(exporter->labels[i]);
+    }
+    
+    sg_free(exporter->metrics);
+    sg_free(exporter->labels);
+    sg_free(exporter->path);
+    sg_free(exporter);
+}
+
+/**
+ * @brief add metrics of segmenter context to export, may be called while exporter is running
+ * @param exporter metrics exporter
+ * @param metrics metrics of segmenter context, should stay valid until exporter is stopped
+ * @param label Prometheus label of context (e.g. channel="name"), NULL when exporting single context
+ * @return 0 on success, negative error code on failure
+ */
+int sg_metrics_exporter_add(SegmenterMetricsExporter *exporter, SegmenterMetrics *metrics, const char *label) {
+    SegmenterMetrics **_metrics;
+    char             **labels, *_label = NULL;
+    int              ret = 0;
+    
+    pthread_mutex_lock(&exporter->lock);
+    
+    if ((_metrics = (SegmenterMetrics**)sg_realloc(exporter->metrics, (exporter->count + 1) * sizeof(SegmenterMetrics*)))) {
+        exporter->metrics = _metrics;
+    }
+    
+    if ((labels = (char**)sg_realloc(exporter->labels, (exporter->count + 1) * sizeof(char*)))) {
+        exporter->labels = labels;
+    }
+    
+    if (!_metrics || !labels || (label && !(_label = sg_strdup(label)))) {
+        ret = SGERROR(SGERROR_MEM_ALLOC);
+    } else {
+        exporter->metrics[exporter->count] = metrics;
+        exporter->labels[exporter->count]  = _label;
+        exporter->count++;
+    }
+    
+    pthread_mutex_unlock(&exporter->lock);
+    
+    return ret;
+}
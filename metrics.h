@@ -0,0 +1,89 @@
+// metrics.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef __SG_METRICS__
+#define __SG_METRICS__
+
+#define SG_METRICS_BUCKETS 12
+
+/**
+ * Latency histogram with fixed buckets (see kMetricsBuckets in metrics.c),
+ * counts are per bucket and accumulated only when exported.
+ */
+typedef struct {
+    uint64_t buckets[SG_METRICS_BUCKETS + 1];
+    uint64_t count;
+    uint64_t sum;
+} SegmenterHistogram;
+
+/**
+ * Runtime counters of one segmenter context. Writers update them with relaxed atomics
+ * on the hot path, exporter reads them from another thread without taking context lock.
+ */
+typedef struct {
+    uint64_t           packets;
+    uint64_t           bytes;
+    uint64_t           segments;
+    uint64_t           playlists;
+    uint64_t           removed;
+    uint64_t           errors;
+    
+    SegmenterHistogram write_pkt;
+    SegmenterHistogram finish_segment;
+    SegmenterHistogram write_playlist;
+    SegmenterHistogram clear_segments;
+    
+    double             avg_bitrate;
+    double             max_bitrate;
+    double             input_pts;
+    double             output_pts;
+    double             skew;
+    
+    uint64_t           cpu_time;
+    double             memory;
+} SegmenterMetrics;
+
+typedef struct {
+    SegmenterMetrics **metrics;
+    char             **labels;
+    int              count;
+    
+    char             *path;
+    double           interval;
+    int              listener;
+    
+    int              stop;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    pthread_t        thread;
+} SegmenterMetricsExporter;
+
+uint64_t sg_metrics_now(void);
+void     sg_metrics_add(uint64_t *counter, uint64_t value);
+void     sg_metrics_set(double *gauge, double value);
+void     sg_metrics_observe(SegmenterHistogram *histogram, uint64_t start);
+
+int  sg_metrics_format(SegmenterMetrics **metrics, char **labels, int count, char **buf, size_t *size);
+
+int  sg_metrics_exporter_start(SegmenterMetricsExporter **exporter, const char *target, double interval);
+int  sg_metrics_exporter_add(SegmenterMetricsExporter *exporter, SegmenterMetrics *metrics, const char *label);
+void sg_metrics_exporter_stop(SegmenterMetricsExporter *exporter);
+
+#endif
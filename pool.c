@@ -0,0 +1,248 @@
+// pool.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "pool.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t kPoolQueueSize = 64;
+
+typedef struct {
+    SegmenterPool *pool;
+    int           index;
+} PoolWorker;
+
+static int queue_push(PoolQueue *queue, PoolJobFunc func, void *opaque) {
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    if (queue->bottom - queue->top == queue->size) {
+        PoolJob *jobs = (PoolJob*)sg_malloc(2 * queue->size * sizeof(PoolJob));
+        size_t  i;
+        
+        if (!jobs) {
+            pthread_mutex_unlock(&queue->lock);
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        for (i = queue->top; i < queue->bottom; i++) {
+            jobs[i % (2 * queue->size)] = queue->jobs[i % queue->size];
+        }
+        
+        sg_free(queue->jobs);
+        
+        queue->jobs  = jobs;
+        queue->size *= 2;
+    }
+    
+    queue->jobs[queue->bottom % queue->size] = (PoolJob){ func, opaque };
+    queue->bottom++;
+    
+    pthread_mutex_unlock(&queue->lock);
+    
+    return 0;
+}
+
+/**
+ * @brief take job from queue, bottom end for owner, top end for thieves
+ * @return 1 if job was taken, 0 if queue is empty
+ */
+static int queue_pop(PoolQueue *queue, int steal, PoolJob *job) {
+    int ret = 0;
+    
+    pthread_mutex_lock(&queue->lock);
+    
+    if (queue->bottom != queue->top) {
+        if (steal) {
+            *job = queue->jobs[queue->top++ % queue->size];
+        } else {
+            *job = queue->jobs[--queue->bottom % queue->size];
+        }
+        
+        ret = 1;
+    }
+    
+    pthread_mutex_unlock(&queue->lock);
+    
+    return ret;
+}
+
+static int pool_take(SegmenterPool *pool, int index, PoolJob *job) {
+    int i;
+    
+    if (queue_pop(&pool->queues[index], 0, job)) {
+        return 1;
+    }
+    
+    for (i = 1; i < pool->queues_count; i++) {
+        if (queue_pop(&pool->queues[(index + i) % pool->queues_count], 1, job)) {
+            __atomic_fetch_add(&pool->steals, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+static void* worker_run(void *opaque) {
+    PoolWorker    *worker = (PoolWorker*)opaque;
+    SegmenterPool *pool   = worker->pool;
+    PoolJob       job;
+    
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        
+        while (!pool->pending && !pool->stop) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        
+        pthread_mutex_unlock(&pool->lock);
+        
+        if (!pool_take(pool, worker->index, &job)) {
+            continue;
+        }
+        
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+        
+        job.func(job.opaque);
+    }
+    
+    sg_free(worker);
+    
+    return NULL;
+}
+
+/**
+ * @brief start thread pool
+ * @param pool output pool
+ * @param threads number of worker threads
+ * @return 0 on success, negative error code on failure
+ */
+int sg_pool_alloc(SegmenterPool **pool, int threads) {
+    SegmenterPool *_pool = (SegmenterPool*)sg_calloc(1, sizeof(SegmenterPool));
+    PoolWorker    *worker;
+    int           i;
+    
+    if (!_pool) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    pthread_mutex_init(&_pool->lock, NULL);
+    pthread_cond_init(&_pool->cond, NULL);
+    
+    if (!(_pool->queues = (PoolQueue*)sg_calloc(threads, sizeof(PoolQueue))) ||
+        !(_pool->workers = (pthread_t*)sg_calloc(threads, sizeof(pthread_t)))) {
+        sg_pool_free(_pool);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    for (i = 0; i < threads; i++) {
+        if (!(_pool->queues[i].jobs = (PoolJob*)sg_malloc(kPoolQueueSize * sizeof(PoolJob)))) {
+            sg_pool_free(_pool);
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        pthread_mutex_init(&_pool->queues[i].lock, NULL);
+        
+        _pool->queues[i].size = kPoolQueueSize;
+        _pool->queues_count++;
+    }
+    
+    for (i = 0; i < threads; i++) {
+        if (!(worker = (PoolWorker*)sg_malloc(sizeof(PoolWorker)))) {
+            sg_pool_free(_pool);
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        worker->pool  = _pool;
+        worker->index = i;
+        
+        if (pthread_create(&_pool->workers[i], NULL, worker_run, worker)) {
+            sg_free(worker);
+            sg_pool_free(_pool);
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        _pool->threads++;
+    }
+    
+    *pool = _pool;
+    
+    return 0;
+}
+
+/**
+ * @brief stop workers after their current jobs, queued jobs are discarded
+ * @param pool thread pool
+ */
+void sg_pool_free(SegmenterPool *pool) {
+    int i;
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (i = 0; i < pool->threads; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    
+    for (i = 0; i < pool->queues_count; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        sg_free(pool->queues[i].jobs);
+    }
+    
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    
+    sg_free(pool->queues);
+    sg_free(pool->workers);
+    sg_free(pool);
+}
+
+/**
+ * @brief queue job, it runs on preferred worker unless another worker is idle and steals it
+ * @param pool thread pool
+ * @param queue preferred worker, jobs of one owner submitted to the same worker share its cache
+ * @param func job function
+ * @param opaque job argument
+ * @return 0 on success, negative error code on failure
+ */
+int sg_pool_submit(SegmenterPool *pool, int queue, PoolJobFunc func, void *opaque) {
+    int ret;
+    
+    if ((ret = queue_push(&pool->queues[queue % pool->queues_count], func, opaque))) {
+        return ret;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    
+    return 0;
+}
@@ -0,0 +1,65 @@
+// pool.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifndef __SG_POOL__
+#define __SG_POOL__
+
+typedef void (*PoolJobFunc)(void *opaque);
+
+typedef struct {
+    PoolJobFunc func;
+    void        *opaque;
+} PoolJob;
+
+/**
+ * Job deque of one worker. Owner takes newest job from the bottom,
+ * idle workers steal oldest job from the top.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    
+    PoolJob         *jobs;
+    size_t          size;
+    size_t          top, bottom;
+} PoolQueue;
+
+/**
+ * Work-stealing thread pool.
+ */
+typedef struct {
+    PoolQueue       *queues;
+    int             queues_count;
+    
+    pthread_t       *workers;
+    int             threads;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    size_t          pending;
+    int             stop;
+    
+    unsigned long   steals;
+} SegmenterPool;
+
+int  sg_pool_alloc(SegmenterPool **pool, int threads);
+void sg_pool_free(SegmenterPool *pool);
+
+int  sg_pool_submit(SegmenterPool *pool, int queue, PoolJobFunc func, void *opaque);
+
+#endif
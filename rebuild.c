@@ -0,0 +1,619 @@
+// rebuild.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "rebuild.h"
+#include "alloc.h"
+#include "frame.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TS_PACKET_SIZE 188
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+static const char         *kRebuildExtensions[] = { "ts", "aac", "mp3" };
+static const size_t       kRebuildChunk         = TS_PACKET_SIZE * 128;
+static const unsigned int kRebuildBatch         = 64;
+static const double       kRebuildMaxGap        = 1.0;
+static const int64_t      kNoTimestamp          = INT64_MIN;
+
+typedef struct {
+    SegmenterRebuild *rebuild;
+    unsigned int     first, last;
+} RebuildJob;
+
+/**
+ * @brief difference of 33 bit timestamps, wrap around is taken into account
+ */
+static int64_t pts_diff(int64_t from, int64_t to) {
+    int64_t diff = (to - from) & ((1LL << 33) - 1);
+    
+    return diff > (1LL << 32) ? diff - (1LL << 33) : diff;
+}
+
+/**
+ * @brief collect PES timestamps from MPEG-TS packets, first timestamp of every stream is
+ *        kept as start, the last one as end, video random access points as key
+ * @return 0 on success, negative value when data isn't MPEG-TS
+ */
+static int ts_parse(RebuildSegment *segment, const uint8_t *buf, size_t size) {
+    const uint8_t *packet, *pes;
+    int64_t       pts;
+    int           offset, kind, key;
+    
+    for (packet = buf; packet + TS_PACKET_SIZE <= buf + size; packet += TS_PACKET_SIZE) {
+        
+        if (packet[0] != 0x47) {
+            return -1;
+        }
+        
+        if (!(packet[1] & 0x40) || !(packet[3] & 0x10)) {
+            continue;
+        }
+        
+        offset = 4;
+        key    = 0;
+        
+        if (packet[3] & 0x20) {
+            offset += 1 + packet[4];
+            key     = packet[4] && (packet[5] & 0x40);
+        }
+        
+        if (offset + 14 > TS_PACKET_SIZE) {
+            continue;
+        }
+        
+        pes = packet + offset;
+        
+        if (pes[0] || pes[1] || pes[2] != 0x01 || !(pes[7] & 0x80)) {
+            continue;
+        }
+        
+        if ((pes[3] & 0xf0) == 0xe0) {
+            kind = 0;
+        } else if ((pes[3] & 0xe0) == 0xc0 || pes[3] == 0xbd) {
+            kind = 1;
+        } else {
+            continue;
+        }
+        
+        pts = ((int64_t)(pes[9] & 0x0e) << 29) | (pes[10] << 22) | ((pes[11] & 0xfe) << 14) | (pes[12] << 7) | (pes[13] >> 1);
+        
+        if (segment->start[kind] == kNoTimestamp) {
+            segment->start[kind] = pts;
+        }
+        
+        segment->end[kind] = pts;
+        
+        if (!kind && key) {
+            segment->key = pts;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief parse part of MPEG-TS file
+ * @return 0 on success, negative value on failure
+ */
+static int ts_read(RebuildSegment *segment, int fd, uint64_t offset, uint64_t length, uint8_t *buf) {
+    ssize_t size;
+    
+    while (length) {
+        if ((size = pread(fd, buf, min(length, kRebuildChunk), offset)) <= 0 || size % TS_PACKET_SIZE) {
+            return -1;
+        }
+        
+        if (ts_parse(segment, buf, size)) {
+            return -1;
+        }
+        
+        offset += size;
+        length -= size;
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief read timestamps at the start of MPEG-TS segment and at its end, whole file is
+ *        read only when it has no timestamps near the start
+ */
+static int ts_probe(RebuildSegment *segment, int fd, uint8_t *buf) {
+    uint64_t pos = 0, length;
+    
+    if (segment->size % TS_PACKET_SIZE) {
+        return -1;
+    }
+    
+    while (pos < segment->size && segment->start[0] == kNoTimestamp && segment->start[1] == kNoTimestamp) {
+        length = min(kRebuildChunk, segment->size - pos);
+        
+        if (ts_read(segment, fd, pos, length, buf)) {
+            return -1;
+        }
+        
+        pos += length;
+    }
+    
+    if (pos < segment->size) {
+        length       = min(kRebuildChunk, segment->size - pos);
+        // key frame is valid only when found in tail, otherwise last segment is read in full
+        segment->key = kNoTimestamp;
+        
+        if (ts_read(segment, fd, segment->size - length, length, buf)) {
+            return -1;
+        }
+    }
+    
+    return segment->start[0] == kNoTimestamp && segment->start[1] == kNoTimestamp ? -1 : 0;
+}
+
+/**
+ * @brief count ADTS or MP3 frames of segment by walking frame headers
+ */
+static int audio_probe(RebuildSegment *segment, int fd, int adts) {
+    const uint8_t *data;
+    AudioFrame    frame;
+    size_t        offset;
+    int           ret = 0;
+    
+    if ((data = (const uint8_t*)mmap(NULL, segment->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        return -1;
+    }
+    
+    madvise((void*)data, segment->size, MADV_SEQUENTIAL);
+    
+    for (offset = sg_id3_size(data, segment->size); offset < segment->size; offset += frame.size) {
+        
+        if ((adts ? sg_adts_frame(data + offset, segment->size - offset, &frame) : sg_mp3_frame(data + offset, segment->size - offset, &frame)) ||
+            offset + frame.size > segment->size) {
+            ret = -1;
+            break;
+        }
+        
+        if (!adts && !segment->samples && sg_mp3_info_frame(data + offset, segment->size - offset, &frame)) {
+            continue;
+        }
+        
+        if (segment->sample_rate && segment->sample_rate != frame.sample_rate) {
+            segment->flags |= RebuildFlagDiscontinuity;
+        }
+        
+        segment->sample_rate = frame.sample_rate;
+        segment->samples    += frame.samples;
+    }
+    
+    munmap((void*)data, segment->size);
+    
+    return ret || !segment->samples ? -1 : 0;
+}
+
+/**
+ * @brief read timing of one segment file
+ * @param rebuild rebuild context
+ * @param index segment index
+ * @param buf read buffer of kRebuildChunk bytes
+ * @param full whether to read whole MPEG-TS file
+ */
+static void rebuild_probe(SegmenterRebuild *rebuild, unsigned int index, uint8_t *buf, int full) {
+    RebuildSegment *segment = &rebuild->segments[index - rebuild->sequence];
+    char           path[PATH_MAX];
+    struct stat    st;
+    int            length, fd, ret;
+    
+    if (segment->flags & RebuildFlagMissing) {
+        return;
+    }
+    
+    length = snprintf(path, sizeof(path), "%s/", rebuild->path);
+    sg_layout_name(&rebuild->layout, rebuild->media_base_name, index, rebuild->extension, path + length, sizeof(path) - length);
+    
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        segment->flags |= RebuildFlagUnreadable;
+        return;
+    }
+    
+    if (fstat(fd, &st) || !st.st_size) {
+        segment->flags |= RebuildFlagUnreadable;
+        close(fd);
+        return;
+    }
+    
+    segment->size = st.st_size;
+    
+    if (strcmp(rebuild->extension, "ts")) {
+        ret = audio_probe(segment, fd, !strcmp(rebuild->extension, "aac"));
+    } else if (full) {
+        ret = ts_read(segment, fd, 0, segment->size, buf);
+    } else {
+        ret = ts_probe(segment, fd, buf);
+    }
+    
+    if (ret) {
+        segment->flags |= RebuildFlagUnreadable;
+    }
+    
+    close(fd);
+}
+
+static void rebuild_job(void *opaque) {
+    RebuildJob       *job     = (RebuildJob*)opaque;
+    SegmenterRebuild *rebuild = job->rebuild;
+    uint8_t          *buf     = (uint8_t*)sg_malloc(kRebuildChunk);
+    unsigned int     i;
+    
+    for (i = job->first; i < job->last; i++) {
+        if (buf) {
+            rebuild_probe(rebuild, i, buf, 0);
+        } else {
+            rebuild->segments[i - rebuild->sequence].flags |= RebuildFlagUnreadable;
+        }
+    }
+    
+    sg_free(buf);
+    
+    pthread_mutex_lock(&rebuild->lock);
+    
+    if (!--rebuild->pending) {
+        pthread_cond_signal(&rebuild->cond);
+    }
+    
+    pthread_mutex_unlock(&rebuild->lock);
+}
+
+/**
+ * @brief segment index of file name written by segmenter into given directory
+ * @return 0 on success, negative value when file isn't a segment
+ */
+static int rebuild_parse_name(SegmenterRebuild *rebuild, const char *dir, const char *name, unsigned int *index) {
+    const char *extension;
+    char       *end, expected[NAME_MAX + SG_LAYOUT_DIR_SIZE + 2];
+    size_t     length = strlen(rebuild->media_base_name);
+    int        i;
+    
+    if (strncmp(name, rebuild->media_base_name, length) || name[length] < '0' || name[length] > '9') {
+        return -1;
+    }
+    
+    *index = strtoul(name + length, &end, 10);
+    
+    if (*end != '.') {
+        return -1;
+    }
+    
+    for (i = 0, extension = NULL; i < sizeof(kRebuildExtensions) / sizeof(kRebuildExtensions[0]); i++) {
+        if (!strcmp(end + 1, kRebuildExtensions[i])) {
+            extension = kRebuildExtensions[i];
+        }
+    }
+    
+    if (!extension) {
+        return -1;
+    }
+    
+    // file must be where layout puts it and named exactly like segmenter names it
+    sg_layout_name(&rebuild->layout, rebuild->media_base_name, *index, extension, expected, sizeof(expected));
+    
+    if (*dir ? (strncmp(expected, dir, strlen(dir)) || strcmp(expected + strlen(dir) + 1, name)) : strcmp(expected, name)) {
+        return -1;
+    }
+    
+    if (rebuild->extension && rebuild->extension != extension) {
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    rebuild->extension = extension;
+    
+    return 0;
+}
+
+/**
+ * @brief collect segment indexes from output directory and, for sharded layout,
+ *        from its subdirectories
+ * @return 0 on success, negative error code on failure
+ */
+static int rebuild_list(SegmenterRebuild *rebuild, const char *dir, unsigned int **indexes, size_t *count, size_t *capacity) {
+    char          path[PATH_MAX];
+    struct dirent *entry;
+    DIR           *_dir;
+    unsigned int  index;
+    int           ret = 0;
+    
+    snprintf(path, sizeof(path), *dir ? "%s/%s" : "%s%s", rebuild->path, dir);
+    
+    if (!(_dir = opendir(path))) {
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    while (!ret && (entry = readdir(_dir))) {
+        
+        if (!*dir && rebuild->layout.type != LayoutTypeFlat && *entry->d_name != '.' &&
+            (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) && strlen(entry->d_name) < SG_LAYOUT_DIR_SIZE) {
+            ret = rebuild_list(rebuild, entry->d_name, indexes, count, capacity);
+            
+            // not a directory after all
+            if (ret == SGERROR(SGERROR_INPUT)) {
+                ret = 0;
+            }
+            
+            continue;
+        }
+        
+        if ((ret = rebuild_parse_name(rebuild, dir, entry->d_name, &index)) < 0) {
+            ret = ret == SGERROR(SGERROR_UNSUPPORTED_FORMAT) ? ret : 0;
+            continue;
+        }
+        
+        if (*count == *capacity) {
+            unsigned int *_indexes = (unsigned int*)sg_realloc(*indexes, (*capacity + 1024) * sizeof(unsigned int));
+            
+            if (!_indexes) {
+                ret = SGERROR(SGERROR_MEM_ALLOC);
+                break;
+            }
+            
+            *indexes   = _indexes;
+            *capacity += 1024;
+        }
+        
+        (*indexes)[(*count)++] = index;
+    }
+    
+    closedir(_dir);
+    
+    return ret;
+}
+
+/**
+ * @brief compute durations the way segmenter does and flag gaps: segment lasts until
+ *        the next one starts, the first segment of stream starts at 0 and the last one
+ *        ends with its last key frame (last packet for audio only output), raw audio
+ *        segments last for all samples of their frames
+ */
+static void rebuild_finish(SegmenterRebuild *rebuild) {
+    RebuildSegment *segment, *next;
+    unsigned int   i;
+    int            ts  = !strcmp(rebuild->extension, "ts");
+    int            ref = 1;
+    int64_t        origin, end;
+    uint8_t        *buf;
+    
+    for (i = 0; i < rebuild->count; i++) {
+        if (rebuild->segments[i].start[0] != kNoTimestamp) {
+            ref = 0;
+        }
+    }
+    
+    segment = &rebuild->segments[rebuild->count - 1];
+    
+    if (ts && !ref && !(segment->flags & (RebuildFlagMissing | RebuildFlagUnreadable)) && segment->key == kNoTimestamp &&
+        (buf = (uint8_t*)sg_malloc(kRebuildChunk))) {
+        rebuild_probe(rebuild, rebuild->sequence + rebuild->count - 1, buf, 1);
+        sg_free(buf);
+    }
+    
+    for (i = 0; i < rebuild->count; i++) {
+        segment = &rebuild->segments[i];
+        next    = i + 1 < rebuild->count ? &rebuild->segments[i + 1] : NULL;
+        
+        if (ts && !(segment->flags & (RebuildFlagMissing | RebuildFlagUnreadable)) && segment->start[ref] == kNoTimestamp) {
+            segment->flags |= RebuildFlagUnreadable;
+        }
+        
+        if (next && (next->flags & (RebuildFlagMissing | RebuildFlagUnreadable))) {
+            next = NULL;
+        }
+        
+        if (segment->flags & RebuildFlagMissing) {
+            rebuild->missing++;
+            continue;
+        }
+        
+        if (segment->flags & RebuildFlagUnreadable) {
+            rebuild->unreadable++;
+            continue;
+        }
+        
+        if (ts) {
+            origin = rebuild->sequence + i ? segment->start[ref] : 0;
+            end    = !ref && i + 1 == rebuild->count && segment->key != kNoTimestamp ? segment->key : segment->end[ref];
+            
+            if (next && next->start[ref] != kNoTimestamp) {
+                next->gap = pts_diff(segment->end[ref], next->start[ref]) / 90000.0;
+                
+                if (next->gap < 0 || next->gap > kRebuildMaxGap) {
+                    next->flags |= RebuildFlagDiscontinuity;
+                } else {
+                    end = next->start[ref];
+                }
+            }
+            
+            segment->duration = pts_diff(origin, end) / 90000.0;
+        } else {
+            if (next && next->sample_rate != segment->sample_rate) {
+                next->flags |= RebuildFlagDiscontinuity;
+            }
+            
+            segment->duration = (double)segment->samples / segment->sample_rate;
+        }
+        
+        if (segment->flags & RebuildFlagDiscontinuity) {
+            rebuild->discontinuities++;
+        }
+        
+        rebuild->durations[i] = segment->duration;
+        rebuild->duration    += segment->duration;
+    }
+}
+
+/**
+ * @brief scan segments left in output directory and read their timing without demuxing,
+ *        files are probed in parallel
+ * @param rebuild output rebuild result
+ * @param path output directory
+ * @param media_base_name base name of segment files
+ * @param layout segment layout used when segments were written
+ * @param threads number of threads, <= 0 means one per online cpu
+ * @return 0 on success, negative error code on failure
+ */
+int sg_rebuild_scan(SegmenterRebuild **rebuild, const char *path, const char *media_base_name, const SegmentLayout *layout, int threads) {
+    SegmenterRebuild *_rebuild;
+    RebuildJob       *jobs = NULL;
+    unsigned int     *indexes = NULL, first = UINT_MAX, last = 0, i;
+    size_t           count = 0, capacity = 0;
+    int              ret;
+    
+    if (!(_rebuild = (SegmenterRebuild*)sg_calloc(1, sizeof(SegmenterRebuild)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    pthread_mutex_init(&_rebuild->lock, NULL);
+    pthread_cond_init(&_rebuild->cond, NULL);
+    
+    _rebuild->layout = *layout;
+    
+    if (!(_rebuild->path = sg_strdup(*path ? path : ".")) || !(_rebuild->media_base_name = sg_strdup(media_base_name))) {
+        ret = SGERROR(SGERROR_MEM_ALLOC);
+        goto fail;
+    }
+    
+    if ((ret = rebuild_list(_rebuild, "", &indexes, &count, &capacity))) {
+        goto fail;
+    }
+    
+    if (!count) {
+        ret = SGERROR(SGERROR_INPUT);
+        goto fail;
+    }
+    
+    for (i = 0; i < count; i++) {
+        first = min(first, indexes[i]);
+        last  = indexes[i] > last ? indexes[i] : last;
+    }
+    
+    _rebuild->sequence = first;
+    _rebuild->count    = last - first + 1;
+    
+    if (!(_rebuild->segments = (RebuildSegment*)sg_malloc(_rebuild->count * sizeof(RebuildSegment))) ||
+        !(_rebuild->durations = (double*)sg_calloc(_rebuild->count, sizeof(double)))) {
+        ret = SGERROR(SGERROR_MEM_ALLOC);
+        goto fail;
+    }
+    
+    for (i = 0; i < _rebuild->count; i++) {
+        RebuildSegment *segment = &_rebuild->segments[i];
+        
+        memset(segment, 0, sizeof(RebuildSegment));
+        
+        segment->flags    = RebuildFlagMissing;
+        segment->start[0] = segment->start[1] = kNoTimestamp;
+        segment->end[0]   = segment->end[1]   = kNoTimestamp;
+        segment->key      = kNoTimestamp;
+    }
+    
+    for (i = 0; i < count; i++) {
+        _rebuild->segments[indexes[i] - first].flags = 0;
+    }
+    
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    }
+    
+    _rebuild->pending = (_rebuild->count + kRebuildBatch - 1) / kRebuildBatch;
+    
+    if (!(jobs = (RebuildJob*)sg_malloc(_rebuild->pending * sizeof(RebuildJob)))) {
+        ret = SGERROR(SGERROR_MEM_ALLOC);
+        goto fail;
+    }
+    
+    if ((ret = sg_pool_alloc(&_rebuild->pool, threads))) {
+        goto fail;
+    }
+    
+    count = _rebuild->pending;
+    
+    for (i = 0; i < count; i++) {
+        jobs[i].rebuild = _rebuild;
+        jobs[i].first   = first + i * kRebuildBatch;
+        jobs[i].last    = min(jobs[i].first + kRebuildBatch, last + 1);
+        
+        if ((ret = sg_pool_submit(_rebuild->pool, i % threads, rebuild_job, &jobs[i]))) {
+            pthread_mutex_lock(&_rebuild->lock);
+            _rebuild->pending -= count - i;
+            pthread_mutex_unlock(&_rebuild->lock);
+            break;
+        }
+    }
+    
+    pthread_mutex_lock(&_rebuild->lock);
+    
+    while (_rebuild->pending) {
+        pthread_cond_wait(&_rebuild->cond, &_rebuild->lock);
+    }
+    
+    pthread_mutex_unlock(&_rebuild->lock);
+    
+    sg_pool_free(_rebuild->pool);
+    _rebuild->pool = NULL;
+    
+    if (ret) {
+        goto fail;
+    }
+    
+    rebuild_finish(_rebuild);
+    
+    sg_free(jobs);
+    sg_free(indexes);
+    
+    *rebuild = _rebuild;
+    
+    return 0;
+
+fail:
+    sg_free(jobs);
+    sg_free(indexes);
+    sg_rebuild_free(_rebuild);
+    
+    return ret;
+}
+
+void sg_rebuild_free(SegmenterRebuild *rebuild) {
+    
+    if (rebuild->pool) {
+        sg_pool_free(rebuild->pool);
+    }
+    
+    pthread_mutex_destroy(&rebuild->lock);
+    pthread_cond_destroy(&rebuild->cond);
+    
+    sg_free(rebuild->path);
+    sg_free(rebuild->media_base_name);
+    sg_free(rebuild->segments);
+    sg_free(rebuild->durations);
+    sg_free(rebuild);
+}
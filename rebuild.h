@@ -0,0 +1,81 @@
+// rebuild.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "layout.h"
+#include "pool.h"
+
+#ifndef __SG_REBUILD__
+#define __SG_REBUILD__
+
+typedef enum {
+    RebuildFlagMissing       = 0x01,
+    RebuildFlagUnreadable    = 0x02,
+    RebuildFlagDiscontinuity = 0x04
+} RebuildFlag;
+
+/**
+ * Timing read from one segment file. MPEG-TS timestamps are 90 kHz PTS of video [0] and
+ * audio [1] elementary streams at the start and the end of the file, ADTS and MP3 segments
+ * are measured by their frame headers.
+ */
+typedef struct {
+    int      flags;
+    uint64_t size;
+    
+    int64_t  start[2];
+    int64_t  end[2];
+    int64_t  key;
+    
+    int64_t  samples;
+    int      sample_rate;
+    
+    double   duration;
+    double   gap;
+} RebuildSegment;
+
+/**
+ * Result of scanning segments written by segmenter, durations follow segmenter rules
+ * so index written from them matches the one written while segmenting.
+ */
+typedef struct {
+    char            *path;
+    char            *media_base_name;
+    const char      *extension;
+    SegmentLayout   layout;
+    
+    RebuildSegment  *segments;
+    double          *durations;
+    unsigned int    sequence;
+    unsigned int    count;
+    
+    unsigned int    missing;
+    unsigned int    unreadable;
+    unsigned int    discontinuities;
+    double          duration;
+    
+    SegmenterPool   *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    unsigned int    pending;
+} SegmenterRebuild;
+
+int  sg_rebuild_scan(SegmenterRebuild **rebuild, const char *path, const char *media_base_name, const SegmentLayout *layout, int threads);
+void sg_rebuild_free(SegmenterRebuild *rebuild);
+
+#endif
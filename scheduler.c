@@ -0,0 +1,109 @@
+// scheduler.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "scheduler.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+/**
+ * @brief allocate boundary scheduler
+ * @param scheduler output scheduler
+ * @param tolerance maximum distance in seconds between boundary and key frame considered aligned
+ * @return 0 on success, negative error code on failure
+ */
+int sg_scheduler_alloc(SegmenterScheduler **scheduler, double tolerance) {
+    SegmenterScheduler *_scheduler = (SegmenterScheduler*)sg_calloc(1, sizeof(SegmenterScheduler));
+    
+    if (!_scheduler) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (pthread_mutex_init(&_scheduler->lock, NULL)) {
+        sg_free(_scheduler);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _scheduler->tolerance = tolerance;
+    
+    *scheduler = _scheduler;
+    
+    return 0;
+}
+
+void sg_scheduler_free(SegmenterScheduler *scheduler) {
+    pthread_mutex_destroy(&scheduler->lock);
+    sg_free(scheduler);
+}
+
+/**
+ * @brief register rendition, when any rendition has video only video renditions choose boundaries
+ * @param scheduler boundary scheduler
+ * @param video whether rendition has video
+ */
+void sg_scheduler_add(SegmenterScheduler *scheduler, int video) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->video |= video;
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * @brief decide whether rendition should finish segment on current cut opportunity
+ * @param scheduler boundary scheduler
+ * @param index index of segment rendition would finish
+ * @param time timestamp of cut opportunity (key frame) in seconds
+ * @param ready whether rendition reached target duration on its own
+ * @param video whether rendition has video
+ * @param skew output distance in seconds between cut and scheduled boundary, set when cut is made
+ * @return 1 if segment should be finished, 0 otherwise
+ */
+int sg_scheduler_cut(SegmenterScheduler *scheduler, unsigned int index, double time, int ready, int video, double *skew) {
+    int cut = 0, slot = index % SG_SCHEDULER_WINDOW;
+    
+    pthread_mutex_lock(&scheduler->lock);
+    
+    if (index < scheduler->count && scheduler->cuts[slot].index == index) {
+        // boundary already chosen by another rendition
+        if (time >= scheduler->cuts[slot].time - scheduler->tolerance) {
+            cut   = 1;
+            *skew = time - scheduler->cuts[slot].time;
+            
+            scheduler->boundaries++;
+            scheduler->aligned  += fabs(*skew) <= scheduler->tolerance;
+            scheduler->skew_sum += fabs(*skew);
+            scheduler->skew_max  = max(scheduler->skew_max, fabs(*skew));
+        }
+    } else if (index < scheduler->count) {
+        // rendition fell behind scheduler window, it decides on its own
+        cut = ready;
+    } else if (ready && (video || !scheduler->video)) {
+        scheduler->cuts[slot].index = index;
+        scheduler->cuts[slot].time  = time;
+        scheduler->count            = index + 1;
+        
+        cut   = 1;
+        *skew = 0;
+    }
+    
+    pthread_mutex_unlock(&scheduler->lock);
+    
+    return cut;
+}
@@ -0,0 +1,54 @@
+// scheduler.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <pthread.h>
+
+#ifndef __SG_SCHEDULER__
+#define __SG_SCHEDULER__
+
+#define SG_SCHEDULER_WINDOW 64
+
+/**
+ * Segment boundary scheduler shared by renditions of one stream. First rendition to reach
+ * target duration on a key frame chooses boundary time, the rest cut on their first key frame
+ * at or after it, so all renditions have the same number of segments and aligned boundaries
+ * when their key frames are aligned. Renditions are expected to share timestamps.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    
+    struct {
+        unsigned int index;
+        double       time;
+    }               cuts[SG_SCHEDULER_WINDOW];
+    unsigned int    count;
+    
+    double          tolerance;
+    int             video;
+    
+    unsigned long   boundaries;
+    unsigned long   aligned;
+    double          skew_sum;
+    double          skew_max;
+} SegmenterScheduler;
+
+int  sg_scheduler_alloc(SegmenterScheduler **scheduler, double tolerance);
+void sg_scheduler_free(SegmenterScheduler *scheduler);
+
+void sg_scheduler_add(SegmenterScheduler *scheduler, int video);
+int  sg_scheduler_cut(SegmenterScheduler *scheduler, unsigned int index, double time, int ready, int video, double *skew);
+
+#endif
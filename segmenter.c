@@ -16,6 +16,8 @@
 
 #include "config.h"
 #include "segmenter.h"
+#include "alloc.h"
+#include "sink.h"
 #include "util.h"
 
 #include <math.h>
@@ -40,11 +42,19 @@ static const char* kFormatADTS      = "adts";
 static const char* kFormatMP3       = "mp3";
 static const char* kFormatMPEGTS    = "mpegts";
 
+static const char* kExtensionKey      = "key";
+static const char* kExtensionManifest = "json";
+
 static const size_t kAvgSegmentsCount = 128;
+static const int    kOutputBufferSize = 32768;
 
 static AVStream* copy_stream(AVFormatContext *context, AVStream *source_stream) {
     AVStream *output_stream = avformat_new_stream(context, source_stream->codec->codec);
     
+    if (!output_stream) {
+        return NULL;
+    }
+    
     AVCodecContext *output_context = output_stream->codec, *source_context = source_stream->codec;
     
     output_context->codec_id   = source_context->codec_id;
@@ -60,13 +70,15 @@ static AVStream* copy_stream(AVFormatContext *context, AVStream *source_stream)
     
     
     output_context->bit_rate = source_context->bit_rate;
+    output_context->profile = source_context->profile;
+    output_context->level = source_context->level;
     output_context->rc_max_rate = source_context->rc_max_rate;
     output_context->rc_buffer_size = source_context->rc_buffer_size;
     output_context->field_order = source_context->field_order;
     output_context->extradata = av_mallocz(source_context->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
     
     if (!output_context->extradata) {
-        exit(-1);
+        return NULL;
     }
     
     memcpy(output_context->extradata, source_context->extradata, source_context->extradata_size);
@@ -84,7 +96,7 @@ static AVStream* copy_stream(AVFormatContext *context, AVStream *source_stream)
             output_context->audio_service_type = source_context->audio_service_type;
             output_context->block_align = source_context->block_align;
             break;
-            
+        
         case AVMEDIA_TYPE_VIDEO:    
             output_context->pix_fmt = source_context->pix_fmt;
             output_context->width = source_context->width;
@@ -117,13 +129,24 @@ static int load_decoder(AVCodecContext *context) {
  */
 int segmenter_alloc_context(SegmenterContext** context) {
     
-    SegmenterContext *_context = (SegmenterContext*)malloc(sizeof(SegmenterContext));
+    SegmenterContext *_context = (SegmenterContext*)sg_malloc(sizeof(SegmenterContext));
     
     if (!_context) {
         return SGERROR(SGERROR_MEM_ALLOC);
     }
     
     _context->output           = NULL;
+    _context->pb               = NULL;
+    
+    memset(&_context->sink, 0, sizeof(SegmenterSink));
+    _context->segment_size     = 0;
+    
+    _context->crypt            = NULL;
+    _context->crypt_buf        = NULL;
+    _context->key_url          = NULL;
+    
+    _context->checksum         = NULL;
+    _context->checksums        = NULL;
     
     _context->buf              = NULL;
     _context->buf_size         = 0;
@@ -131,6 +154,9 @@ int segmenter_alloc_context(SegmenterContext** context) {
     _context->file_base_name   = NULL;
     _context->media_base_name  = NULL;
     
+    _context->layout.type      = LayoutTypeFlat;
+    _context->layout.fanout    = 0;
+    
     _context->segment_file_sequence = 0;
     _context->segment_sequence      = 0;
     _context->segment_index         = 0;
@@ -143,17 +169,29 @@ int segmenter_alloc_context(SegmenterContext** context) {
     
     _context->max_bitrate      = 0;
     _context->avg_bitrate      = 0;
+    _context->bitrate_segments = 0;
     
     _context->_pts             = 0;
     _context->_dts             = 0;
-     
+    
     _context->eof              = 0;
     
+    _context->scheduler        = NULL;
+    _context->archive          = NULL;
+    
+    memset(&_context->metrics, 0, sizeof(SegmenterMetrics));
+    
     _context->durations_size   = kAvgSegmentsCount;
-    _context->durations        = (double*)malloc(sizeof(double) * _context->durations_size);
+    _context->durations        = (double*)sg_malloc(sizeof(double) * _context->durations_size);
     
     if (!_context->durations) {
-        free(_context);
+        sg_free(_context);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (pthread_mutex_init(&_context->lock, NULL)) {
+        sg_free(_context->durations);
+        sg_free(_context);
         return SGERROR(SGERROR_MEM_ALLOC);
     }
     
@@ -175,18 +213,226 @@ void segmenter_free_context(SegmenterContext* context) {
     }
     
     if (context->output) {
+        context->output->pb = NULL;
         avformat_free_context(context->output);
     }
     
+    if (context->pb) {
+        av_free(context->pb->buffer);
+        av_free(context->pb);
+    }
+    
+    if (context->sink.free) {
+        context->sink.free(context->sink.opaque);
+    }
+    
+    if (context->crypt) {
+        sg_crypt_free(context->crypt);
+    }
+    
+    if (context->crypt_buf) {
+        sg_free(context->crypt_buf);
+    }
+    
+    if (context->checksum) {
+        sg_checksum_free(context->checksum);
+    }
+    
+    if (context->checksums) {
+        sg_free(context->checksums);
+    }
+    
     if (context->buf) {
-        free(context->buf);
+        sg_free(context->buf);
     }
     
     if (context->durations) {
-        free(context->durations);
+        sg_free(context->durations);
+    }
+    
+    if (context->archive) {
+        sg_archive_close(context->archive);
+    }
+    
+    pthread_mutex_destroy(&context->lock);
+    
+    sg_free(context);
+}
+
+/**
+ * @brief set output sink, should be called before segmenter_init,
+ *        segmenter takes ownership of sink opaque data on success
+ * @param context segmenter context
+ * @param sink output sink callbacks
+ * @return 0 on success, negative error code on failure or when required callback is missing
+ */
+int segmenter_set_sink(SegmenterContext *context, const SegmenterSink *sink) {
+    
+    if (!sink->open_segment || !sink->write_segment || !sink->close_segment || !sink->write_playlist) {
+        return SGERROR(SGERROR_INVALID);
+    }
+    
+    if (context->sink.free) {
+        context->sink.free(context->sink.opaque);
+    }
+    
+    context->sink = *sink;
+    
+    return 0;
+}
+
+/**
+ * @brief enable AES-128 segment encryption, should be called before segmenter_open
+ * @param context segmenter context
+ * @param key static 16 byte key, NULL to generate random key for each rotation period
+ * @param rotation number of segments encrypted with one random key, 0 to never rotate
+ * @param key_url url prefix of key files in index, NULL for url relative to index
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_set_encryption(SegmenterContext *context, const uint8_t *key, unsigned int rotation, char *key_url) {
+    int ret;
+    
+    if ((ret = sg_crypt_alloc(&context->crypt, key, rotation))) {
+        return ret;
+    }
+    
+    if (!(context->crypt_buf = (uint8_t*)sg_malloc(kOutputBufferSize + SG_CRYPT_BLOCK_SIZE))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    context->key_url = key_url;
+    
+    return 0;
+}
+
+/**
+ * @brief compute checksums of segments as they are written and publish manifest with index
+ * @param context segmenter context
+ * @param types ChecksumType flags
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_set_checksums(SegmenterContext *context, int types) {
+    int ret;
+    
+    if ((ret = sg_checksum_alloc(&context->checksum, types))) {
+        return ret;
+    }
+    
+    if (!(context->checksums = (SegmentChecksum*)sg_malloc(context->durations_size * sizeof(SegmentChecksum)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief align segment boundaries with other renditions sharing scheduler, should be called
+ *        after segmenter_init, scheduler is not owned by context
+ * @param context segmenter context
+ * @param scheduler boundary scheduler
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_set_scheduler(SegmenterContext *context, SegmenterScheduler *scheduler) {
+    
+    context->scheduler = scheduler;
+    sg_scheduler_add(scheduler, context->source_video_index >= 0);
+    
+    return 0;
+}
+
+/**
+ * @brief place segment files into subdirectories of output root, should be called
+ *        before segmenter_open, segment uris in index follow the same layout
+ * @param context segmenter context
+ * @param layout segment layout
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_set_layout(SegmenterContext *context, const SegmentLayout *layout) {
+    
+    context->layout = *layout;
+    
+    return 0;
+}
+
+/**
+ * @brief keep every finished segment in archive directory and maintain VOD playlist of them,
+ *        should be called after segmenter_init and before segmenter_open, output must be
+ *        local directory
+ * @param context segmenter context
+ * @param path archive directory
+ * @param index_file archive playlist name
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_set_archive(SegmenterContext *context, const char *path, const char *index_file) {
+    return sg_archive_open(&context->archive, context->file_base_name, path, index_file);
+}
+
+/**
+ * @brief segment name relative to output root, written to context buffer
+ */
+static const char* segment_name(SegmenterContext *context, unsigned int index) {
+    
+    sg_layout_name(&context->layout, context->media_base_name, index, context->extension, context->buf, context->buf_size);
+    
+    return context->buf;
+}
+
+static int write_segment_data(SegmenterContext *context, const uint8_t *buf, size_t size) {
+    
+    if (context->sink.write_segment(context->sink.opaque, buf, size)) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (context->checksum) {
+        sg_checksum_update(context->checksum, buf, size);
+    }
+    
+    context->segment_size += size;
+    sg_metrics_add(&context->metrics.bytes, size);
+    
+    return 0;
+}
+
+static int write_output(void *opaque, uint8_t *buf, int size) {
+    SegmenterContext *context = (SegmenterContext*)opaque;
+    int              offset, length;
+    
+    if (!context->crypt) {
+        return write_segment_data(context, buf, size) ? AVERROR(EIO) : size;
+    }
+    
+    for (offset = 0; offset < size; offset += kOutputBufferSize) {
+        length = sg_crypt_update(context->crypt, buf + offset, FFMIN(size - offset, kOutputBufferSize), context->crypt_buf);
+        
+        if (length < 0 || write_segment_data(context, context->crypt_buf, length)) {
+            return AVERROR(EIO);
+        }
+    }
+    
+    return size;
+}
+
+/**
+ * @brief set output names and default file sink once extension is known
+ * @return 0 on success, negative error code on failure
+ */
+static int init_output(SegmenterContext *context, char *file_base_name, char *media_base_name, double target_duration) {
+    
+    context->file_base_name  = file_base_name;
+    context->media_base_name = media_base_name;
+    context->target_duration = target_duration;
+    
+    context->buf_size = snprintf(NULL, 0, "%s%u.%s", context->media_base_name, UINT_MAX, context->extension) + SG_LAYOUT_DIR_SIZE + 1;
+    
+    if (!(context->buf = (char*)sg_malloc(context->buf_size * sizeof(char)))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (!context->sink.open_segment) {
+        return sg_file_sink_init(&context->sink, file_base_name);
     }
     
-    free(context);
+    return 0;
 }
 
 /**
@@ -212,7 +458,7 @@ int segmenter_init(SegmenterContext *context, AVFormatContext *source, char* fil
                 } 
                 
                 break;
-                
+            
             case AVMEDIA_TYPE_AUDIO:
                 
                 if ((media_filter & MediaTypeAudio) && !load_decoder(_stream->codec)) {
@@ -220,7 +466,7 @@ int segmenter_init(SegmenterContext *context, AVFormatContext *source, char* fil
                 } 
                 
                 break;    
-                
+            
             default:
                 break;
         }
@@ -244,6 +490,7 @@ int segmenter_init(SegmenterContext *context, AVFormatContext *source, char* fil
             case AV_CODEC_ID_MP3:
                 oformat = av_guess_format(kFormatMP3, NULL, NULL);
                 context->extension = kExtensionMP3;
+                break;
             default:
                 oformat = av_guess_format(kFormatMPEGTS, NULL, NULL);
                 context->extension = kExtensionMPEGTS;
@@ -265,28 +512,77 @@ int segmenter_init(SegmenterContext *context, AVFormatContext *source, char* fil
     context->video = video_index >= 0 ? copy_stream(context->output, source->streams[video_index]) : NULL;
     context->audio = audio_index >= 0 ? copy_stream(context->output, source->streams[audio_index]) : NULL;
     
-    context->file_base_name  = file_base_name;
-    context->media_base_name = media_base_name;
-    context->target_duration = target_duration;
+    if ((video_index >= 0 && !context->video) || (audio_index >= 0 && !context->audio)) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
     
-    context->buf_size = snprintf(NULL, 0, "%s/%s%u.%s", context->file_base_name, context->media_base_name, UINT_MAX, context->extension) + 1;
+    int ret;
     
-    if (!(context->buf = (char*)malloc(context->buf_size * sizeof(char)))) {
+    if ((ret = init_output(context, file_base_name, media_base_name, target_duration))) {
+        return ret;
+    }
+    
+    unsigned char *buf = (unsigned char*)av_malloc(kOutputBufferSize);
+    
+    if (!buf) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (!(context->pb = avio_alloc_context(buf, kOutputBufferSize, 1, context, NULL, write_output, NULL))) {
+        av_free(buf);
         return SGERROR(SGERROR_MEM_ALLOC);
     }
     
+    context->output->pb     = context->pb;
+    context->output->flags |= AVFMT_FLAG_CUSTOM_IO;
+    
     return 0;
 }
 
+/**
+ * @brief initialize segmenter for elementary audio frames written with segmenter_write_frames,
+ *        no muxer is involved, segments are ADTS or MPEG audio files
+ * @param context segmenter context
+ * @param codec_id AV_CODEC_ID_AAC or AV_CODEC_ID_MP3
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_init_frames(SegmenterContext *context, enum AVCodecID codec_id, char* file_base_name, char* media_base_name,
+                          double target_duration) {
+    
+    switch (codec_id) {
+        case AV_CODEC_ID_AAC:
+            context->extension = kExtensionAAC;
+            break;
+        case AV_CODEC_ID_MP3:
+            context->extension = kExtensionMP3;
+            break;
+        default:
+            return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    context->source_video_index = -1;
+    context->source_audio_index = -1;
+    
+    return init_output(context, file_base_name, media_base_name, target_duration);
+}
+
 static int set_segment_duration(SegmenterContext *context, unsigned int index, double duration) {
     
     if (index - context->segment_sequence >= context->durations_size) {
         context->durations_size += kAvgSegmentsCount;
-        context->durations = (double*)realloc(context->durations, context->durations_size * sizeof(double));
+        context->durations = (double*)sg_realloc(context->durations, context->durations_size * sizeof(double));
         
         if (!context->durations) {
             return SGERROR(SGERROR_MEM_ALLOC);
         }
+        
+        if (context->checksums) {
+            context->checksums = (SegmentChecksum*)sg_realloc(context->checksums, context->durations_size * sizeof(SegmentChecksum));
+            
+            if (!context->checksums) {
+                return SGERROR(SGERROR_MEM_ALLOC);
+            }
+        }
     }
     
     context->durations[index - context->segment_sequence] = duration;
@@ -299,6 +595,86 @@ static inline double segment_duration(SegmenterContext *context, unsigned int se
     return context->durations[segment - context->segment_sequence];
 }
 
+/**
+ * @brief initialize context from already written segments instead of source, so index
+ *        can be rebuilt with segmenter_write_playlist without segmenting again
+ * @param context segmenter context
+ * @param file_base_name output directory
+ * @param media_base_name base name of segment files
+ * @param extension segment file extension
+ * @param target_duration target segment duration
+ * @param sequence index of first segment
+ * @param durations durations of segments
+ * @param count number of segments
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_restore(SegmenterContext *context, char *file_base_name, char *media_base_name, const char *extension,
+                      double target_duration, unsigned int sequence, const double *durations, unsigned int count) {
+    unsigned int i;
+    int          ret;
+    
+    context->extension = extension;
+    
+    if ((ret = init_output(context, file_base_name, media_base_name, target_duration))) {
+        return ret;
+    }
+    
+    context->segment_file_sequence = sequence;
+    context->segment_sequence      = sequence;
+    
+    for (i = 0; i < count; i++) {
+        if ((ret = set_segment_duration(context, sequence + i, durations[i]))) {
+            return ret;
+        }
+        
+        context->duration += durations[i];
+    }
+    
+    context->segment_index = sequence + count;
+    context->eof           = 1;
+    
+    return 0;
+}
+
+
+/**
+ * @brief format name of key file for key rotation period
+ * @return allocated name, NULL on failure
+ */
+static char* key_name(SegmenterContext *context, unsigned int period) {
+    int  length = snprintf(NULL, 0, "%s-%u.%s", context->media_base_name, period, kExtensionKey) + 1;
+    char *name  = (char*)sg_malloc(length);
+    
+    if (name) {
+        snprintf(name, length, "%s-%u.%s", context->media_base_name, period, kExtensionKey);
+    }
+    
+    return name;
+}
+
+/**
+ * @brief start segment encryption and publish new key when period changes
+ * @param context segmenter context
+ * @return 0 on success, negative error code on failure
+ */
+static int start_encryption(SegmenterContext *context) {
+    char *name;
+    int  ret;
+    
+    if ((ret = sg_crypt_start(context->crypt, context->segment_index)) <= 0) {
+        return ret;
+    }
+    
+    if (!(name = key_name(context, context->crypt->period))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    ret = context->sink.write_playlist(context->sink.opaque, name, context->crypt->key, SG_CRYPT_KEY_SIZE);
+    
+    sg_free(name);
+    
+    return ret;
+}
 
 /**
  * @brief starts next segment
@@ -306,44 +682,140 @@ static inline double segment_duration(SegmenterContext *context, unsigned int se
  * @return 0 on success, negative error code on failure
  */
 static int start_segment(SegmenterContext *context) {
-
-    snprintf(context->buf, context->buf_size, "%s/%s%u.%s", context->file_base_name, context->media_base_name, context->segment_index, context->extension);
+    int ret;
     
-    if (avio_open(&context->output->pb, context->buf, AVIO_FLAG_WRITE)) {
-        return SGERROR(SGERROR_FILE_WRITE);
+    if ((ret = sg_layout_prepare(&context->layout, context->segment_index, context->sink.create_dir, context->sink.opaque))) {
+        return ret;
+    }
+    
+    if ((ret = context->sink.open_segment(context->sink.opaque, segment_name(context, context->segment_index), context->segment_index))) {
+        return ret;
+    }
+    
+    context->segment_size = 0;
+    
+    if (context->checksum && (ret = sg_checksum_start(context->checksum))) {
+        return ret;
     }
     
-    if (context->segment_index == 0) {
-        return avformat_write_header(context->output, NULL);
+    if (context->crypt && (ret = start_encryption(context))) {
+        return ret;
+    }
+    
+    if (context->segment_index == 0 && context->output && avformat_write_header(context->output, NULL) < 0) {
+        return SGERROR(SGERROR_MUX);
     }
     
     return 0;
 }
 
+/**
+ * @brief link finished segment into archive, key file goes along with the first segment
+ *        encrypted with it
+ * @param context segmenter context
+ * @return 0 on success, negative error code on failure
+ */
+static int archive_segment(SegmenterContext *context) {
+    unsigned int index = context->segment_index;
+    char         *name = NULL, *uri = NULL;
+    int          ret;
+    
+    if (context->crypt && (!context->archive->count || sg_crypt_period(context->crypt, index) != sg_crypt_period(context->crypt, index - 1))) {
+        if (!(name = key_name(context, sg_crypt_period(context->crypt, index))) ||
+            !(uri = (char*)sg_malloc(strlen(context->key_url ? context->key_url : "") + strlen(name) + 1))) {
+            sg_free(name);
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        sprintf(uri, "%s%s", context->key_url ? context->key_url : "", name);
+        
+        if ((ret = sg_archive_add_file(context->archive, name))) {
+            sg_free(name);
+            sg_free(uri);
+            return ret;
+        }
+    }
+    
+    ret = sg_archive_add_segment(context->archive, segment_name(context, index), index, context->segment_duration, uri);
+    
+    sg_free(name);
+    sg_free(uri);
+    
+    return ret;
+}
+
 /**
  * @brief finish segment
  * @param context segmenter context
  * @return 0 on success, negative error code on failure
  */
 static int finish_segment(SegmenterContext *context) {
-    AVFormatContext *output = context->output;
-    size_t size;
-    int    ret;
+    uint64_t start = sg_metrics_now();
+    size_t   size;
+    int      ret;
+    
+    if (context->pb) {
+        avio_flush(context->pb);
+        
+        if (context->pb->error) {
+            return SGERROR(SGERROR_FILE_WRITE);
+        }
+    }
+    
+    if (context->crypt) {
+        int length = sg_crypt_finish(context->crypt, context->crypt_buf);
+        
+        if (length < 0) {
+            return length;
+        }
+        
+        if ((ret = write_segment_data(context, context->crypt_buf, length))) {
+            return ret;
+        }
+    }
     
-    avio_flush(output->pb);
-    size = avio_size(output->pb);
-    avio_close(output->pb);
+    size = context->segment_size;
     
-    context->max_bitrate = max(context->max_bitrate, size * 8 / context->segment_duration);
-    context->avg_bitrate = (context->avg_bitrate * context->segment_index + (size * 8 / context->segment_duration)) / (context->segment_index + 1);
+    if ((ret = context->sink.close_segment(context->sink.opaque, segment_name(context, context->segment_index), context->segment_index, context->segment_duration, size))) {
+        return ret;
+    }
+    
+    // zero length segment (e.g. lone packet at end of stream) has no bitrate, it would turn both into inf
+    if (context->segment_duration > 0) {
+        double bitrate = size * 8 / context->segment_duration;
+        
+        context->max_bitrate = max(context->max_bitrate, bitrate);
+        context->avg_bitrate = (context->avg_bitrate * context->bitrate_segments + bitrate) / (context->bitrate_segments + 1);
+        context->bitrate_segments++;
+    }
     
     if ((ret = set_segment_duration(context, context->segment_index, context->segment_duration))) {
         return ret;
     }
     
+    if (context->checksum) {
+        SegmentChecksum *checksum = &context->checksums[context->segment_index - context->segment_sequence];
+        
+        checksum->size = size;
+        
+        if ((ret = sg_checksum_finish(context->checksum, checksum))) {
+            return ret;
+        }
+    }
+    
+    if (context->archive && (ret = archive_segment(context))) {
+        return ret;
+    }
+    
     context->segment_index++;
     context->segment_duration = 0;
     
+    sg_metrics_add(&context->metrics.segments, 1);
+    sg_metrics_set(&context->metrics.avg_bitrate, context->avg_bitrate);
+    sg_metrics_set(&context->metrics.max_bitrate, context->max_bitrate);
+    sg_metrics_set(&context->metrics.output_pts, context->duration);
+    sg_metrics_observe(&context->metrics.finish_segment, start);
+    
     return 0;
 }
 
@@ -353,7 +825,13 @@ static int finish_segment(SegmenterContext *context) {
  * @return 0 on success, negative error code on failure
  */
 int segmenter_open(SegmenterContext* context) {
-    return start_segment(context);
+    int ret;
+    
+    pthread_mutex_lock(&context->lock);
+    ret = start_segment(context);
+    pthread_mutex_unlock(&context->lock);
+    
+    return ret;
 }
 
 /**
@@ -362,9 +840,14 @@ int segmenter_open(SegmenterContext* context) {
  * @return 0 on success, negative error code on failure
  */
 int segmenter_close(SegmenterContext* context) {
+    int ret;
+    
+    pthread_mutex_lock(&context->lock);
     context->eof = 1;
+    ret = finish_segment(context);
+    pthread_mutex_unlock(&context->lock);
     
-    return finish_segment(context);
+    return ret;
 }
 
 /**
@@ -373,16 +856,32 @@ int segmenter_close(SegmenterContext* context) {
  * @return 0 on success, negative error code on failure
  */
 static int clear_segments(SegmenterContext *context) {
+    uint64_t start = sg_metrics_now();
     
     unsigned int i;
     
     for (i = context->segment_file_sequence; i < context->segment_sequence; i++) {
-        snprintf(context->buf, context->buf_size, "%s/%s%u.%s", context->file_base_name, context->media_base_name, i, context->extension);
-        unlink(context->buf);
+        if (context->sink.remove_segment) {
+            context->sink.remove_segment(context->sink.opaque, segment_name(context, i), i);
+        }
+        
+        sg_layout_release(&context->layout, i, context->sink.remove_dir, context->sink.opaque);
+        
+        if (context->crypt && context->crypt->rotation && (i + 1) % context->crypt->rotation == 0 && context->sink.remove_segment) {
+            char *name = key_name(context, sg_crypt_period(context->crypt, i));
+            
+            if (name) {
+                context->sink.remove_segment(context->sink.opaque, name, i);
+                sg_free(name);
+            }
+        }
     }
     
+    sg_metrics_add(&context->metrics.removed, context->segment_sequence - context->segment_file_sequence);
+    sg_metrics_observe(&context->metrics.clear_segments, start);
+    
     context->segment_file_sequence = context->segment_sequence;
-        
+    
     return 0;
 }
 
@@ -397,7 +896,10 @@ int segmenter_set_sequence(SegmenterContext *context, unsigned int sequence, int
     
     int i;
     
+    pthread_mutex_lock(&context->lock);
+    
     if (sequence <= context->segment_sequence || sequence >= context->segment_index) {
+        pthread_mutex_unlock(&context->lock);
         return 0;
     }
     
@@ -410,7 +912,7 @@ int segmenter_set_sequence(SegmenterContext *context, unsigned int sequence, int
     while (duration < context->target_duration * 3 && i > context->segment_sequence) {
         duration += segment_duration(context, --i);
     }
-        
+    
     sequence = i;
     
     context->max_duration = 0;
@@ -418,6 +920,10 @@ int segmenter_set_sequence(SegmenterContext *context, unsigned int sequence, int
     for (i = sequence; i < context->segment_index; i++) {
         context->durations[i - sequence] = context->durations[i - context->segment_sequence];
         context->max_duration = max(context->max_duration, context->durations[i - sequence]);
+        
+        if (context->checksums) {
+            context->checksums[i - sequence] = context->checksums[i - context->segment_sequence];
+        }
     }
     
     context->segment_sequence = sequence;
@@ -426,25 +932,21 @@ int segmenter_set_sequence(SegmenterContext *context, unsigned int sequence, int
         clear_segments(context);
     }
     
+    pthread_mutex_unlock(&context->lock);
+    
     return 0;
 }
 
-/**
- * @brief write packet from input to output
- * @param context segmenter context
- * @param source source input
- * @param pkt packet to write
- * @return 0 on success, negative error code on failure
- */
-int segmenter_write_pkt(SegmenterContext* context, AVFormatContext *source, AVPacket *pkt) {
+static int write_pkt(SegmenterContext* context, AVFormatContext *source, AVPacket *pkt) {
     
     AVPacket opkt;
     AVStream *stream, *output_stream;
+    double   skew = 0;
+    int      cut  = 0;
     
     stream = source->streams[pkt->stream_index];
     
     if (pkt->stream_index != context->source_audio_index && pkt->stream_index != context->source_video_index) {
-        av_packet_unref(pkt);
         return 0;
     }
     
@@ -474,23 +976,40 @@ int segmenter_write_pkt(SegmenterContext* context, AVFormatContext *source, AVPa
     
     if (pkt->stream_index == context->source_video_index && context->bfilter) {
         AVPacket _pkt = opkt;
+        int      ret  = av_bitstream_filter_filter(context->bfilter, context->video->codec, NULL, &_pkt.data, &_pkt.size,
+                                                   pkt->data, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
         
-        av_bitstream_filter_filter(context->bfilter, context->video->codec, NULL, &_pkt.data, &_pkt.size, pkt->data, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
-        
-        av_packet_unref(&opkt);
-        opkt = _pkt;
-        // opkt.destruct = av_destruct_packet;
-    }  
+        // positive result means filter allocated new data, it is released with output packet
+        if (ret > 0) {
+            if (!(_pkt.buf = av_buffer_create(_pkt.data, _pkt.size, av_buffer_default_free, NULL, 0))) {
+                av_free(_pkt.data);
+                return SGERROR(SGERROR_MEM_ALLOC);
+            }
+            
+            opkt = _pkt;
+        } else if (!ret) {
+            opkt = _pkt;
+        }
+    }
     
     context->duration = opkt.pts * av_q2d(output_stream->time_base);
+    sg_metrics_set(&context->metrics.input_pts, context->duration);
     
     if (context->source_video_index < 0 || (output_stream == context->video && (opkt.flags & AV_PKT_FLAG_KEY))) {
         context->segment_duration = (opkt.pts - context->_pts) * av_q2d(output_stream->time_base);
+        
+        cut = context->segment_duration >= context->target_duration;
+        
+        if (context->scheduler) {
+            cut = sg_scheduler_cut(context->scheduler, context->segment_index, context->duration, cut, context->source_video_index >= 0, &skew);
+        }
     }
     
-    if (context->segment_duration >= context->target_duration) {
+    if (cut) {
         int ret;
         
+        sg_metrics_set(&context->metrics.skew, skew);
+        
         context->_pts = opkt.pts;
         
         if((ret = finish_segment(context))) {
@@ -503,30 +1022,206 @@ int segmenter_write_pkt(SegmenterContext* context, AVFormatContext *source, AVPa
     }
     
     
-    av_write_frame(context->output , &opkt);
+    if (av_write_frame(context->output , &opkt) < 0) {
+        av_packet_unref(&opkt);
+        return SGERROR(SGERROR_MUX);
+    }
+    
+    // raw audio segment lasts for all samples of its frames, as native cutter and rebuild count it
+    if (context->extension != kExtensionMPEGTS && opkt.duration > 0) {
+        context->segment_duration = (opkt.pts + opkt.duration - context->_pts) * av_q2d(output_stream->time_base);
+    }
+    
     av_packet_unref(&opkt);
     
     return 0;
 }
 
+/**
+ * @brief write packet from input to output
+ * @param context segmenter context
+ * @param source source input
+ * @param pkt packet to write, stays owned by caller
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_write_pkt(SegmenterContext* context, AVFormatContext *source, AVPacket *pkt) {
+    uint64_t start = sg_metrics_now();
+    int      ret;
+    
+    pthread_mutex_lock(&context->lock);
+    ret = write_pkt(context, source, pkt);
+    pthread_mutex_unlock(&context->lock);
+    
+    sg_metrics_add(ret ? &context->metrics.errors : &context->metrics.packets, 1);
+    sg_metrics_observe(&context->metrics.write_pkt, start);
+    
+    return ret;
+}
 
-static FILE* segmenter_open_playlist(SegmenterContext *context, char *index_file) {
-    int length;
-    char *filename;
+/**
+ * @brief write whole elementary audio frames of context initialized with segmenter_init_frames,
+ *        frames go to sink in one write (through encryption and checksum when enabled)
+ * @param context segmenter context
+ * @param buf frames data
+ * @param size frames size
+ * @param duration frames duration
+ * @param cut whether frames start new segment
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_write_frames(SegmenterContext *context, const uint8_t *buf, size_t size, double duration, int cut) {
+    uint64_t start = sg_metrics_now();
+    int      ret   = 0;
     
-    length = snprintf(NULL, 0, "%s/%s", context->file_base_name, index_file);
+    pthread_mutex_lock(&context->lock);
     
-    if (!(filename = (char*)alloca(sizeof(char)*(length+1)))) {
-        return NULL;
+    if (cut && !(ret = finish_segment(context))) {
+        ret = start_segment(context);
     }
     
-    snprintf(filename, length + 1, "%s/%s", context->file_base_name, index_file);
+    if (!ret && write_output(context, (uint8_t*)buf, (int)size) != (int)size) {
+        ret = SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (!ret) {
+        context->segment_duration += duration;
+        context->duration         += duration;
+        
+        sg_metrics_set(&context->metrics.input_pts, context->duration);
+    }
     
-    return fopen(filename, "w");
+    pthread_mutex_unlock(&context->lock);
+    
+    sg_metrics_add(ret ? &context->metrics.errors : &context->metrics.packets, 1);
+    sg_metrics_observe(&context->metrics.write_pkt, start);
+    
+    return ret;
 }
 
-static void segmenter_close_playlist(FILE *out) {
-    fclose(out);
+/**
+ * @brief write manifest with size, duration and checksums of segments listed in index,
+ *        manifest name is index file name with json extension
+ * @param context segmenter context
+ * @param index_file index file name
+ * @return 0 on success, negative error code on failure
+ */
+static int write_manifest(SegmenterContext *context, char *index_file) {
+    AVIOContext  *out;
+    uint8_t      *buf;
+    char         *name, *ext;
+    int          size, ret, length;
+    unsigned int i, j;
+    
+    ext    = strrchr(index_file, '.');
+    length = ext ? ext - index_file : strlen(index_file);
+    
+    if (!(name = (char*)sg_malloc(length + strlen(kExtensionManifest) + 2))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    sprintf(name, "%.*s.%s", length, index_file, kExtensionManifest);
+    
+    if (avio_open_dyn_buf(&out) < 0) {
+        sg_free(name);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    avio_printf(out, "{\n  \"media_sequence\": %u,\n  \"segments\": [", context->segment_sequence);
+    
+    for (i = context->segment_sequence; i < context->segment_index; i++) {
+        SegmentChecksum *checksum = &context->checksums[i - context->segment_sequence];
+        
+        avio_printf(out, "%s\n    {\"name\": \"%s\", \"size\": %zu, \"duration\": %.6f",
+                    i == context->segment_sequence ? "" : ",", segment_name(context, i),
+                    checksum->size, segment_duration(context, i));
+        
+        if (context->checksum->types & ChecksumTypeCRC32C) {
+            avio_printf(out, ", \"crc32c\": \"%08x\"", checksum->crc32c);
+        }
+        
+        if (context->checksum->types & ChecksumTypeSHA256) {
+            avio_printf(out, ", \"sha256\": \"");
+            
+            for (j = 0; j < SG_SHA256_SIZE; j++) {
+                avio_printf(out, "%02x", checksum->sha256[j]);
+            }
+            
+            avio_printf(out, "\"");
+        }
+        
+        avio_printf(out, "}");
+    }
+    
+    avio_printf(out, "\n  ]\n}\n");
+    
+    size = avio_close_dyn_buf(out, &buf);
+    ret  = context->sink.write_playlist(context->sink.opaque, name, buf, size);
+    
+    av_free(buf);
+    sg_free(name);
+    
+    return ret;
+}
+
+static int write_playlist(SegmenterContext *context, IndexType type, char* base_url, char *index_file) {
+    AVIOContext *out;
+    uint8_t     *buf;
+    int         size, ret;
+    
+    // manifest is replaced first, so every segment listed by index is already in manifest
+    if (context->checksum && (ret = write_manifest(context, index_file))) {
+        return ret;
+    }
+    
+    if (avio_open_dyn_buf(&out) < 0) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    avio_printf(out, "#EXTM3U\n"
+                     "#EXT-X-TARGETDURATION:%ld\n"
+                     "#EXT-X-VERSION:3\n"
+                     "#EXT-X-MEDIA-SEQUENCE:%u\n", lround(context->max_duration), context->segment_sequence);
+    
+    switch (type) {
+        case IndexTypeVOD:
+            avio_printf(out, "#EXT-X-PLAYLIST-TYPE:VOD\n");
+            break;
+        case IndexTypeEvent:
+            avio_printf(out, "#EXT-X-PLAYLIST-TYPE:EVENT\n");
+            break;
+        default:
+            break;
+    }
+    
+    unsigned int i;
+    for (i = context->segment_sequence; i < context->segment_index; i++) {
+        
+        if (context->crypt && (i == context->segment_sequence || sg_crypt_period(context->crypt, i) != sg_crypt_period(context->crypt, i - 1))) {
+            char *name = key_name(context, sg_crypt_period(context->crypt, i));
+            
+            if (!name) {
+                avio_close_dyn_buf(out, &buf);
+                av_free(buf);
+                return SGERROR(SGERROR_MEM_ALLOC);
+            }
+            
+            avio_printf(out, "#EXT-X-KEY:METHOD=AES-128,URI=\"%s%s\"\n", context->key_url ? context->key_url : base_url, name);
+            sg_free(name);
+        }
+        
+        avio_printf(out, "#EXTINF:%.6f,\n"
+                         "%s%s\n", segment_duration(context, i), base_url, segment_name(context, i));
+    }
+    
+    if ((type == IndexTypeEvent || type == IndexTypeVOD) && context->eof) {
+        avio_printf(out, "#EXT-X-ENDLIST");
+    }
+    
+    size = avio_close_dyn_buf(out, &buf);
+    ret  = context->sink.write_playlist(context->sink.opaque, index_file, buf, size);
+    
+    av_free(buf);
+    
+    return ret;
 }
 
 /**
@@ -536,44 +1231,131 @@ static void segmenter_close_playlist(FILE *out) {
  * @return 0 on success, negative error code on error 
  */
 int segmenter_write_playlist(SegmenterContext *context, IndexType type, char* base_url, char *index_file) {
+    uint64_t start = sg_metrics_now();
+    int      ret;
+    
+    pthread_mutex_lock(&context->lock);
     
+    // VOD index is written once at the end of stream, earlier calls write nothing and are not counted
     if (type == IndexTypeVOD && !context->eof) {
+        pthread_mutex_unlock(&context->lock);
         return 0;
     }
     
-    FILE *out = segmenter_open_playlist(context, index_file);
+    ret = write_playlist(context, type, base_url, index_file);
+    pthread_mutex_unlock(&context->lock);
     
-    if (!out) {
-        return SGERROR(SGERROR_FILE_WRITE);
-    }
-        
-    fprintf(out, "#EXTM3U\n"
-                 "#EXT-X-TARGETDURATION:%ld\n"
-                 "#EXT-X-VERSION:3\n"
-                 "#EXT-X-MEDIA-SEQUENCE:%u\n", lround(context->max_duration), context->segment_sequence);
+    sg_metrics_add(ret ? &context->metrics.errors : &context->metrics.playlists, 1);
+    sg_metrics_observe(&context->metrics.write_playlist, start);
     
-    switch (type) {
-        case IndexTypeVOD:
-            fprintf(out, "#EXT-X-PLAYLIST-TYPE:VOD\n");
+    return ret;
+}
+
+/**
+ * @brief append RFC 6381 codec of stream to list, H.264 profile and level are taken from SPS in extradata
+ *        (avcC or Annex B) when it is present, AAC object type from AudioSpecificConfig or profile
+ * @return length of list
+ */
+static int append_codec(AVStream *stream, char *list, int length, size_t size) {
+    AVCodecContext *codec = stream->codec;
+    const uint8_t  *data  = codec->extradata, *sps = NULL;
+    const char     *separator = length ? "," : "";
+    int            i, written = 0;
+    
+    switch (codec->codec_id) {
+        case AV_CODEC_ID_H264:
+            if (codec->extradata_size >= 4 && data[0] == 1) {
+                sps = data + 1;
+            }
+            
+            for (i = 0; !sps && i + 6 < codec->extradata_size; i++) {
+                if (!data[i] && !data[i + 1] && data[i + 2] == 1 && (data[i + 3] & 0x1f) == 7) {
+                    sps = data + i + 4;
+                }
+            }
+            
+            if (sps) {
+                written = snprintf(list + length, size - length, "%savc1.%02x%02x%02x", separator, sps[0], sps[1], sps[2]);
+            } else if (codec->profile != FF_PROFILE_UNKNOWN && codec->level != FF_LEVEL_UNKNOWN) {
+                written = snprintf(list + length, size - length, "%savc1.%02x%02x%02x", separator, codec->profile & 0xff,
+                                   codec->profile & FF_PROFILE_H264_CONSTRAINED ? 0x40 : 0, codec->level);
+            }
             break;
-        case IndexTypeEvent:
-            fprintf(out, "#EXT-X-PLAYLIST-TYPE:EVENT\n");
+        case AV_CODEC_ID_AAC:
+            // object type is profile + 1, AAC LC when neither is known
+            written = snprintf(list + length, size - length, "%smp4a.40.%d", separator,
+                               codec->extradata_size >= 2 ? data[0] >> 3 : codec->profile != FF_PROFILE_UNKNOWN ? codec->profile + 1 : 2);
+            break;
+        case AV_CODEC_ID_MP3:
+            written = snprintf(list + length, size - length, "%smp4a.40.34", separator);
+            break;
+        case AV_CODEC_ID_AC3:
+            written = snprintf(list + length, size - length, "%sac-3", separator);
             break;
         default:
             break;
     }
     
-    int i;
-    for (i = context->segment_sequence; i < context->segment_index; i++) {
-        fprintf(out, "#EXTINF:%ld,\n"
-                     "%s%s%u.%s\n", lround(segment_duration(context, i)), base_url, context->media_base_name, i, context->extension);
+    return written > 0 && length + written < size ? length + written : length;
+}
+
+/**
+ * @brief write master playlist of renditions, bandwidth is taken from measured segment bitrates,
+ *        codecs and resolution from rendition streams
+ * @param contexts rendition contexts
+ * @param uris index file uri of every rendition
+ * @param count number of renditions
+ * @param sink output sink of master playlist
+ * @param name master playlist file name
+ * @return 0 on success, negative error code on failure
+ */
+int segmenter_write_master_playlist(SegmenterContext **contexts, char **uris, int count, SegmenterSink *sink, char *name) {
+    AVIOContext *out;
+    uint8_t     *buf;
+    int         size, ret, i;
+    
+    if (avio_open_dyn_buf(&out) < 0) {
+        return SGERROR(SGERROR_MEM_ALLOC);
     }
     
-    if ((type == IndexTypeEvent || type == IndexTypeVOD) && context->eof) {
-        fprintf(out, "#EXT-X-ENDLIST");
+    avio_printf(out, "#EXTM3U\n"
+                     "#EXT-X-VERSION:3\n");
+    
+    for (i = 0; i < count; i++) {
+        SegmenterContext *context = contexts[i];
+        char             codecs[64];
+        int              length = 0;
+        
+        pthread_mutex_lock(&context->lock);
+        
+        avio_printf(out, "#EXT-X-STREAM-INF:BANDWIDTH=%ld,AVERAGE-BANDWIDTH=%ld", lround(context->max_bitrate), lround(context->avg_bitrate));
+        
+        if (context->video) {
+            length = append_codec(context->video, codecs, length, sizeof(codecs));
+        }
+        
+        if (context->audio) {
+            length = append_codec(context->audio, codecs, length, sizeof(codecs));
+        }
+        
+        // players filter renditions by codecs before downloading them
+        if (length) {
+            avio_printf(out, ",CODECS=\"%s\"", codecs);
+        }
+        
+        if (context->video && context->video->codec->width) {
+            avio_printf(out, ",RESOLUTION=%dx%d", context->video->codec->width, context->video->codec->height);
+        }
+        
+        pthread_mutex_unlock(&context->lock);
+        
+        avio_printf(out, "\n%s\n", uris[i]);
     }
     
-    segmenter_close_playlist(out);
+    size = avio_close_dyn_buf(out, &buf);
+    ret  = sink->write_playlist(sink->opaque, name, buf, size);
     
-    return 0;
+    av_free(buf);
+    
+    return ret;
 }
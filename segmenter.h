@@ -15,6 +15,15 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <libavformat/avformat.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "archive.h"
+#include "checksum.h"
+#include "crypt.h"
+#include "layout.h"
+#include "metrics.h"
+#include "scheduler.h"
 
 #ifndef __SEGMENTER__
 #define __SEGMENTER__
@@ -31,16 +40,54 @@ typedef enum {
     IndexTypeEvent
 } IndexType;
 
+/**
+ * Output sink. Every byte produced by the segmenter goes through these callbacks,
+ * names are relative to the sink root (segment file name or index file name).
+ * write_playlist also receives other small files replaced as a whole (encryption keys, manifest).
+ * open_segment, write_segment, close_segment and write_playlist are required. remove_segment,
+ * free, create_dir and remove_dir are optional, segments are kept when remove_segment is NULL
+ * and create_dir and remove_dir are called for sharded segment layouts.
+ * Callbacks return 0 on success or negative error code on failure.
+ */
+typedef struct {
+    void *opaque;
+    
+    int  (*open_segment)(void *opaque, const char *name, unsigned int index);
+    int  (*write_segment)(void *opaque, const uint8_t *buf, size_t size);
+    int  (*close_segment)(void *opaque, const char *name, unsigned int index, double duration, size_t size);
+    int  (*remove_segment)(void *opaque, const char *name, unsigned int index);
+    int  (*write_playlist)(void *opaque, const char *name, const uint8_t *buf, size_t size);
+    
+    void (*free)(void *opaque);
+    
+    int  (*create_dir)(void *opaque, const char *name);
+    int  (*remove_dir)(void *opaque, const char *name);
+} SegmenterSink;
+
 typedef struct {
     AVFormatContext          *output;
+    AVIOContext              *pb;
     AVBitStreamFilterContext *bfilter;
     
+    SegmenterSink   sink;
+    size_t          segment_size;
+    
+    SegmenterCrypt  *crypt;
+    uint8_t         *crypt_buf;
+    char            *key_url;
+    
+    SegmenterChecksum *checksum;
+    SegmentChecksum   *checksums;
+    
     char            *buf;
     size_t          buf_size;
     
     char            *file_base_name, *media_base_name;
     const char      *extension;
     
+    SegmentLayout   layout;
+    
+    SegmenterArchive *archive;
     
     AVStream        *video, *audio;
     int             source_video_index, source_audio_index;
@@ -59,27 +106,48 @@ typedef struct {
     
     double          avg_bitrate;
     double          max_bitrate;
+    unsigned int    bitrate_segments;
     
     int64_t         _pts;
     int64_t         _dts;
     
     int             eof;
     
+    SegmenterScheduler *scheduler;
+    
+    SegmenterMetrics metrics;
+    
+    pthread_mutex_t lock;
+    
 } SegmenterContext;
 
 int  segmenter_alloc_context(SegmenterContext**);
+int  segmenter_set_sink(SegmenterContext*, const SegmenterSink *sink);
+int  segmenter_set_encryption(SegmenterContext*, const uint8_t *key, unsigned int rotation, char *key_url);
+int  segmenter_set_checksums(SegmenterContext*, int types);
+int  segmenter_set_scheduler(SegmenterContext*, SegmenterScheduler *scheduler);
+int  segmenter_set_layout(SegmenterContext*, const SegmentLayout *layout);
+int  segmenter_set_archive(SegmenterContext*, const char *path, const char *index_file);
 int  segmenter_init(SegmenterContext *context, AVFormatContext *source, char* file_base_name, char* media_base_name, 
                         double target_duration, int media_filter);
 
+int  segmenter_init_frames(SegmenterContext *context, enum AVCodecID codec_id, char* file_base_name, char* media_base_name,
+                           double target_duration);
+
+int  segmenter_restore(SegmenterContext *context, char *file_base_name, char *media_base_name, const char *extension,
+                       double target_duration, unsigned int sequence, const double *durations, unsigned int count);
+
 int  segmenter_open(SegmenterContext*);
 int  segmenter_close(SegmenterContext*);
 
 int  segmenter_write_pkt(SegmenterContext* context, AVFormatContext *source, AVPacket *pkt);
+int  segmenter_write_frames(SegmenterContext *context, const uint8_t *buf, size_t size, double duration, int cut);
 
 void segmenter_free_context(SegmenterContext*);
 
 int  segmenter_set_sequence(SegmenterContext*, unsigned int sequence, int del);
 int  segmenter_write_playlist(SegmenterContext*, IndexType type, char* base_url, char *index_file);
+int  segmenter_write_master_playlist(SegmenterContext **contexts, char **uris, int count, SegmenterSink *sink, char *name);
 
 
 #endif
@@ -0,0 +1,993 @@
+// sgbench.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "segmenter.h"
+#include "cutter.h"
+#include "sink.h"
+#include "crypt.h"
+#include "checksum.h"
+#include "input.h"
+#include "layout.h"
+#include "synth.h"
+#include "util.h"
+
+#define DEFAULT_OUTPUT_DIR  "/tmp"
+#define DEFAULT_DATA_SIZE   256
+#define DEFAULT_SEGMENT_SIZE 1
+#define DEFAULT_DURATION    120
+#define DEFAULT_FILES       1000000
+
+static const int    kChunkSize         = 32768;
+static const double kTargetDuration    = 10;
+static const int    kWindowEntries     = 5;
+
+static const SynthFormat kFormats[]    = { SynthFormatTS, SynthFormatMP4 };
+static const double      kGops[]       = { 1, 2, 5 };
+static const int         kBitrates[]   = { 1000000, 6000000 };
+static const double      kLengths[]    = { 0.25, 1 };
+static const int         kAudioBitrate = 128000;
+
+static const char        *kLayouts[]   = { "flat", "range:1000", "hash:256" };
+static const int         kLookups      = 100000;
+
+struct config {
+    char   *input_file;
+    char   *output_dir;
+    FILE   *out;
+    
+    size_t data_size;
+    size_t segment_size;
+    double duration;
+    
+    unsigned int files;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_usage(char *name) {
+    printf("Usage:%s [options] <benchmark> where benchmark is one of: crypt, checksum, input, segment, live, audio, layout, all\n"
+           "\t" "-i <file> | --input=<file>         : media file for input benchmark\n"
+           "\t" "-o <file> | --output=<file>        : write JSON results to file (default stdout)\n"
+           "\t" "-f <path> | --file-base=<path>     : directory for benchmark output files (default /tmp)\n"
+           "\t" "-s <MB>   | --size=<MB>            : amount of data per run, also size of audio benchmark input (default 256)\n"
+           "\t" "-S <MB>   | --segment-size=<MB>    : segment size (default 1)\n"
+           "\t" "-d <sec>  | --duration=<sec>       : duration of synthetic media (default 120)\n"
+           "\t" "-N <num>  | --files=<num>          : number of segment files for layout benchmark (default 1000000)\n"
+           , name);
+}
+
+static int memory_open(void *opaque, const char *name, unsigned int index) { return 0; }
+static int memory_close(void *opaque, const char *name, unsigned int index, double duration, size_t size) { return 0; }
+
+static int memory_write(void *opaque, const uint8_t *buf, size_t size) {
+    memcpy(opaque, buf, size);
+    return 0;
+}
+
+/**
+ * @brief push data through sink the way segmenter output does
+ * @return throughput in MB/s, negative on failure
+ */
+static double run_output(struct config *config, SegmenterSink *sink, SegmenterCrypt *crypt) {
+    uint8_t  *data = (uint8_t*)malloc(kChunkSize), *buf = (uint8_t*)malloc(kChunkSize + SG_CRYPT_BLOCK_SIZE);
+    size_t   segments = config->data_size / config->segment_size, i, offset;
+    char     name[64];
+    double   start;
+    int      length;
+    
+    if (!data || !buf) {
+        free(data);
+        free(buf);
+        return -1;
+    }
+    
+    for (i = 0; i < kChunkSize; i++) {
+        data[i] = rand();
+    }
+    
+    start = now();
+    
+    for (i = 0; i < segments; i++) {
+        snprintf(name, sizeof(name), "sgbench%zu.ts", i);
+        
+        if (sink->open_segment(sink->opaque, name, i) || (crypt && sg_crypt_start(crypt, i) < 0)) {
+            break;
+        }
+        
+        for (offset = 0; offset < config->segment_size; offset += kChunkSize) {
+            if (crypt) {
+                length = sg_crypt_update(crypt, data, kChunkSize, buf);
+                sink->write_segment(sink->opaque, buf, length);
+            } else {
+                sink->write_segment(sink->opaque, data, kChunkSize);
+            }
+        }
+        
+        if (crypt) {
+            length = sg_crypt_finish(crypt, buf);
+            sink->write_segment(sink->opaque, buf, length);
+        }
+        
+        sink->close_segment(sink->opaque, name, i, 0, config->segment_size);
+        
+        if (sink->remove_segment) {
+            sink->remove_segment(sink->opaque, name, i);
+        }
+    }
+    
+    start = now() - start;
+    
+    free(data);
+    free(buf);
+    
+    return i == segments ? (segments * config->segment_size) / start / (1024 * 1024) : -1;
+}
+
+/**
+ * @brief compare unencrypted and AES-128 encrypted output throughput
+ */
+static int bench_crypt(struct config *config) {
+    uint8_t        memory[kChunkSize + SG_CRYPT_BLOCK_SIZE];
+    SegmenterSink  memory_sink = { memory, memory_open, memory_write, memory_close, NULL, NULL, NULL, NULL, NULL }, file_sink;
+    SegmenterCrypt *crypt;
+    double         plain_mem, aes_mem, plain_file, aes_file;
+    int            ret;
+    
+    if ((ret = sg_crypt_alloc(&crypt, NULL, 0))) {
+        fprintf(stderr, "crypt: %s\n", sg_strerror(SGUNERROR(ret)));
+        return ret;
+    }
+    
+    if ((ret = sg_file_sink_init(&file_sink, config->output_dir))) {
+        fprintf(stderr, "crypt: %s\n", sg_strerror(SGUNERROR(ret)));
+        sg_crypt_free(crypt);
+        return ret;
+    }
+    
+    plain_mem  = run_output(config, &memory_sink, NULL);
+    aes_mem    = run_output(config, &memory_sink, crypt);
+    plain_file = run_output(config, &file_sink, NULL);
+    aes_file   = run_output(config, &file_sink, crypt);
+    ret        = plain_mem < 0 || aes_mem < 0 || plain_file < 0 || aes_file < 0;
+    
+    file_sink.free(file_sink.opaque);
+    sg_crypt_free(crypt);
+    
+    if (ret) {
+        // keeps combined output valid JSON without reporting partial throughput
+        fprintf(stderr, "crypt: output run failed\n");
+        fprintf(config->out, "{\"benchmark\": \"crypt\", \"error\": \"output run failed\"}\n");
+        return ret;
+    }
+    
+    fprintf(config->out, "{\"benchmark\": \"crypt\", \"data_bytes\": %zu, \"segment_bytes\": %zu,\n"
+                         " \"memory\": {\"plain_mbps\": %.1f, \"aes128_mbps\": %.1f, \"cost_percent\": %.1f},\n"
+                         " \"file\": {\"plain_mbps\": %.1f, \"aes128_mbps\": %.1f, \"cost_percent\": %.1f}}\n",
+            config->data_size, config->segment_size,
+            plain_mem, aes_mem, 100 * (1 - aes_mem / plain_mem),
+            plain_file, aes_file, 100 * (1 - aes_file / plain_file));
+    
+    return 0;
+}
+
+/**
+ * @brief measure inline segment checksum throughput
+ */
+static int bench_checksum(struct config *config) {
+    SegmenterChecksum *checksum;
+    SegmentChecksum   result;
+    uint8_t           *data = (uint8_t*)malloc(kChunkSize);
+    double            start, crc32c, portable, sha256 = 0;
+    size_t            offset;
+    uint32_t          crc = 0;
+    int               i;
+    
+    if (!data) {
+        return 1;
+    }
+    
+    for (i = 0; i < kChunkSize; i++) {
+        data[i] = rand();
+    }
+    
+    start = now();
+    for (offset = 0; offset < config->data_size; offset += kChunkSize) {
+        crc = sg_crc32c(crc, data, kChunkSize);
+    }
+    crc32c = config->data_size / (now() - start) / (1024 * 1024);
+    
+    start = now();
+    for (offset = 0; offset < config->data_size; offset += kChunkSize) {
+        crc = sg_crc32c_portable(crc, data, kChunkSize);
+    }
+    portable = config->data_size / (now() - start) / (1024 * 1024);
+    
+    if (!sg_checksum_alloc(&checksum, ChecksumTypeSHA256)) {
+        start = now();
+        sg_checksum_start(checksum);
+        for (offset = 0; offset < config->data_size; offset += kChunkSize) {
+            sg_checksum_update(checksum, data, kChunkSize);
+        }
+        sg_checksum_finish(checksum, &result);
+        sha256 = config->data_size / (now() - start) / (1024 * 1024);
+        
+        sg_checksum_free(checksum);
+    }
+    
+    fprintf(config->out, "{\"benchmark\": \"checksum\", \"data_bytes\": %zu, \"crc32c_accelerated\": %s,\n"
+                         " \"crc32c_mbps\": %.1f, \"crc32c_portable_mbps\": %.1f, \"sha256_mbps\": %.1f, \"crc\": \"%08x\"}\n",
+            config->data_size, sg_crc32c_accelerated() ? "true" : "false", crc32c, portable, sha256, crc);
+    
+    free(data);
+    
+    return 0;
+}
+
+struct input_stats {
+    double  mbps;
+    long    read_syscalls;
+    long    major_faults;
+    long    minor_faults;
+    long    block_reads;
+};
+
+/**
+ * @brief read syscall counter of current process
+ */
+static long read_syscalls() {
+    char line[128];
+    long count = -1;
+    FILE *in   = fopen("/proc/self/io", "r");
+    
+    if (!in) {
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "syscr: %ld", &count) == 1) {
+            break;
+        }
+    }
+    
+    fclose(in);
+    
+    return count;
+}
+
+/**
+ * @brief drop file pages from page cache
+ */
+static void drop_cache(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/**
+ * @brief demux whole input and collect i/o statistics
+ */
+static int run_input(struct config *config, int flags, int cold, struct input_stats *stats) {
+    AVFormatContext *source = NULL;
+    AVPacket        pkt;
+    struct rusage   usage_start, usage_end;
+    struct stat     st;
+    long            syscalls;
+    double          start;
+    
+    if (stat(config->input_file, &st)) {
+        return -1;
+    }
+    
+    if (cold) {
+        drop_cache(config->input_file);
+    }
+    
+    getrusage(RUSAGE_SELF, &usage_start);
+    syscalls = read_syscalls();
+    start    = now();
+    
+    if (sg_input_open(&source, config->input_file, flags)) {
+        return -1;
+    }
+    
+    while (av_read_frame(source, &pkt) >= 0) {
+        av_packet_unref(&pkt);
+    }
+    
+    sg_input_close(&source);
+    
+    stats->mbps          = st.st_size / (now() - start) / (1024 * 1024);
+    stats->read_syscalls = read_syscalls() - syscalls;
+    
+    getrusage(RUSAGE_SELF, &usage_end);
+    
+    stats->major_faults = usage_end.ru_majflt - usage_start.ru_majflt;
+    stats->minor_faults = usage_end.ru_minflt - usage_start.ru_minflt;
+    stats->block_reads  = usage_end.ru_inblock - usage_start.ru_inblock;
+    
+    return 0;
+}
+
+static void print_input_stats(FILE *out, const char *name, struct input_stats *stats, int last) {
+    fprintf(out, "  \"%s\": {\"mbps\": %.1f, \"read_syscalls\": %ld, \"major_faults\": %ld, \"minor_faults\": %ld, \"block_reads\": %ld}%s\n",
+            name, stats->mbps, stats->read_syscalls, stats->major_faults, stats->minor_faults, stats->block_reads, last ? "" : ",");
+}
+
+/**
+ * @brief compare default file protocol with memory mapped input on cold and warm page cache
+ */
+static int bench_input(struct config *config) {
+    struct input_stats default_cold, default_warm, mapped_cold, mapped_warm;
+    
+    if (!config->input_file) {
+        fprintf(stderr, "input: no input file was supplied\n");
+        return 1;
+    }
+    
+    if (run_input(config, InputFlagNoMap, 1, &default_cold) || run_input(config, InputFlagNoMap, 0, &default_warm) ||
+        run_input(config, 0, 1, &mapped_cold) || run_input(config, 0, 0, &mapped_warm)) {
+        fprintf(stderr, "input: can't read '%s'\n", config->input_file);
+        return 1;
+    }
+    
+    fprintf(config->out, "{\"benchmark\": \"input\", \"file\": \"%s\",\n", config->input_file);
+    print_input_stats(config->out, "default_cold", &default_cold, 0);
+    print_input_stats(config->out, "default_warm", &default_warm, 0);
+    print_input_stats(config->out, "mapped_cold",  &mapped_cold,  0);
+    print_input_stats(config->out, "mapped_warm",  &mapped_warm,  1);
+    fprintf(config->out, "}\n");
+    
+    return 0;
+}
+
+struct stage {
+    long   count;
+    double total;
+    double max;
+};
+
+static void stage_add(struct stage *stage, double elapsed) {
+    stage->count++;
+    stage->total += elapsed;
+    
+    if (elapsed > stage->max) {
+        stage->max = elapsed;
+    }
+}
+
+static void print_stage(FILE *out, const char *name, struct stage *stage, int last) {
+    fprintf(out, "  \"%s\": {\"count\": %ld, \"total_ms\": %.3f, \"mean_us\": %.2f, \"max_us\": %.2f}%s\n",
+            name, stage->count, stage->total * 1e3, stage->count ? stage->total * 1e6 / stage->count : 0, stage->max * 1e6, last ? "" : ",");
+}
+
+static void print_header(FILE *out, const char *name) {
+    unsigned int version = avformat_version();
+    
+    fprintf(out, "{\"benchmark\": \"%s\", \"libavformat\": \"%u.%u.%u\",\n", name, version >> 16, (version >> 8) & 0xff, version & 0xff);
+}
+
+/**
+ * @brief create empty scratch directory inside output directory
+ * @return directory path, should be freed with remove_dir
+ */
+static char* make_dir(struct config *config) {
+    char *path = (char*)malloc(strlen(config->output_dir) + 32);
+    
+    if (!path) {
+        return NULL;
+    }
+    
+    sprintf(path, "%s/sgbench.XXXXXX", config->output_dir);
+    
+    if (!mkdtemp(path)) {
+        free(path);
+        return NULL;
+    }
+    
+    return path;
+}
+
+/**
+ * @brief remove scratch directory with its files and empty subdirectories
+ */
+static void remove_dir(char *path) {
+    char          name[PATH_MAX];
+    struct dirent *entry;
+    DIR           *dir = opendir(path);
+    
+    while (dir && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+            snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+            
+            if (unlink(name)) {
+                rmdir(name);
+            }
+        }
+    }
+    
+    if (dir) {
+        closedir(dir);
+    }
+    
+    rmdir(path);
+    free(path);
+}
+
+/**
+ * @brief segment synthetic file and time every pipeline stage
+ */
+static int run_segment(struct config *config, SynthParams *params, int first) {
+    AVFormatContext  *source = NULL;
+    SegmenterContext *output = NULL;
+    AVPacket         pkt;
+    struct stage     demux = {0}, write = {0}, cut = {0}, playlist = {0};
+    char             *dir, filename[PATH_MAX];
+    unsigned int     prev_index = 0;
+    double           start, elapsed;
+    int              ret;
+    
+    if (!(dir = make_dir(config))) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    snprintf(filename, sizeof(filename), "%s/source.%s", dir, params->format == SynthFormatMP4 ? "mp4" : "ts");
+    
+    if ((ret = sg_synth_write_file(params, filename))) {
+        remove_dir(dir);
+        return ret;
+    }
+    
+    start = now();
+    
+    if (sg_input_open(&source, filename, 0) || avformat_find_stream_info(source, NULL) < 0) {
+        sg_input_close(&source);
+        remove_dir(dir);
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    stage_add(&demux, now() - start);
+    
+    if ((ret = segmenter_alloc_context(&output)) ||
+        (ret = segmenter_init(output, source, dir, "fileSequence", kTargetDuration, MediaTypeAudio | MediaTypeVideo)) ||
+        (ret = segmenter_open(output))) {
+        goto end;
+    }
+    
+    while (1) {
+        start = now();
+        
+        if (av_read_frame(source, &pkt) < 0) {
+            break;
+        }
+        
+        stage_add(&demux, (elapsed = now()) - start);
+        
+        ret = segmenter_write_pkt(output, source, &pkt);
+        
+        stage_add(prev_index < output->segment_index ? &cut : &write, now() - elapsed);
+        
+        av_packet_unref(&pkt);
+        
+        if (ret) {
+            goto end;
+        }
+        
+        if (prev_index < output->segment_index) {
+            prev_index = output->segment_index;
+            
+            start = now();
+            segmenter_write_playlist(output, IndexTypeVOD, "", "prog_index.m3u8");
+            stage_add(&playlist, now() - start);
+        }
+    }
+    
+    start = now();
+    segmenter_close(output);
+    stage_add(&cut, now() - start);
+    
+    start = now();
+    ret = segmenter_write_playlist(output, IndexTypeVOD, "", "prog_index.m3u8");
+    stage_add(&playlist, now() - start);
+    
+    if (!ret) {
+        fprintf(config->out, first ? "" : ",\n");
+        print_header(config->out, "segment");
+        fprintf(config->out, "  \"format\": \"%s\", \"gop\": %.1f, \"video_bitrate\": %d, \"media_seconds\": %.1f, \"segments\": %u,\n",
+                params->format == SynthFormatMP4 ? "mp4" : "ts", params->gop, params->video_bitrate, params->duration, output->segment_index);
+        print_stage(config->out, "demux",          &demux,    0);
+        print_stage(config->out, "write_pkt",      &write,    0);
+        print_stage(config->out, "segment_cut",    &cut,      0);
+        print_stage(config->out, "write_playlist", &playlist, 1);
+        fprintf(config->out, "}");
+    }
+
+end:
+    if (output) {
+        segmenter_free_context(output);
+    }
+    
+    sg_input_close(&source);
+    remove_dir(dir);
+    
+    return ret;
+}
+
+/**
+ * @brief per-stage timing over container, GOP length, bitrate and input length matrix,
+ *        short inputs last quarter of configured duration
+ */
+static int bench_segment(struct config *config) {
+    SynthParams params;
+    int         f, g, b, l, ret = 0, first = 1;
+    
+    fprintf(config->out, "[\n");
+    
+    for (f = 0; f < sizeof(kFormats) / sizeof(kFormats[0]); f++) {
+        for (g = 0; g < sizeof(kGops) / sizeof(kGops[0]); g++) {
+            for (b = 0; b < sizeof(kBitrates) / sizeof(kBitrates[0]); b++) {
+                for (l = 0; l < sizeof(kLengths) / sizeof(kLengths[0]); l++) {
+                    params = (SynthParams){ kFormats[f], config->duration * kLengths[l], kGops[g], 25, kBitrates[b], kAudioBitrate };
+                    
+                    if ((ret = run_segment(config, &params, first))) {
+                        fprintf(stderr, "segment: %s\n", sg_strerror(SGUNERROR(ret)));
+                        goto end;
+                    }
+                    
+                    first = 0;
+                }
+            }
+        }
+    }
+
+end:
+    fprintf(config->out, "\n]\n");
+    
+    return ret;
+}
+
+/**
+ * @brief replay synthetic live stream without pacing, sliding window with file deletion
+ */
+static int bench_live(struct config *config) {
+    SynthParams      params = { SynthFormatTS, config->duration, 2, 25, 4000000, kAudioBitrate };
+    SynthSource      *source;
+    SegmenterContext *output = NULL;
+    AVPacket         pkt;
+    struct stage     write = {0}, cut = {0}, playlist = {0};
+    char             *dir;
+    unsigned int     prev_index = 0;
+    double           start, wall;
+    int              ret;
+    
+    if (!(dir = make_dir(config))) {
+        return 1;
+    }
+    
+    if ((ret = sg_synth_open(&source, &params))) {
+        remove_dir(dir);
+        return ret;
+    }
+    
+    if ((ret = segmenter_alloc_context(&output)) ||
+        (ret = segmenter_init(output, source->context, dir, "fileSequence", kTargetDuration, MediaTypeAudio | MediaTypeVideo)) ||
+        (ret = segmenter_open(output))) {
+        goto end;
+    }
+    
+    wall = now();
+    
+    while (!sg_synth_read(source, &pkt)) {
+        start = now();
+        ret   = segmenter_write_pkt(output, source->context, &pkt);
+        
+        stage_add(prev_index < output->segment_index ? &cut : &write, now() - start);
+        
+        av_packet_unref(&pkt);
+        
+        if (ret) {
+            goto end;
+        }
+        
+        if (prev_index < output->segment_index) {
+            prev_index = output->segment_index;
+            
+            start = now();
+            
+            if (output->segment_index > kWindowEntries) {
+                segmenter_set_sequence(output, output->segment_index - kWindowEntries, 1);
+            }
+            
+            segmenter_write_playlist(output, IndexTypeLive, "", "prog_index.m3u8");
+            stage_add(&playlist, now() - start);
+        }
+    }
+    
+    segmenter_close(output);
+    ret  = segmenter_write_playlist(output, IndexTypeLive, "", "prog_index.m3u8");
+    wall = now() - wall;
+    
+    if (!ret) {
+        print_header(config->out, "live");
+        fprintf(config->out, "  \"media_seconds\": %.1f, \"wall_seconds\": %.3f, \"speed\": %.1f, \"segments\": %u,\n",
+                params.duration, wall, params.duration / wall, output->segment_index);
+        print_stage(config->out, "write_pkt",      &write,    0);
+        print_stage(config->out, "segment_cut",    &cut,      0);
+        print_stage(config->out, "write_playlist", &playlist, 1);
+        fprintf(config->out, "}\n");
+    }
+
+end:
+    if (ret) {
+        fprintf(stderr, "live: %s\n", sg_strerror(SGUNERROR(ret)));
+    }
+    
+    if (output) {
+        segmenter_free_context(output);
+    }
+    
+    sg_synth_close(source);
+    remove_dir(dir);
+    
+    return ret;
+}
+
+/**
+ * @brief create, look up and remove segment files of one layout through file sink
+ */
+static int run_layout(struct config *config, const char *spec, unsigned int *lookups) {
+    SegmenterSink sink;
+    SegmentLayout layout;
+    struct stat   st;
+    struct stage  create = {0}, lookup = {0}, remove = {0};
+    char          *dir, name[64], path[PATH_MAX];
+    unsigned int  i, found = 0;
+    double        start;
+    int           ret;
+    
+    if ((ret = sg_layout_parse(&layout, spec))) {
+        return ret;
+    }
+    
+    if (!(dir = make_dir(config))) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if ((ret = sg_file_sink_init(&sink, dir))) {
+        remove_dir(dir);
+        return ret;
+    }
+    
+    for (i = 0; i < config->files; i++) {
+        start = now();
+        
+        sg_layout_name(&layout, "fileSequence", i, "ts", name, sizeof(name));
+        
+        if ((ret = sg_layout_prepare(&layout, i, sink.create_dir, sink.opaque)) ||
+            (ret = sink.open_segment(sink.opaque, name, i)) ||
+            (ret = sink.close_segment(sink.opaque, name, i, kTargetDuration, 0))) {
+            goto end;
+        }
+        
+        stage_add(&create, now() - start);
+    }
+    
+    for (i = 0; i < kLookups; i++) {
+        unsigned int index = (unsigned int)(((uint64_t)rand() * RAND_MAX + rand()) % config->files);
+        
+        start = now();
+        
+        sg_layout_name(&layout, "fileSequence", index, "ts", name, sizeof(name));
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        
+        found += !stat(path, &st);
+        
+        stage_add(&lookup, now() - start);
+    }
+    
+    for (i = 0; i < config->files; i++) {
+        start = now();
+        
+        sg_layout_name(&layout, "fileSequence", i, "ts", name, sizeof(name));
+        sink.remove_segment(sink.opaque, name, i);
+        sg_layout_release(&layout, i, sink.remove_dir, sink.opaque);
+        
+        stage_add(&remove, now() - start);
+    }
+    
+    fprintf(config->out, "  \"%s\": {\n", spec);
+    print_stage(config->out, "create", &create, 0);
+    print_stage(config->out, "lookup", &lookup, 0);
+    print_stage(config->out, "remove", &remove, 1);
+    fprintf(config->out, "  }");
+    
+    *lookups = found;
+
+end:
+    sink.free(sink.opaque);
+    remove_dir(dir);
+    
+    return ret;
+}
+
+/**
+ * @brief compare flat output directory with range and hash sharded layouts at large file counts
+ */
+static int bench_layout(struct config *config) {
+    unsigned int found;
+    int          i, ret;
+    
+    fprintf(config->out, "{\"benchmark\": \"layout\", \"files\": %u, \"lookups\": %d,\n", config->files, kLookups);
+    
+    for (i = 0; i < sizeof(kLayouts) / sizeof(kLayouts[0]); i++) {
+        fprintf(config->out, i ? ",\n" : "");
+        
+        if ((ret = run_layout(config, kLayouts[i], &found)) || found != kLookups) {
+            fprintf(stderr, "layout: %s, %s\n", kLayouts[i], ret ? sg_strerror(SGUNERROR(ret)) : "missing files");
+            fprintf(config->out, "\n}\n");
+            return 1;
+        }
+    }
+    
+    fprintf(config->out, "\n}\n");
+    
+    return 0;
+}
+
+struct audio_stats {
+    double       seconds;
+    double       mbps;
+    unsigned int segments;
+    double       duration;
+};
+
+/**
+ * @brief segment audio file through libavformat or native frame cutter
+ */
+static int run_audio(struct config *config, const char *filename, int native, struct audio_stats *stats) {
+    AVFormatContext  *source = NULL;
+    SegmenterCutter  *cutter = NULL;
+    SegmenterContext *output = NULL;
+    AVPacket         pkt;
+    struct stat      st;
+    char             *dir;
+    unsigned int     i;
+    double           start;
+    int              ret = 0;
+    
+    if (stat(filename, &st) || !(dir = make_dir(config))) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    start = now();
+    
+    if (native) {
+        if (!(ret = sg_cutter_open(&cutter, filename))) {
+            ret = sg_cutter_probe(cutter);
+        }
+    } else if (sg_input_open(&source, filename, 0) || avformat_find_stream_info(source, NULL) < 0) {
+        ret = SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    if (ret || (ret = segmenter_alloc_context(&output)) ||
+        (ret = native ? segmenter_init_frames(output, cutter->codec_id, dir, "fileSequence", kTargetDuration)
+                      : segmenter_init(output, source, dir, "fileSequence", kTargetDuration, MediaTypeAudio)) ||
+        (ret = segmenter_open(output))) {
+        goto end;
+    }
+    
+    if (native) {
+        do {
+            ret = sg_cutter_write(cutter, output);
+        } while (ret > 0);
+    } else {
+        while (!ret && av_read_frame(source, &pkt) >= 0) {
+            ret = segmenter_write_pkt(output, source, &pkt);
+            av_packet_unref(&pkt);
+        }
+    }
+    
+    if (ret || (ret = segmenter_close(output)) || (ret = segmenter_write_playlist(output, IndexTypeVOD, "", "prog_index.m3u8"))) {
+        goto end;
+    }
+    
+    stats->seconds  = now() - start;
+    stats->mbps     = st.st_size / stats->seconds / (1024 * 1024);
+    stats->segments = output->segment_index;
+    stats->duration = 0;
+    
+    for (i = 0; i < output->segment_index; i++) {
+        stats->duration += output->durations[i];
+    }
+
+end:
+    if (output) {
+        segmenter_free_context(output);
+    }
+    
+    if (cutter) {
+        sg_cutter_close(cutter);
+    }
+    
+    sg_input_close(&source);
+    remove_dir(dir);
+    
+    return ret;
+}
+
+static void print_audio_stats(FILE *out, const char *name, struct audio_stats *stats, int last) {
+    fprintf(out, "  \"%s\": {\"seconds\": %.3f, \"mbps\": %.1f, \"segments\": %u, \"duration\": %.3f}%s\n",
+            name, stats->seconds, stats->mbps, stats->segments, stats->duration, last ? "" : ",");
+}
+
+/**
+ * @brief compare libavformat demux and mux path with native cutter on audio only ADTS input
+ */
+static int bench_audio(struct config *config) {
+    SynthParams        params = { SynthFormatADTS, config->data_size * 8.0 / kAudioBitrate, 0, 25, 0, kAudioBitrate };
+    struct audio_stats libavformat, native;
+    char               *dir, filename[PATH_MAX];
+    int                ret;
+    
+    if (!(dir = make_dir(config))) {
+        return 1;
+    }
+    
+    snprintf(filename, sizeof(filename), "%s/source.aac", dir);
+    
+    if (!(ret = sg_synth_write_file(&params, filename)) && !(ret = run_audio(config, filename, 0, &libavformat))) {
+        ret = run_audio(config, filename, 1, &native);
+    }
+    
+    if (!ret) {
+        print_header(config->out, "audio");
+        fprintf(config->out, "  \"media_seconds\": %.1f, \"audio_bitrate\": %d, \"speedup\": %.1f,\n",
+                params.duration, params.audio_bitrate, libavformat.seconds / native.seconds);
+        print_audio_stats(config->out, "libavformat", &libavformat, 0);
+        print_audio_stats(config->out, "native",      &native,      1);
+        fprintf(config->out, "}\n");
+    } else {
+        fprintf(stderr, "audio: %s\n", sg_strerror(SGUNERROR(ret)));
+    }
+    
+    remove_dir(dir);
+    
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    
+    struct option options_long[] = {
+        {"help",                       no_argument,       NULL, 'h'},
+        {"input",                      required_argument, NULL, 'i'},
+        {"output",                     required_argument, NULL, 'o'},
+        {"file-base",                  required_argument, NULL, 'f'},
+        {"size",                       required_argument, NULL, 's'},
+        {"segment-size",               required_argument, NULL, 'S'},
+        {"duration",                   required_argument, NULL, 'd'},
+        {"files",                      required_argument, NULL, 'N'},
+        {0, 0, 0, 0}
+    };
+    
+    char* options_short = "hi:o:f:s:S:d:N:";
+    
+    struct config config;
+    
+    config.input_file   = NULL;
+    config.output_dir   = DEFAULT_OUTPUT_DIR;
+    config.out          = stdout;
+    config.data_size    = (size_t)DEFAULT_DATA_SIZE * 1024 * 1024;
+    config.segment_size = (size_t)DEFAULT_SEGMENT_SIZE * 1024 * 1024;
+    config.duration     = DEFAULT_DURATION;
+    config.files        = DEFAULT_FILES;
+    
+    int c;
+    while ((c = getopt_long(argc, argv, options_short, options_long, NULL)) != -1) {
+        switch (c) {
+            case 'h': print_usage(argv[0]); exit(EXIT_SUCCESS); break;
+            
+            case 'o':
+                if (!(config.out = fopen(optarg, "w"))) {
+                    fprintf(stderr, "%s: can't open '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            
+            case 'i': config.input_file   = optarg;                                break;
+            case 'f': config.output_dir   = optarg;                                break;
+            case 's': config.data_size    = (size_t)(atof(optarg) * 1024 * 1024);  break;
+            case 'S': config.segment_size = (size_t)(atof(optarg) * 1024 * 1024);  break;
+            case 'd': config.duration     = atof(optarg);                          break;
+            case 'N': config.files        = strtoul(optarg, NULL, 10);             break;
+            
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (optind >= argc || !config.segment_size || config.data_size < config.segment_size || config.duration <= 0 || !config.files) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    int ret = 1;
+    
+    av_register_all();
+    
+    if (!strcmp(argv[optind], "crypt")) {
+        ret = bench_crypt(&config);
+    } else if (!strcmp(argv[optind], "checksum")) {
+        ret = bench_checksum(&config);
+    } else if (!strcmp(argv[optind], "input")) {
+        ret = bench_input(&config);
+    } else if (!strcmp(argv[optind], "segment")) {
+        ret = bench_segment(&config);
+    } else if (!strcmp(argv[optind], "live")) {
+        ret = bench_live(&config);
+    } else if (!strcmp(argv[optind], "audio")) {
+        ret = bench_audio(&config);
+    } else if (!strcmp(argv[optind], "layout")) {
+        ret = bench_layout(&config);
+    } else if (!strcmp(argv[optind], "all")) {
+        fprintf(config.out, "[\n");
+        
+        ret = bench_crypt(&config);
+        fprintf(config.out, ",\n");
+        ret |= bench_checksum(&config);
+        fprintf(config.out, ",\n");
+        ret |= bench_segment(&config);
+        fprintf(config.out, ",\n");
+        ret |= bench_live(&config);
+        fprintf(config.out, ",\n");
+        ret |= bench_audio(&config);
+        
+        if (config.input_file) {
+            fprintf(config.out, ",\n");
+            ret |= bench_input(&config);
+        }
+        
+        fprintf(config.out, "]\n");
+    } else {
+        fprintf(stderr, "%s: unknown benchmark '%s'\n", argv[0], argv[optind]);
+    }
+    
+    if (config.out != stdout) {
+        fclose(config.out);
+    }
+    
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,652 @@
+// sghttp.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "segmenter.h"
+#include "http.h"
+#include "log.h"
+#include "util.h"
+
+#define SERVER_REQUESTS 64
+#define SERVER_FILES    16
+#define SERVER_BUFFER   4096
+
+static const size_t kChunkSize     = 64 * 1024;
+static const int    kSegmentChunks = 8;
+static const int    kHttpAttempts  = 4;
+
+/**
+ * @brief request as seen by stand-in server
+ */
+struct request {
+    char   method[16];
+    char   path[256];
+    int    connection;
+    int    chunked;
+    size_t size;
+    int    status;
+};
+
+struct file {
+    char    path[256];
+    uint8_t *data;
+    size_t  size;
+};
+
+/**
+ * @brief stand-in HTTP server keeping uploaded files in memory, next PUT requests
+ *        can be answered with given status to exercise retries
+ */
+struct server {
+    int             fd;
+    int             port;
+    pthread_mutex_t lock;
+    
+    int             connections;
+    int             fail_status;
+    int             fail_count;
+    
+    struct request  requests[SERVER_REQUESTS];
+    int             nb_requests;
+    
+    struct file     files[SERVER_FILES];
+};
+
+struct client {
+    struct server *server;
+    int           fd;
+    int           id;
+    
+    char          buf[SERVER_BUFFER];
+    size_t        pos, size;
+};
+
+static int client_getc(struct client *client) {
+    ssize_t ret;
+    
+    if (client->pos == client->size) {
+        if ((ret = read(client->fd, client->buf, sizeof(client->buf))) <= 0) {
+            return -1;
+        }
+        
+        client->pos  = 0;
+        client->size = ret;
+    }
+    
+    return (uint8_t)client->buf[client->pos++];
+}
+
+static int client_line(struct client *client, char *line, size_t size) {
+    size_t length = 0;
+    int    c;
+    
+    while ((c = client_getc(client)) >= 0 && c != '\n') {
+        if (c != '\r' && length + 1 < size) {
+            line[length++] = c;
+        }
+    }
+    
+    line[length] = '\0';
+    
+    return c < 0 ? -1 : 0;
+}
+
+static int client_read(struct client *client, uint8_t **data, size_t *size, size_t length) {
+    uint8_t *buf = (uint8_t*)realloc(*data, *size + length + 1);
+    size_t  i;
+    int     c;
+    
+    if (!buf) {
+        return -1;
+    }
+    
+    for (i = 0; i < length; i++) {
+        if ((c = client_getc(client)) < 0) {
+            return -1;
+        }
+        
+        buf[*size + i] = c;
+    }
+    
+    *data  = buf;
+    *size += length;
+    
+    return 0;
+}
+
+/**
+ * @brief read request body, either chunked or of content length
+ */
+static int client_body(struct client *client, int chunked, size_t length, uint8_t **data, size_t *size) {
+    char line[256];
+    
+    if (!chunked) {
+        return client_read(client, data, size, length);
+    }
+    
+    do {
+        if (client_line(client, line, sizeof(line))) {
+            return -1;
+        }
+        
+        length = strtoul(line, NULL, 16);
+        
+        if (client_read(client, data, size, length) || client_line(client, line, sizeof(line))) {
+            return -1;
+        }
+    } while (length);
+    
+    return 0;
+}
+
+static const char* status_text(int status) {
+    switch (status) {
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 404: return "Not Found";
+        case 503: return "Service Unavailable";
+        default:  return "Error";
+    }
+}
+
+/**
+ * @brief answer request from in-memory files, takes ownership of body
+ * @return response status
+ */
+static int server_answer(struct server *server, struct request *request, uint8_t *data) {
+    struct file *file = NULL, *empty = NULL;
+    int         i;
+    
+    for (i = 0; i < SERVER_FILES; i++) {
+        if (!strcmp(server->files[i].path, request->path)) {
+            file = &server->files[i];
+        } else if (!empty && !server->files[i].path[0]) {
+            empty = &server->files[i];
+        }
+    }
+    
+    if (!strcmp(request->method, "PUT") && server->fail_count) {
+        server->fail_count--;
+        free(data);
+        return server->fail_status;
+    }
+    
+    if (!strcmp(request->method, "PUT") && (file = file ? file : empty)) {
+        free(file->data);
+        snprintf(file->path, sizeof(file->path), "%s", request->path);
+        file->data = data;
+        file->size = request->size;
+        return 201;
+    }
+    
+    free(data);
+    
+    if (!strcmp(request->method, "DELETE") && file) {
+        free(file->data);
+        memset(file, 0, sizeof(struct file));
+        return 204;
+    }
+    
+    return 404;
+}
+
+static void* client_thread(void *opaque) {
+    struct client  *client = (struct client*)opaque;
+    struct server  *server = client->server;
+    struct request request;
+    char           line[1024], response[128];
+    uint8_t        *data;
+    size_t         length;
+    int            status;
+    
+    while (!client_line(client, line, sizeof(line))) {
+        memset(&request, 0, sizeof(request));
+        request.connection = client->id;
+        
+        if (sscanf(line, "%15s %255s", request.method, request.path) != 2) {
+            break;
+        }
+        
+        length = 0;
+        
+        while (!client_line(client, line, sizeof(line)) && line[0]) {
+            if (!strncasecmp(line, "Content-Length:", 15)) {
+                length = strtoul(line + 15, NULL, 10);
+            } else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line + 18, "chunked")) {
+                request.chunked = 1;
+            }
+        }
+        
+        data = NULL;
+        
+        if (client_body(client, request.chunked, length, &data, &request.size)) {
+            free(data);
+            break;
+        }
+        
+        pthread_mutex_lock(&server->lock);
+        
+        status = request.status = server_answer(server, &request, data);
+        
+        if (server->nb_requests < SERVER_REQUESTS) {
+            server->requests[server->nb_requests++] = request;
+        }
+        
+        pthread_mutex_unlock(&server->lock);
+        
+        length = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n", status, status_text(status));
+        
+        if (write(client->fd, response, length) != length) {
+            break;
+        }
+    }
+    
+    close(client->fd);
+    free(client);
+    
+    return NULL;
+}
+
+static void* server_thread(void *opaque) {
+    struct server *server = (struct server*)opaque;
+    struct client *client;
+    pthread_t     thread;
+    int           fd;
+    
+    while ((fd = accept(server->fd, NULL, NULL)) >= 0) {
+        if (!(client = (struct client*)calloc(1, sizeof(struct client)))) {
+            close(fd);
+            continue;
+        }
+        
+        pthread_mutex_lock(&server->lock);
+        client->id = ++server->connections;
+        pthread_mutex_unlock(&server->lock);
+        
+        client->server = server;
+        client->fd     = fd;
+        
+        if (pthread_create(&thread, NULL, client_thread, client)) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        
+        pthread_detach(thread);
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief listen on ephemeral loopback port and serve connections in background
+ */
+static int server_start(struct server *server) {
+    struct sockaddr_in addr;
+    socklen_t          length = sizeof(addr);
+    pthread_t          thread;
+    
+    memset(server, 0, sizeof(struct server));
+    pthread_mutex_init(&server->lock, NULL);
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    if ((server->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        bind(server->fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(server->fd, 16) ||
+        getsockname(server->fd, (struct sockaddr*)&addr, &length)) {
+        return -1;
+    }
+    
+    server->port = ntohs(addr.sin_port);
+    
+    if (pthread_create(&thread, NULL, server_thread, server)) {
+        return -1;
+    }
+    
+    pthread_detach(thread);
+    
+    return 0;
+}
+
+static struct file* server_file(struct server *server, const char *path) {
+    int i;
+    
+    for (i = 0; i < SERVER_FILES; i++) {
+        if (!strcmp(server->files[i].path, path)) {
+            return &server->files[i];
+        }
+    }
+    
+    return NULL;
+}
+
+static void server_fail(struct server *server, int status, int count) {
+    pthread_mutex_lock(&server->lock);
+    server->fail_status = status;
+    server->fail_count  = count;
+    pthread_mutex_unlock(&server->lock);
+}
+
+static int open_sink(struct server *server, SegmenterSink *sink) {
+    char url[64];
+    int  ret;
+    
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/live/", server->port);
+    
+    if ((ret = sg_http_sink_init(sink, url, 2))) {
+        printf("  FAIL: can't create sink for %s, %s\n", url, sg_strerror(SGUNERROR(ret)));
+    }
+    
+    return ret;
+}
+
+static uint8_t pattern(unsigned int index, size_t pos) {
+    return (uint8_t)(pos * 7 + index);
+}
+
+/**
+ * @brief stream segment of kSegmentChunks chunks through sink
+ */
+static int upload_segment(SegmenterSink *sink, const char *name, unsigned int index) {
+    uint8_t *buf = (uint8_t*)malloc(kChunkSize);
+    size_t  pos;
+    int     i, ret;
+    
+    if (!buf) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if ((ret = sink->open_segment(sink->opaque, name, index))) {
+        goto end;
+    }
+    
+    for (i = 0; i < kSegmentChunks; i++) {
+        for (pos = 0; pos < kChunkSize; pos++) {
+            buf[pos] = pattern(index, i * kChunkSize + pos);
+        }
+        
+        if ((ret = sink->write_segment(sink->opaque, buf, kChunkSize))) {
+            goto end;
+        }
+    }
+    
+    ret = sink->close_segment(sink->opaque, name, index, 1.0, kSegmentChunks * kChunkSize);
+
+end:
+    free(buf);
+    
+    return ret;
+}
+
+/**
+ * @brief check that server holds complete segment
+ * @return number of failed checks
+ */
+static int check_segment(struct server *server, const char *path, unsigned int index) {
+    struct file *file;
+    size_t      pos;
+    int         failed = 0;
+    
+    pthread_mutex_lock(&server->lock);
+    
+    if (!(file = server_file(server, path)) || file->size != kSegmentChunks * kChunkSize) {
+        printf("  FAIL: %s has %zu bytes, expected %zu\n", path, file ? file->size : 0, kSegmentChunks * kChunkSize);
+        failed++;
+    } else {
+        for (pos = 0; pos < file->size && file->data[pos] == pattern(index, pos); pos++);
+        
+        if (pos < file->size) {
+            printf("  FAIL: %s differs at byte %zu\n", path, pos);
+            failed++;
+        }
+    }
+    
+    pthread_mutex_unlock(&server->lock);
+    
+    return failed;
+}
+
+static int check_requests(struct server *server, int first, int count) {
+    
+    if (server->nb_requests - first != count) {
+        printf("  FAIL: server got %d requests, expected %d\n", server->nb_requests - first, count);
+        return 1;
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief segment is streamed with chunked transfer encoding as it is written
+ */
+static int test_chunked_put(struct server *server, SegmenterSink *sink) {
+    int first = server->nb_requests, failed = 0, ret;
+    
+    if ((ret = upload_segment(sink, "fileSequence0.ts", 0))) {
+        printf("  FAIL: upload, %s\n", sg_strerror(SGUNERROR(ret)));
+        return 1;
+    }
+    
+    failed += check_requests(server, first, 1);
+    failed += check_segment(server, "/live/fileSequence0.ts", 0);
+    
+    if (!failed && (!server->requests[first].chunked || strcmp(server->requests[first].method, "PUT"))) {
+        printf("  FAIL: segment was sent by %s%s\n", server->requests[first].method, server->requests[first].chunked ? "" : " without chunked encoding");
+        failed++;
+    }
+    
+    return failed;
+}
+
+/**
+ * @brief segments and playlists share persistent connection
+ */
+static int test_keep_alive(struct server *server, SegmenterSink *sink) {
+    int         first = server->nb_requests, connections = server->connections, failed = 0, i, ret;
+    const char  *playlist = "#EXTM3U\n";
+    char        name[32];
+    
+    for (i = 1; i <= 3; i++) {
+        snprintf(name, sizeof(name), "fileSequence%d.ts", i);
+        
+        if ((ret = upload_segment(sink, name, i)) ||
+            (ret = sink->write_playlist(sink->opaque, "prog_index.m3u8", (const uint8_t*)playlist, strlen(playlist)))) {
+            printf("  FAIL: upload, %s\n", sg_strerror(SGUNERROR(ret)));
+            return 1;
+        }
+    }
+    
+    failed += check_requests(server, first, 6);
+    
+    if (server->connections != connections) {
+        printf("  FAIL: %d new connections opened\n", server->connections - connections);
+        failed++;
+    }
+    
+    for (i = first + 1; i < server->nb_requests; i++) {
+        if (server->requests[i].connection != server->requests[first].connection) {
+            printf("  FAIL: %s %s sent over connection %d, previous one over %d\n", server->requests[i].method,
+                   server->requests[i].path, server->requests[i].connection, server->requests[first].connection);
+            failed++;
+        }
+    }
+    
+    return failed;
+}
+
+/**
+ * @brief 5xx is retried, streamed segment is sent again from kept copy, 4xx is not retried
+ */
+static int test_retry(struct server *server, SegmenterSink *sink) {
+    const char *playlist = "#EXTM3U\n";
+    int        first = server->nb_requests, failed = 0, ret;
+    
+    server_fail(server, 503, 1);
+    
+    if ((ret = sink->write_playlist(sink->opaque, "prog_index.m3u8", (const uint8_t*)playlist, strlen(playlist)))) {
+        printf("  FAIL: playlist after 503, %s\n", sg_strerror(SGUNERROR(ret)));
+        failed++;
+    }
+    
+    failed += check_requests(server, first, 2);
+    
+    first = server->nb_requests;
+    server_fail(server, 503, 1);
+    
+    if ((ret = upload_segment(sink, "fileSequence4.ts", 4))) {
+        printf("  FAIL: segment after 503, %s\n", sg_strerror(SGUNERROR(ret)));
+        failed++;
+    }
+    
+    if (!check_requests(server, first, 2) && server->requests[first + 1].chunked) {
+        printf("  FAIL: segment was sent again with chunked encoding\n");
+        failed++;
+    }
+    
+    failed += check_segment(server, "/live/fileSequence4.ts", 4);
+    
+    first = server->nb_requests;
+    server_fail(server, 503, kHttpAttempts);
+    
+    if (!sink->write_playlist(sink->opaque, "prog_index.m3u8", (const uint8_t*)playlist, strlen(playlist))) {
+        printf("  FAIL: playlist succeeded while server keeps failing\n");
+        failed++;
+    }
+    
+    failed += check_requests(server, first, kHttpAttempts);
+    
+    first = server->nb_requests;
+    server_fail(server, 403, 1);
+    
+    if (!sink->write_playlist(sink->opaque, "prog_index.m3u8", (const uint8_t*)playlist, strlen(playlist))) {
+        printf("  FAIL: playlist succeeded after 403\n");
+        failed++;
+    }
+    
+    failed += check_requests(server, first, 1);
+    server_fail(server, 0, 0);
+    
+    return failed;
+}
+
+/**
+ * @brief removed segment is deleted, removing missing one is not an error
+ */
+static int test_delete(struct server *server, SegmenterSink *sink) {
+    int first = server->nb_requests, failed = 0, ret, i;
+    
+    if ((ret = upload_segment(sink, "fileSequence5.ts", 5))) {
+        printf("  FAIL: upload, %s\n", sg_strerror(SGUNERROR(ret)));
+        return 1;
+    }
+    
+    for (i = 0; i < 2; i++) {
+        if ((ret = sink->remove_segment(sink->opaque, "fileSequence5.ts", 5))) {
+            printf("  FAIL: delete %d, %s\n", i + 1, sg_strerror(SGUNERROR(ret)));
+            failed++;
+        }
+    }
+    
+    if (check_requests(server, first, 3)) {
+        return failed + 1;
+    }
+    
+    if (server->requests[first + 1].status != 204 || server->requests[first + 2].status != 404) {
+        printf("  FAIL: delete answered %d and %d, expected 204 and 404\n", server->requests[first + 1].status, server->requests[first + 2].status);
+        failed++;
+    }
+    
+    if (server_file(server, "/live/fileSequence5.ts")) {
+        printf("  FAIL: segment was not deleted\n");
+        failed++;
+    }
+    
+    return failed;
+}
+
+/**
+ * @brief sink refuses single connection, segment stream would block index upload
+ */
+static int test_connections(struct server *server, SegmenterSink *sink) {
+    SegmenterSink other;
+    char          url[64];
+    
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/live/", server->port);
+    
+    if (!sg_http_sink_init(&other, url, SG_HTTP_MIN_CONNECTIONS - 1)) {
+        printf("  FAIL: sink accepted %d connection\n", SG_HTTP_MIN_CONNECTIONS - 1);
+        other.free(other.opaque);
+        return 1;
+    }
+    
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    
+    struct {
+        const char *name;
+        int        (*run)(struct server*, SegmenterSink*);
+    } tests[] = {
+        {"chunked put", test_chunked_put},
+        {"keep-alive",  test_keep_alive},
+        {"retry",       test_retry},
+        {"delete",      test_delete},
+        {"connections", test_connections},
+    };
+    
+    struct server server;
+    SegmenterSink sink;
+    int           failed = 0, ret, i;
+    
+    // failed requests are expected, only checks report
+    sg_log_set_level(SG_LOG_FATAL);
+    
+    if (server_start(&server)) {
+        fprintf(stderr, "%s: can't start server\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    if (open_sink(&server, &sink)) {
+        return EXIT_FAILURE;
+    }
+    
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        printf("%s:\n", tests[i].name);
+        
+        if ((ret = tests[i].run(&server, &sink))) {
+            failed += ret;
+        } else {
+            printf("  PASS\n");
+        }
+    }
+    
+    sink.free(sink.opaque);
+    
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
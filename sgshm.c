@@ -0,0 +1,197 @@
+// sgshm.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include "shm.h"
+#include "util.h"
+
+static const int kReopenAttempts = 50;
+
+struct config {
+    char   *store;
+    char   *name;
+    double repeat;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_usage(char *name) {
+    printf("Usage:%s [options] shm:<store> [<name>]\n"
+           "Lists segments and files of shared memory store, or writes one of them to stdout.\n"
+           "\t" "-r <sec>  | --repeat=<sec>         : read <name> repeatedly for <sec> seconds and report read rate\n"
+           , name);
+}
+
+/**
+ * @brief map store, waiting while writer replaces it
+ */
+static ShmReader* open_store(const char *store) {
+    ShmReader *reader = NULL;
+    int       i, ret = 0;
+    
+    for (i = 0; i < kReopenAttempts; i++) {
+        if (!(ret = sg_shm_reader_open(&reader, store))) {
+            return reader;
+        }
+        
+        usleep(100000);
+    }
+    
+    fprintf(stderr, "can't open store '%s', %s\n", store, sg_strerror(SGUNERROR(ret)));
+    
+    return NULL;
+}
+
+static void list_store(ShmReader *reader) {
+    ShmHeader    *header = reader->header;
+    unsigned int i;
+    
+    printf("slots %u, slot size %llu, store size %llu%s\n", header->slots, (unsigned long long)header->slot_size,
+           (unsigned long long)header->size, header->closed ? ", closed" : "");
+    
+    for (i = 0; i < SG_SHM_FILES + header->slots; i++) {
+        ShmEntry entry;
+        uint32_t generation = __atomic_load_n(&header->entries[i].generation, __ATOMIC_ACQUIRE);
+        
+        memcpy(&entry, &header->entries[i], sizeof(ShmEntry));
+        entry.name[SG_SHM_NAME_SIZE - 1] = '\0';
+        
+        if (!entry.name[0] || !sg_shm_valid(&header->entries[i], generation)) {
+            if (i >= SG_SHM_FILES && (generation & 1)) {
+                printf("slot %u writing\n", i - SG_SHM_FILES);
+            }
+            
+            continue;
+        }
+        
+        if (i < SG_SHM_FILES) {
+            printf("file %-24s %8llu bytes, generation %u\n", entry.name, (unsigned long long)entry.size, generation);
+        } else {
+            printf("slot %u %-24s %8llu bytes, %.3f s, index %u, generation %u\n", i - SG_SHM_FILES, entry.name,
+                   (unsigned long long)entry.size, entry.duration, entry.index, generation);
+        }
+    }
+}
+
+/**
+ * @brief read entry for given time, reopening store when writer replaces it
+ */
+static int repeat_read(ShmReader **reader, struct config *config, uint8_t *buf, size_t size) {
+    double start = now(), elapsed;
+    long   reads = 0, misses = 0, reopens = 0;
+    
+    while ((elapsed = now() - start) < config->repeat) {
+        if (__atomic_load_n(&(*reader)->header->closed, __ATOMIC_ACQUIRE)) {
+            sg_shm_reader_close(*reader);
+            
+            if (!(*reader = open_store(config->store))) {
+                return 1;
+            }
+            
+            reopens++;
+        }
+        
+        if (sg_shm_read(*reader, config->name, buf, size) < 0) {
+            misses++;
+        }
+        
+        reads++;
+    }
+    
+    printf("{\"reads\": %ld, \"misses\": %ld, \"reopens\": %ld, \"reads_per_second\": %.0f}\n", reads, misses, reopens, reads / elapsed);
+    
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    
+    struct option options_long[] = {
+        {"help",                       no_argument,       NULL, 'h'},
+        {"repeat",                     required_argument, NULL, 'r'},
+        {0, 0, 0, 0}
+    };
+    
+    char* options_short = "hr:";
+    
+    struct config config;
+    
+    config.store  = NULL;
+    config.name   = NULL;
+    config.repeat = 0;
+    
+    int c;
+    while ((c = getopt_long(argc, argv, options_short, options_long, NULL)) != -1) {
+        switch (c) {
+            case 'h': print_usage(argv[0]); exit(EXIT_SUCCESS); break;
+            case 'r': config.repeat = atof(optarg);             break;
+                
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (optind >= argc || (config.repeat > 0 && optind + 1 >= argc)) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    config.store = argv[optind];
+    config.name  = optind + 1 < argc ? argv[optind + 1] : NULL;
+    
+    ShmReader *reader = open_store(config.store);
+    int       ret     = 0;
+    
+    if (!reader) {
+        exit(EXIT_FAILURE);
+    }
+    
+    if (!config.name) {
+        list_store(reader);
+    } else {
+        size_t  size = reader->header->slot_size > SG_SHM_FILE_SIZE ? reader->header->slot_size : SG_SHM_FILE_SIZE;
+        uint8_t *buf = (uint8_t*)malloc(size);
+        int     length;
+        
+        if (!buf) {
+            ret = 1;
+        } else if (config.repeat > 0) {
+            ret = repeat_read(&reader, &config, buf, size);
+        } else if ((length = sg_shm_read(reader, config.name, buf, size)) < 0) {
+            fprintf(stderr, "'%s' isn't in store\n", config.name);
+            ret = 1;
+        } else {
+            ret = fwrite(buf, 1, length, stdout) != length;
+        }
+        
+        free(buf);
+    }
+    
+    sg_shm_reader_close(reader);
+    
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,538 @@
+// sgsoak.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "segmenter.h"
+#include "input.h"
+#include "synth.h"
+#include "alloc.h"
+#include "util.h"
+
+#define DEFAULT_OUTPUT_DIR    "/tmp"
+#define DEFAULT_LIVE_HOURS    72
+#define DEFAULT_EVENT_HOURS   12
+#define DEFAULT_DURATION      4
+#define DEFAULT_VIDEO_BITRATE 100000
+
+#define SOAK_SAMPLES          20
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+
+static const double kSourceDuration  = 600;
+static const int    kAudioBitrate    = 32000;
+static const int    kWindowEntries   = 5;
+static const int    kKeyRotation     = 10;
+static const int    kBaselineSample  = 4;
+static const long   kRssSlack        = 4 * 1024 * 1024;
+static const long   kEventEntryBytes = 256;
+static const int    kReportSites     = 15;
+
+struct config {
+    char        *output_dir;
+    SynthFormat format;
+    
+    double      live_hours;
+    double      event_hours;
+    double      duration;
+    int         video_bitrate;
+    
+    int         checksum;
+    int         encrypt;
+};
+
+/**
+ * @brief process resources and output directory contents at one checkpoint
+ */
+struct sample {
+    double       hours;
+    unsigned int segments;
+    
+    long         rss;
+    int          fds;
+    
+    int          segment_files;
+    int          key_files;
+    int          index_files;
+    int          other_files;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_usage(char *name) {
+    printf("Usage:%s [options] [live] [event]\n"
+           "\t" "-f <path> | --file-base=<path>     : directory for soak output files (default /tmp)\n"
+           "\t" "-l <hrs>  | --live-hours=<hrs>     : media hours replayed through live window (default 72)\n"
+           "\t" "-e <hrs>  | --event-hours=<hrs>    : media hours replayed through event index (default 12)\n"
+           "\t" "-t <dur>  | --target-duration=<dur>: target segment duration (default 4)\n"
+           "\t" "-b <bps>  | --bitrate=<bps>        : synthetic video bitrate (default 100000)\n"
+           "\t" "-s <fmt>  | --source=<fmt>         : synthetic source container, mp4 or ts (default mp4)\n"
+           "\t" "-c        | --checksum             : write segment manifest with checksums\n"
+           "\t" "-E        | --encrypt              : encrypt segments, rotating keys every 10 segments\n"
+           , name);
+}
+
+static long sample_rss() {
+    FILE *file;
+    long pages = 0;
+    
+    if ((file = fopen("/proc/self/statm", "r"))) {
+        if (fscanf(file, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        
+        fclose(file);
+    }
+    
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief count entries of directory, directory stream itself is not counted
+ */
+static int sample_files(const char *path, struct sample *sample, const char *extension) {
+    struct dirent *entry;
+    DIR           *dir;
+    int           count = 0;
+    
+    if (!(dir = opendir(path))) {
+        return -1;
+    }
+    
+    while ((entry = readdir(dir))) {
+        const char *ext = strrchr(entry->d_name, '.');
+        
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        
+        count++;
+        
+        if (!sample) {
+            continue;
+        }
+        
+        ext = ext ? ext + 1 : "";
+        
+        if (!strcmp(ext, extension)) {
+            sample->segment_files++;
+        } else if (!strcmp(ext, "key")) {
+            sample->key_files++;
+        } else if (!strcmp(ext, "m3u8") || !strcmp(ext, "json")) {
+            sample->index_files++;
+        } else {
+            sample->other_files++;
+        }
+    }
+    
+    closedir(dir);
+    
+    return count - (sample ? 0 : 1);
+}
+
+static void take_sample(SegmenterContext *output, const char *dir, struct sample *sample) {
+    memset(sample, 0, sizeof(struct sample));
+    
+    sample->hours    = output->duration / 3600;
+    sample->segments = output->segment_index;
+    sample->rss      = sample_rss();
+    sample->fds      = sample_files("/proc/self/fd", NULL, NULL);
+    
+    sample_files(dir, sample, output->extension);
+}
+
+static void print_sample(struct sample *sample) {
+    printf("  %8.1f %9u %8.1f %5d %7d %5d %6d %6d\n", sample->hours, sample->segments, sample->rss / 1048576.0, sample->fds,
+           sample->segment_files, sample->key_files, sample->index_files, sample->other_files);
+}
+
+static void remove_dir(const char *path) {
+    char          name[PATH_MAX];
+    struct dirent *entry;
+    DIR           *dir = opendir(path);
+    
+    while (dir && (entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+            snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+            unlink(name);
+        }
+    }
+    
+    if (dir) {
+        closedir(dir);
+    }
+    
+    rmdir(path);
+}
+
+static int compare_sites(const void *a, const void *b) {
+    const AllocSite *_a = (const AllocSite*)a, *_b = (const AllocSite*)b;
+    
+    return _a->bytes < _b->bytes ? 1 : _a->bytes > _b->bytes ? -1 : 0;
+}
+
+/**
+ * @brief print library allocation sites which hold more memory than at baseline
+ */
+static void print_sites(AllocSite *baseline, int baseline_count, AllocSite *sites, int count, long rss_growth) {
+    long tracked = 0;
+    int  i, j, printed = 0;
+    
+    if (count <= 0) {
+        printf("  allocation sites are not tracked, configure with --enable-alloc-tracking for per-site report\n");
+        return;
+    }
+    
+    // keep only growth since baseline
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < baseline_count; j++) {
+            if (baseline[j].file == sites[i].file && baseline[j].line == sites[i].line) {
+                sites[i].bytes -= min(baseline[j].bytes, sites[i].bytes);
+                sites[i].count  = sites[i].count > baseline[j].count ? sites[i].count - baseline[j].count : 0;
+                sites[i].total -= baseline[j].total;
+                break;
+            }
+        }
+    }
+    
+    qsort(sites, count, sizeof(AllocSite), compare_sites);
+    
+    printf("  allocation growth by site since baseline:\n");
+    
+    for (i = 0; i < count; i++) {
+        tracked += sites[i].bytes;
+        
+        if (sites[i].bytes && printed++ < kReportSites) {
+            printf("    %s:%d  +%zu bytes in +%zu blocks (%zu allocations)\n", sites[i].file, sites[i].line, sites[i].bytes, sites[i].count, sites[i].total);
+        }
+    }
+    
+    printf("  library allocations grew by %ld bytes, rest of %ld bytes RSS growth is outside of library (libav*, libc)\n",
+           tracked, rss_growth);
+}
+
+/**
+ * @brief check checkpoints after baseline against growth budget
+ * @return number of failed checks
+ */
+static int check_samples(IndexType type, struct sample *samples, int count, int baseline, long *rss_growth) {
+    struct sample *base = &samples[baseline], *last = &samples[count - 1];
+    long          budget = kRssSlack;
+    int           failed = 0, i;
+    
+    if (type == IndexTypeEvent) {
+        // event index keeps every segment, its entries are expected to grow
+        budget += (long)(last->segments - base->segments) * kEventEntryBytes;
+    }
+    
+    *rss_growth = last->rss - base->rss;
+    
+    if (*rss_growth > budget) {
+        printf("  FAIL: rss grew by %.1f MB after baseline, budget %.1f MB\n", *rss_growth / 1048576.0, budget / 1048576.0);
+        failed++;
+    }
+    
+    if (last->fds > base->fds) {
+        printf("  FAIL: open descriptors grew from %d to %d\n", base->fds, last->fds);
+        failed++;
+    }
+    
+    for (i = 0; i < count; i++) {
+        struct sample *sample = &samples[i];
+        
+        // live window holds finished entries plus segment being written, event keeps all of them
+        if (type == IndexTypeLive && sample->segment_files > kWindowEntries + 1) {
+            printf("  FAIL: %d segment files at %.1f h, window is %d\n", sample->segment_files, sample->hours, kWindowEntries);
+            failed++;
+        } else if (type == IndexTypeEvent && abs(sample->segment_files - (int)sample->segments) > 1) {
+            printf("  FAIL: %d segment files at %.1f h for %u segments\n", sample->segment_files, sample->hours, sample->segments);
+            failed++;
+        }
+        
+        if (type == IndexTypeLive && sample->key_files > kWindowEntries / kKeyRotation + 2) {
+            printf("  FAIL: %d key files at %.1f h\n", sample->key_files, sample->hours);
+            failed++;
+        }
+        
+        if (sample->index_files > 2 || sample->other_files) {
+            printf("  FAIL: %d index and %d unexpected files at %.1f h\n", sample->index_files, sample->other_files, sample->hours);
+            failed++;
+        }
+    }
+    
+    return failed;
+}
+
+/**
+ * @brief replay synthetic source back to back without pacing for given media hours
+ * @return 0 when resources stay bounded, 1 when growth is detected, negative error code on failure
+ */
+static int run_soak(struct config *config, IndexType type, double hours) {
+    const char       *name    = type == IndexTypeLive ? "live" : "event";
+    SynthParams      params   = { config->format, kSourceDuration, 2, 25, config->video_bitrate, kAudioBitrate };
+    SegmenterContext *output  = NULL;
+    AVFormatContext  *source  = NULL;
+    AllocSite        *baseline_sites = NULL, *sites = NULL;
+    int              baseline_count  = 0, count = 0;
+    struct sample    samples[SOAK_SAMPLES + 2];
+    int              samples_count = 0;
+    char             dir[PATH_MAX], out[PATH_MAX], filename[PATH_MAX];
+    unsigned int     prev_index = 0;
+    double           next_sample = hours / SOAK_SAMPLES, wall = now();
+    long             rss_growth;
+    int              pass, ret;
+    
+    snprintf(dir, sizeof(dir), "%s/sgsoak.XXXXXX", config->output_dir);
+    
+    if (!mkdtemp(dir)) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    // segments go into their own directory so that source file is not counted
+    snprintf(out, sizeof(out), "%s/out", dir);
+    snprintf(filename, sizeof(filename), "%s/source.%s", dir, config->format == SynthFormatMP4 ? "mp4" : "ts");
+    
+    if (mkdir(out, 0755)) {
+        remove_dir(dir);
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if ((ret = sg_synth_write_file(&params, filename))) {
+        goto end;
+    }
+    
+    printf("%s: %.1f media hours, %.0f s segments, source %s\n", name, hours, config->duration, filename);
+    printf("  %8s %9s %8s %5s %7s %5s %6s %6s\n", "hours", "segments", "rss_mb", "fds", "segs", "keys", "index", "other");
+    
+    for (pass = 0; !ret && (!output || output->duration < hours * 3600); pass++) {
+        int64_t  offset = llrint(pass * kSourceDuration * AV_TIME_BASE);
+        AVPacket pkt;
+        
+        if (sg_input_open(&source, filename, 0) || avformat_find_stream_info(source, NULL) < 0) {
+            ret = SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+            break;
+        }
+        
+        if (!output) {
+            if ((ret = segmenter_alloc_context(&output)) ||
+                (ret = segmenter_init(output, source, out, "fileSequence", config->duration, MediaTypeAudio | MediaTypeVideo)) ||
+                (config->encrypt && (ret = segmenter_set_encryption(output, NULL, kKeyRotation, NULL))) ||
+                (config->checksum && (ret = segmenter_set_checksums(output, ChecksumTypeCRC32C))) ||
+                (ret = segmenter_open(output))) {
+                break;
+            }
+        }
+        
+        while (!ret && av_read_frame(source, &pkt) >= 0) {
+            AVRational time_base = source->streams[pkt.stream_index]->time_base;
+            
+            // every pass continues timeline of previous one
+            if (pkt.pts != AV_NOPTS_VALUE) {
+                pkt.pts += av_rescale_q(offset, AV_TIME_BASE_Q, time_base);
+            }
+            
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                pkt.dts += av_rescale_q(offset, AV_TIME_BASE_Q, time_base);
+            }
+            
+            ret = segmenter_write_pkt(output, source, &pkt);
+            
+            av_packet_unref(&pkt);
+            
+            if (ret || prev_index == output->segment_index) {
+                continue;
+            }
+            
+            prev_index = output->segment_index;
+            
+            if (type == IndexTypeLive && output->segment_index > kWindowEntries) {
+                segmenter_set_sequence(output, output->segment_index - kWindowEntries, 1);
+            }
+            
+            if ((ret = segmenter_write_playlist(output, type, "", "prog_index.m3u8"))) {
+                break;
+            }
+            
+            if (output->duration / 3600 >= next_sample && samples_count < SOAK_SAMPLES) {
+                take_sample(output, out, &samples[samples_count]);
+                print_sample(&samples[samples_count]);
+                
+                if (samples_count++ == kBaselineSample) {
+                    baseline_count = sg_alloc_snapshot(&baseline_sites);
+                }
+                
+                next_sample += hours / SOAK_SAMPLES;
+            }
+            
+            if (output->duration >= hours * 3600) {
+                break;
+            }
+        }
+        
+        sg_input_close(&source);
+    }
+    
+    if (ret) {
+        goto end;
+    }
+    
+    if (samples_count <= kBaselineSample) {
+        fprintf(stderr, "%s: run is too short for baseline, increase hours\n", name);
+        ret = SGERROR(SGERROR_NO_STREAM);
+        goto end;
+    }
+    
+    take_sample(output, out, &samples[samples_count]);
+    print_sample(&samples[samples_count++]);
+    
+    count = sg_alloc_snapshot(&sites);
+    wall  = now() - wall;
+    
+    printf("  %.1f media hours in %.1f s (%.0fx), %u segments\n", hours, wall, hours * 3600 / wall, output->segment_index);
+    
+    if (check_samples(type, samples, samples_count, kBaselineSample, &rss_growth)) {
+        print_sites(baseline_sites, baseline_count, sites, count, rss_growth);
+        ret = 1;
+    } else {
+        printf("  PASS\n");
+    }
+
+end:
+    if (ret < 0) {
+        fprintf(stderr, "%s: %s\n", name, sg_strerror(SGUNERROR(ret)));
+    }
+    
+    if (output) {
+        segmenter_close(output);
+        segmenter_free_context(output);
+    }
+    
+    sg_input_close(&source);
+    
+    free(baseline_sites);
+    free(sites);
+    
+    remove_dir(out);
+    remove_dir(dir);
+    
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    
+    struct option options_long[] = {
+        {"help",                       no_argument,       NULL, 'h'},
+        {"file-base",                  required_argument, NULL, 'f'},
+        {"live-hours",                 required_argument, NULL, 'l'},
+        {"event-hours",                required_argument, NULL, 'e'},
+        {"target-duration",            required_argument, NULL, 't'},
+        {"bitrate",                    required_argument, NULL, 'b'},
+        {"source",                     required_argument, NULL, 's'},
+        {"checksum",                   no_argument,       NULL, 'c'},
+        {"encrypt",                    no_argument,       NULL, 'E'},
+        {0, 0, 0, 0}
+    };
+    
+    char* options_short = "hf:l:e:t:b:s:cE";
+    
+    struct config config;
+    
+    config.output_dir    = DEFAULT_OUTPUT_DIR;
+    config.format        = SynthFormatMP4;
+    config.live_hours    = DEFAULT_LIVE_HOURS;
+    config.event_hours   = DEFAULT_EVENT_HOURS;
+    config.duration      = DEFAULT_DURATION;
+    config.video_bitrate = DEFAULT_VIDEO_BITRATE;
+    config.checksum      = 0;
+    config.encrypt       = 0;
+    
+    int c;
+    while ((c = getopt_long(argc, argv, options_short, options_long, NULL)) != -1) {
+        switch (c) {
+            case 'h': print_usage(argv[0]); exit(EXIT_SUCCESS); break;
+            
+            case 'f': config.output_dir    = optarg;       break;
+            case 'l': config.live_hours    = atof(optarg); break;
+            case 'e': config.event_hours   = atof(optarg); break;
+            case 't': config.duration      = atof(optarg); break;
+            case 'b': config.video_bitrate = atoi(optarg); break;
+            case 'c': config.checksum      = 1;            break;
+            case 'E': config.encrypt       = 1;            break;
+            
+            case 's':
+                if (!strcmp(optarg, "mp4")) {
+                    config.format = SynthFormatMP4;
+                } else if (!strcmp(optarg, "ts")) {
+                    config.format = SynthFormatTS;
+                } else {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (config.duration <= 0 || config.video_bitrate <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    int live  = optind == argc;
+    int event = optind == argc;
+    int ret   = 0;
+    int i;
+    
+    for (i = optind; i < argc; i++) {
+        if (!strcmp(argv[i], "live")) {
+            live = 1;
+        } else if (!strcmp(argv[i], "event")) {
+            event = 1;
+        } else {
+            fprintf(stderr, "%s: unknown soak '%s'\n", argv[0], argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    av_register_all();
+    
+    if (live && config.live_hours > 0) {
+        ret |= run_soak(&config, IndexTypeLive, config.live_hours) != 0;
+    }
+    
+    if (event && config.event_hours > 0) {
+        ret |= run_soak(&config, IndexTypeEvent, config.event_hours) != 0;
+    }
+    
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
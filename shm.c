@@ -0,0 +1,506 @@
+// shm.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "shm.h"
+#include "alloc.h"
+#include "log.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *kShmScheme = "shm:";
+static const int  kShmSpins   = 1000;
+
+typedef struct {
+    ShmHeader *header;
+    size_t    size;
+    uint32_t  writes;
+    
+    ShmEntry  *segment;
+    int       overflow;
+} ShmSink;
+
+/**
+ * @brief check whether output location is shared memory store
+ */
+int sg_is_shm_url(const char *url) {
+    return !strncmp(url, kShmScheme, strlen(kShmScheme));
+}
+
+/**
+ * @brief POSIX shared memory object name of store, shm:live/0 is mapped to /live.0
+ * @return 0 on success, negative error code on failure
+ */
+static int shm_object_name(const char *url, char *buf, size_t size) {
+    size_t i, length;
+    
+    if (sg_is_shm_url(url)) {
+        url += strlen(kShmScheme);
+    }
+    
+    while (*url == '/') {
+        url++;
+    }
+    
+    if (!(length = strlen(url)) || length + 2 > size || length + 1 > NAME_MAX) {
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    buf[0] = '/';
+    
+    for (i = 0; i <= length; i++) {
+        buf[i + 1] = url[i] == '/' ? '.' : url[i];
+    }
+    
+    return 0;
+}
+
+static size_t shm_page_align(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    
+    return (size + page - 1) / page * page;
+}
+
+static void shm_entry_begin(ShmEntry *entry) {
+    __atomic_store_n(&entry->generation, entry->generation + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_entry_end(ShmEntry *entry) {
+    __atomic_store_n(&entry->generation, entry->generation + 1, __ATOMIC_RELEASE);
+}
+
+static void shm_entry_clear(ShmEntry *entry) {
+    shm_entry_begin(entry);
+    
+    entry->name[0]  = '\0';
+    entry->size     = 0;
+    entry->duration = 0;
+    
+    shm_entry_end(entry);
+}
+
+/**
+ * @brief file entry with given name, or when create is set first free one, or the
+ *        least recently written one when table is full. Index and manifest are rewritten
+ *        with every segment, so the entry recycled is the oldest key which already left
+ *        the window when -D doesn't expire keys
+ */
+static ShmEntry* shm_file(ShmHeader *header, const char *name, int create) {
+    ShmEntry *free = NULL, *oldest = NULL;
+    int      i;
+    
+    for (i = 0; i < SG_SHM_FILES; i++) {
+        ShmEntry *entry = &header->entries[i];
+        
+        if (!strncmp(entry->name, name, SG_SHM_NAME_SIZE)) {
+            return entry;
+        }
+        
+        if (!free && !entry->name[0]) {
+            free = entry;
+        }
+        
+        if (entry->name[0] && (!oldest || (int32_t)(entry->index - oldest->index) < 0)) {
+            oldest = entry;
+        }
+    }
+    
+    return create ? (free ? free : oldest) : NULL;
+}
+
+static int shm_sink_open_segment(void *opaque, const char *name, unsigned int index) {
+    ShmSink  *sink = (ShmSink*)opaque;
+    ShmEntry *entry;
+    
+    if (!sink->header->slots || strlen(name) >= SG_SHM_NAME_SIZE) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    entry = &sink->header->entries[SG_SHM_FILES + index % sink->header->slots];
+    
+    shm_entry_begin(entry);
+    
+    strcpy(entry->name, name);
+    entry->index    = index;
+    entry->size     = 0;
+    entry->duration = 0;
+    
+    sink->segment  = entry;
+    sink->overflow = 0;
+    
+    return 0;
+}
+
+/**
+ * @brief copy segment data to its slot, segment which outgrows the slot is dropped from
+ *        the store and readers don't find it, the channel keeps running
+ */
+static int shm_sink_write_segment(void *opaque, const uint8_t *buf, size_t size) {
+    ShmSink  *sink  = (ShmSink*)opaque;
+    ShmEntry *entry = sink->segment;
+    
+    if (!entry) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (sink->overflow) {
+        return 0;
+    }
+    
+    if (entry->size + size > sink->header->slot_size) {
+        sg_log(SG_LOG_ERROR, "segment %s is larger than shm slot of %llu bytes, skipped", entry->name, (unsigned long long)sink->header->slot_size);
+        
+        entry->name[0] = '\0';
+        entry->size    = 0;
+        
+        sink->overflow = 1;
+        return 0;
+    }
+    
+    memcpy((uint8_t*)sink->header + entry->offset + entry->size, buf, size);
+    entry->size += size;
+    
+    return 0;
+}
+
+static int shm_sink_close_segment(void *opaque, const char *name, unsigned int index, double duration, size_t size) {
+    ShmSink  *sink  = (ShmSink*)opaque;
+    ShmEntry *entry = sink->segment;
+    
+    if (!entry) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    entry->duration = duration;
+    shm_entry_end(entry);
+    
+    sink->segment = NULL;
+    
+    return 0;
+}
+
+/**
+ * @brief expire segment slot or key file, slot already reused by newer segment is left alone
+ */
+static int shm_sink_remove_segment(void *opaque, const char *name, unsigned int index) {
+    ShmSink  *sink = (ShmSink*)opaque;
+    ShmEntry *entry;
+    
+    if ((entry = shm_file(sink->header, name, 0))) {
+        shm_entry_clear(entry);
+        return 0;
+    }
+    
+    if (sink->header->slots) {
+        entry = &sink->header->entries[SG_SHM_FILES + index % sink->header->slots];
+        
+        if (entry != sink->segment && entry->index == index && !strncmp(entry->name, name, SG_SHM_NAME_SIZE)) {
+            shm_entry_clear(entry);
+        }
+    }
+    
+    return 0;
+}
+
+static int shm_sink_write_playlist(void *opaque, const char *name, const uint8_t *buf, size_t size) {
+    ShmSink  *sink = (ShmSink*)opaque;
+    ShmEntry *entry;
+    
+    if (strlen(name) >= SG_SHM_NAME_SIZE || size > SG_SHM_FILE_SIZE || !(entry = shm_file(sink->header, name, 1))) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    shm_entry_begin(entry);
+    
+    strcpy(entry->name, name);
+    memcpy((uint8_t*)sink->header + entry->offset, buf, size);
+    entry->size  = size;
+    entry->index = ++sink->writes;
+    
+    shm_entry_end(entry);
+    
+    return 0;
+}
+
+static void shm_sink_free(void *opaque) {
+    ShmSink *sink = (ShmSink*)opaque;
+    
+    munmap(sink->header, sink->size);
+    sg_free(sink);
+}
+
+/**
+ * @brief mark store left by previous writer closed and unlink it, readers still
+ *        mapping it keep old memory until they map the new store
+ */
+static void shm_retire(const char *name) {
+    ShmHeader *header;
+    int       fd;
+    
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0) {
+        return;
+    }
+    
+    header = (ShmHeader*)mmap(NULL, sizeof(ShmHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    
+    if (header != MAP_FAILED) {
+        if (header->magic == SG_SHM_MAGIC) {
+            __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+        }
+        
+        munmap(header, sizeof(ShmHeader));
+    }
+    
+    close(fd);
+    shm_unlink(name);
+}
+
+/**
+ * @brief initialize sink keeping live sliding window in POSIX shared memory ring,
+ *        so web server on the same host serves segments and index without touching files
+ * @param sink sink to initialize
+ * @param url store name, shm:<name>
+ * @param slots number of segment slots, should exceed sliding window entries,
+ *              0 for store with files (master playlist) only
+ * @param slot_size maximum segment size
+ * @return 0 on success, negative error code on failure
+ */
+int sg_shm_sink_init(SegmenterSink *sink, const char *url, unsigned int slots, size_t slot_size) {
+    char         name[NAME_MAX + 1];
+    ShmSink      *_sink;
+    ShmHeader    *header;
+    size_t       offset, size;
+    unsigned int i;
+    int          fd, ret;
+    
+    if ((ret = shm_object_name(url, name, sizeof(name)))) {
+        return ret;
+    }
+    
+    slot_size = shm_page_align(slot_size);
+    offset    = shm_page_align(sizeof(ShmHeader) + (SG_SHM_FILES + slots) * sizeof(ShmEntry));
+    size      = offset + SG_SHM_FILES * SG_SHM_FILE_SIZE + slots * slot_size;
+    
+    shm_retire(name);
+    
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (ftruncate(fd, size)) {
+        close(fd);
+        shm_unlink(name);
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    header = (ShmHeader*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if (header == MAP_FAILED) {
+        shm_unlink(name);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (!(_sink = (ShmSink*)sg_calloc(1, sizeof(ShmSink)))) {
+        munmap(header, size);
+        shm_unlink(name);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    header->version   = SG_SHM_VERSION;
+    header->slots     = slots;
+    header->slot_size = slot_size;
+    header->size      = size;
+    
+    for (i = 0; i < SG_SHM_FILES + slots; i++) {
+        header->entries[i].offset = offset;
+        offset += i < SG_SHM_FILES ? SG_SHM_FILE_SIZE : slot_size;
+    }
+    
+    __atomic_store_n(&header->magic, SG_SHM_MAGIC, __ATOMIC_RELEASE);
+    
+    _sink->header = header;
+    _sink->size   = size;
+    
+    sink->opaque         = _sink;
+    sink->open_segment   = shm_sink_open_segment;
+    sink->write_segment  = shm_sink_write_segment;
+    sink->close_segment  = shm_sink_close_segment;
+    sink->remove_segment = shm_sink_remove_segment;
+    sink->write_playlist = shm_sink_write_playlist;
+    sink->free           = shm_sink_free;
+    sink->create_dir     = NULL;
+    sink->remove_dir     = NULL;
+    
+    return 0;
+}
+
+/**
+ * @brief map shared memory store read only
+ * @param reader output reader
+ * @param url store name, shm:<name>
+ * @return 0 on success, negative error code on failure
+ */
+int sg_shm_reader_open(ShmReader **reader, const char *url) {
+    char        name[NAME_MAX + 1];
+    ShmReader   *_reader;
+    ShmHeader   *header;
+    struct stat st;
+    int         fd, ret;
+    
+    if ((ret = shm_object_name(url, name, sizeof(name)))) {
+        return ret;
+    }
+    
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    if (fstat(fd, &st) || st.st_size < sizeof(ShmHeader)) {
+        close(fd);
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    header = (ShmHeader*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if (header == MAP_FAILED) {
+        return SGERROR(SGERROR_INPUT);
+    }
+    
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SG_SHM_MAGIC || header->version != SG_SHM_VERSION || header->size != st.st_size ||
+        sizeof(ShmHeader) + (SG_SHM_FILES + (size_t)header->slots) * sizeof(ShmEntry) > st.st_size) {
+        munmap(header, st.st_size);
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    if (!(_reader = (ShmReader*)sg_malloc(sizeof(ShmReader)))) {
+        munmap(header, st.st_size);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _reader->header = header;
+    _reader->size   = st.st_size;
+    
+    *reader = _reader;
+    
+    return 0;
+}
+
+void sg_shm_reader_close(ShmReader *reader) {
+    
+    if (reader) {
+        munmap(reader->header, reader->size);
+        sg_free(reader);
+    }
+}
+
+/**
+ * @brief find complete segment or file by name without copying it, data is at entry
+ *        offset from mapped header and stays valid while sg_shm_valid returns true
+ * @param reader shared memory reader
+ * @param name segment or file name
+ * @param generation entry generation, input for sg_shm_valid
+ * @return entry, NULL when name isn't in store or segment is still being written
+ */
+const ShmEntry* sg_shm_find(ShmReader *reader, const char *name, uint32_t *generation) {
+    ShmHeader    *header = reader->header;
+    unsigned int i;
+    uint32_t     current;
+    int          spins, match = 0;
+    
+    for (i = 0; i < SG_SHM_FILES + header->slots; i++) {
+        ShmEntry *entry = &header->entries[i];
+        
+        for (spins = 0; spins < kShmSpins; spins++) {
+            current = __atomic_load_n(&entry->generation, __ATOMIC_ACQUIRE);
+            
+            // segment slots stay odd while segment is muxed, only files are worth waiting for
+            if (current & 1) {
+                if (i >= SG_SHM_FILES) {
+                    break;
+                }
+                
+                continue;
+            }
+            
+            match = !strncmp(entry->name, name, SG_SHM_NAME_SIZE) && entry->offset + entry->size <= reader->size;
+            
+            if (sg_shm_valid(entry, current)) {
+                break;
+            }
+        }
+        
+        if (!(current & 1) && spins < kShmSpins && match) {
+            *generation = current;
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+/**
+ * @brief check that entry wasn't changed since it was found
+ */
+int sg_shm_valid(const ShmEntry *entry, uint32_t generation) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    
+    return __atomic_load_n(&entry->generation, __ATOMIC_RELAXED) == generation;
+}
+
+/**
+ * @brief copy segment or file from store
+ * @param reader shared memory reader
+ * @param name segment or file name
+ * @param buf output buffer
+ * @param size buffer size, at most size bytes are copied
+ * @return full size of segment or file like snprintf, negative error code when it isn't in store
+ */
+int sg_shm_read(ShmReader *reader, const char *name, uint8_t *buf, size_t size) {
+    const ShmEntry *entry;
+    uint32_t       generation;
+    size_t         length;
+    int            spins;
+    
+    for (spins = 0; spins < kShmSpins; spins++) {
+        if (!(entry = sg_shm_find(reader, name, &generation))) {
+            return SGERROR(SGERROR_INPUT);
+        }
+        
+        length = entry->size;
+        
+        if (entry->offset + length > reader->size) {
+            continue;
+        }
+        
+        memcpy(buf, (const uint8_t*)reader->header + entry->offset, length < size ? length : size);
+        
+        if (sg_shm_valid(entry, generation)) {
+            return length;
+        }
+    }
+    
+    return SGERROR(SGERROR_INPUT);
+}
@@ -0,0 +1,78 @@
+// shm.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "segmenter.h"
+
+#ifndef __SG_SHM__
+#define __SG_SHM__
+
+#define SG_SHM_MAGIC     0x53475348
+#define SG_SHM_VERSION   1
+#define SG_SHM_NAME_SIZE 64
+#define SG_SHM_FILES     16
+#define SG_SHM_FILE_SIZE 65536
+
+/**
+ * Entry of shared memory store, either segment slot or small file (index, key, manifest).
+ * Index is segment index of slot or write order of file. Generation is a sequence lock:
+ * odd while writer changes entry, readers copy entry and its data between two even and
+ * equal generation loads.
+ */
+typedef struct {
+    uint32_t generation;
+    uint32_t index;
+    uint64_t offset;
+    uint64_t size;
+    double   duration;
+    char     name[SG_SHM_NAME_SIZE];
+} ShmEntry;
+
+/**
+ * Shared memory store layout: header, SG_SHM_FILES file entries followed by segment
+ * slot entries, then page aligned data of files and slots at entry offsets. Segment
+ * index i lives in slot i % slots, so the store holds live sliding window. Closed is set
+ * when writer replaces the store, readers should map it again.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t closed;
+    uint64_t slot_size;
+    uint64_t size;
+    
+    ShmEntry entries[];
+} ShmHeader;
+
+typedef struct {
+    ShmHeader *header;
+    size_t    size;
+} ShmReader;
+
+int  sg_is_shm_url(const char *url);
+int  sg_shm_sink_init(SegmenterSink *sink, const char *url, unsigned int slots, size_t slot_size);
+
+int  sg_shm_reader_open(ShmReader **reader, const char *url);
+void sg_shm_reader_close(ShmReader *reader);
+
+const ShmEntry* sg_shm_find(ShmReader *reader, const char *name, uint32_t *generation);
+int  sg_shm_valid(const ShmEntry *entry, uint32_t generation);
+int  sg_shm_read(ShmReader *reader, const char *name, uint8_t *buf, size_t size);
+
+#endif
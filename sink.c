@@ -0,0 +1,368 @@
+// sink.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "sink.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FILE_SINK_DIRS      256
+#define FILE_SINK_DIR_NAME  64
+
+typedef struct {
+    char         name[FILE_SINK_DIR_NAME];
+    int          fd;
+    unsigned int used;
+} FileSinkDir;
+
+/**
+ * File sink keeps output root and recently used subdirectories open, so segment files
+ * of sharded layouts are created and removed with *at calls relative to directory fd
+ * instead of resolving full path every time.
+ */
+typedef struct {
+    char   *path;
+    int    dir;
+    FILE   *file;
+    
+    FileSinkDir  dirs[FILE_SINK_DIRS];
+    unsigned int clock;
+    
+    char   *buf;
+    size_t buf_size;
+} FileSink;
+
+/**
+ * @brief build name with suffix into sink buffer
+ * @param sink file sink
+ * @param name file name
+ * @param suffix optional suffix appended to the name
+ * @return name on success, NULL on failure
+ */
+static char* file_sink_name(FileSink *sink, const char *name, const char *suffix) {
+    size_t length = strlen(name) + strlen(suffix) + 1;
+    
+    if (length > sink->buf_size) {
+        char *buf = (char*)sg_realloc(sink->buf, length);
+        
+        if (!buf) {
+            return NULL;
+        }
+        
+        sink->buf      = buf;
+        sink->buf_size = length;
+    }
+    
+    snprintf(sink->buf, sink->buf_size, "%s%s", name, suffix);
+    
+    return sink->buf;
+}
+
+/**
+ * @brief output root directory, opened on first use
+ * @return directory fd, negative value on failure
+ */
+static int file_sink_root(FileSink *sink) {
+    
+    if (sink->dir < 0) {
+        sink->dir = open(sink->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    
+    return sink->dir;
+}
+
+/**
+ * @brief open subdirectory of output root through cache, least recently used
+ *        directory is closed when cache is full
+ * @param sink file sink
+ * @param name directory name relative to output root
+ * @param length length of directory name
+ * @param create whether to create missing directory
+ * @return directory fd, negative value on failure
+ */
+static int file_sink_open_dir(FileSink *sink, const char *name, size_t length, int create) {
+    FileSinkDir *dir = &sink->dirs[0];
+    int         root, i;
+    
+    for (i = 0; i < FILE_SINK_DIRS; i++) {
+        if (sink->dirs[i].fd >= 0 && !strncmp(sink->dirs[i].name, name, length) && !sink->dirs[i].name[length]) {
+            sink->dirs[i].used = ++sink->clock;
+            return sink->dirs[i].fd;
+        }
+        
+        if (sink->dirs[i].used < dir->used) {
+            dir = &sink->dirs[i];
+        }
+    }
+    
+    if ((root = file_sink_root(sink)) < 0) {
+        return -1;
+    }
+    
+    if (dir->fd >= 0) {
+        close(dir->fd);
+        dir->fd = -1;
+    }
+    
+    memcpy(dir->name, name, length);
+    dir->name[length] = '\0';
+    
+    if ((dir->fd = openat(root, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 && errno == ENOENT && create) {
+        if (mkdirat(root, dir->name, 0755) && errno != EEXIST) {
+            dir->used = 0;
+            return -1;
+        }
+        
+        dir->fd = openat(root, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    
+    dir->used = dir->fd >= 0 ? ++sink->clock : 0;
+    
+    return dir->fd;
+}
+
+/**
+ * @brief directory fd and base name of file, names with longer directory
+ *        part than cache holds are resolved relative to output root
+ * @param sink file sink
+ * @param name file name relative to output root
+ * @param base base name relative to returned directory
+ * @param create whether to create missing directory
+ * @return directory fd, negative value on failure
+ */
+static int file_sink_dir(FileSink *sink, const char *name, const char **base, int create) {
+    const char *slash = strrchr(name, '/');
+    
+    if (!slash || slash == name || slash - name >= FILE_SINK_DIR_NAME) {
+        *base = name;
+        return file_sink_root(sink);
+    }
+    
+    *base = slash + 1;
+    
+    return file_sink_open_dir(sink, name, slash - name, create);
+}
+
+/**
+ * @brief drop cached directory fd before directory is removed
+ */
+static void file_sink_close_dir(FileSink *sink, const char *name) {
+    int i;
+    
+    for (i = 0; i < FILE_SINK_DIRS; i++) {
+        if (sink->dirs[i].fd >= 0 && !strcmp(sink->dirs[i].name, name)) {
+            close(sink->dirs[i].fd);
+            
+            sink->dirs[i].fd   = -1;
+            sink->dirs[i].used = 0;
+        }
+    }
+}
+
+static int file_sink_open_segment(void *opaque, const char *name, unsigned int index) {
+    FileSink   *sink = (FileSink*)opaque;
+    const char *base;
+    int        dir, fd;
+    
+    if ((dir = file_sink_dir(sink, name, &base, 1)) < 0) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if ((fd = openat(dir, base, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (!(sink->file = fdopen(fd, "wb"))) {
+        close(fd);
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    return 0;
+}
+
+static int file_sink_write_segment(void *opaque, const uint8_t *buf, size_t size) {
+    FileSink *sink = (FileSink*)opaque;
+    
+    if (!sink->file || fwrite(buf, 1, size, sink->file) != size) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    return 0;
+}
+
+static int file_sink_close_segment(void *opaque, const char *name, unsigned int index, double duration, size_t size) {
+    FileSink *sink = (FileSink*)opaque;
+    int      ret   = 0;
+    
+    if (sink->file) {
+        ret = fclose(sink->file) ? SGERROR(SGERROR_FILE_WRITE) : 0;
+        sink->file = NULL;
+    }
+    
+    return ret;
+}
+
+static int file_sink_remove_segment(void *opaque, const char *name, unsigned int index) {
+    FileSink   *sink = (FileSink*)opaque;
+    const char *base;
+    int        dir;
+    
+    if ((dir = file_sink_dir(sink, name, &base, 0)) >= 0) {
+        unlinkat(dir, base, 0);
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief write playlist to temporary file and move it over the old one,
+ *        so readers never see partially written index
+ */
+static int file_sink_write_playlist(void *opaque, const char *name, const uint8_t *buf, size_t size) {
+    FileSink   *sink = (FileSink*)opaque;
+    FILE       *out;
+    const char *base;
+    char       *tmp;
+    int        dir, fd;
+    int        ret = 0;
+    
+    if ((dir = file_sink_dir(sink, name, &base, 1)) < 0) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (!(tmp = file_sink_name(sink, base, ".tmp"))) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if ((fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (!(out = fdopen(fd, "w"))) {
+        close(fd);
+        unlinkat(dir, tmp, 0);
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (fwrite(buf, 1, size, out) != size) {
+        ret = SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (fclose(out)) {
+        ret = SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (!ret && renameat(dir, tmp, dir, base)) {
+        ret = SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (ret) {
+        unlinkat(dir, tmp, 0);
+    }
+    
+    return ret;
+}
+
+static int file_sink_create_dir(void *opaque, const char *name) {
+    FileSink *sink = (FileSink*)opaque;
+    
+    if (file_sink_open_dir(sink, name, strlen(name), 1) < 0) {
+        return SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    return 0;
+}
+
+static int file_sink_remove_dir(void *opaque, const char *name) {
+    FileSink *sink = (FileSink*)opaque;
+    
+    file_sink_close_dir(sink, name);
+    
+    if (file_sink_root(sink) >= 0) {
+        unlinkat(sink->dir, name, AT_REMOVEDIR);
+    }
+    
+    return 0;
+}
+
+static void file_sink_free(void *opaque) {
+    FileSink *sink = (FileSink*)opaque;
+    int      i;
+    
+    if (sink->file) {
+        fclose(sink->file);
+    }
+    
+    for (i = 0; i < FILE_SINK_DIRS; i++) {
+        if (sink->dirs[i].fd >= 0) {
+            close(sink->dirs[i].fd);
+        }
+    }
+    
+    if (sink->dir >= 0) {
+        close(sink->dir);
+    }
+    
+    sg_free(sink->path);
+    sg_free(sink->buf);
+    sg_free(sink);
+}
+
+/**
+ * @brief initialize sink writing segments and playlists to directory
+ * @param sink sink to initialize
+ * @param path output directory
+ * @return 0 on success, negative error code on failure
+ */
+int sg_file_sink_init(SegmenterSink *sink, const char *path) {
+    FileSink *_sink = (FileSink*)sg_calloc(1, sizeof(FileSink));
+    int      i;
+    
+    if (!_sink) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    if (!(_sink->path = sg_strdup(path))) {
+        sg_free(_sink);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _sink->dir = -1;
+    
+    for (i = 0; i < FILE_SINK_DIRS; i++) {
+        _sink->dirs[i].fd = -1;
+    }
+    
+    sink->opaque         = _sink;
+    sink->open_segment   = file_sink_open_segment;
+    sink->write_segment  = file_sink_write_segment;
+    sink->close_segment  = file_sink_close_segment;
+    sink->remove_segment = file_sink_remove_segment;
+    sink->write_playlist = file_sink_write_playlist;
+    sink->free           = file_sink_free;
+    sink->create_dir     = file_sink_create_dir;
+    sink->remove_dir     = file_sink_remove_dir;
+    
+    return 0;
+}
@@ -0,0 +1,465 @@
+// synth.c
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config.h"
+#include "synth.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef AV_INPUT_BUFFER_PADDING_SIZE
+#define AV_INPUT_BUFFER_PADDING_SIZE FF_INPUT_BUFFER_PADDING_SIZE
+#endif
+
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+static const int kVideoWidth      = 1280;
+static const int kVideoHeight     = 720;
+static const int kVideoTimeBase   = 90000;
+static const int kAudioSampleRate = 48000;
+static const int kAudioFrameSize  = 1024;
+
+static const uint8_t kStartCode[]   = { 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t kAccessUnit[]  = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+static const uint8_t kAudioConfig[] = { 0x11, 0x90 };
+
+static const char *kSynthFormats[] = { "mpegts", "mp4", "adts" };
+
+typedef struct {
+    uint8_t *buf;
+    int     bit;
+} BitWriter;
+
+static void put_bits(BitWriter *writer, int count, uint32_t value) {
+    
+    while (count--) {
+        if ((value >> count) & 1) {
+            writer->buf[writer->bit >> 3] |= 0x80 >> (writer->bit & 7);
+        }
+        
+        writer->bit++;
+    }
+}
+
+static void put_ue(BitWriter *writer, uint32_t value) {
+    int length = 0;
+    
+    while ((value + 1) >> (length + 1)) {
+        length++;
+    }
+    
+    put_bits(writer, length, 0);
+    put_bits(writer, length + 1, value + 1);
+}
+
+static void put_se(BitWriter *writer, int value) {
+    put_ue(writer, value <= 0 ? -2 * value : 2 * value - 1);
+}
+
+static int put_trailing_bits(BitWriter *writer) {
+    put_bits(writer, 1, 1);
+    
+    return (writer->bit + 7) >> 3;
+}
+
+/**
+ * @brief write NAL unit with start code, inserting emulation prevention bytes
+ * @return number of bytes written
+ */
+static int write_nal(uint8_t *out, const uint8_t *rbsp, int size) {
+    int i, length = sizeof(kStartCode), zeros = 0;
+    
+    memcpy(out, kStartCode, sizeof(kStartCode));
+    
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && rbsp[i] <= 3) {
+            out[length++] = 3;
+            zeros = 0;
+        }
+        
+        out[length++] = rbsp[i];
+        zeros = rbsp[i] ? 0 : zeros + 1;
+    }
+    
+    return length;
+}
+
+/**
+ * @brief baseline profile SPS and PPS, used both as extradata and in-band before key frames
+ */
+static int write_parameter_sets(uint8_t *out) {
+    uint8_t   rbsp[64];
+    BitWriter writer = { rbsp, 0 };
+    int       length;
+    
+    memset(rbsp, 0, sizeof(rbsp));
+    
+    put_bits(&writer, 8, 0x67);
+    put_bits(&writer, 8, 66);
+    put_bits(&writer, 8, 0xc0);
+    put_bits(&writer, 8, 31);
+    put_ue(&writer, 0);
+    put_ue(&writer, 0);
+    put_ue(&writer, 2);
+    put_ue(&writer, 1);
+    put_bits(&writer, 1, 0);
+    put_ue(&writer, kVideoWidth / 16 - 1);
+    put_ue(&writer, kVideoHeight / 16 - 1);
+    put_bits(&writer, 1, 1);
+    put_bits(&writer, 1, 1);
+    put_bits(&writer, 1, 0);
+    put_bits(&writer, 1, 0);
+    
+    length = write_nal(out, rbsp, put_trailing_bits(&writer));
+    
+    memset(rbsp, 0, sizeof(rbsp));
+    writer.bit = 0;
+    
+    put_bits(&writer, 8, 0x68);
+    put_ue(&writer, 0);
+    put_ue(&writer, 0);
+    put_bits(&writer, 1, 0);
+    put_bits(&writer, 1, 0);
+    put_ue(&writer, 0);
+    put_ue(&writer, 0);
+    put_ue(&writer, 0);
+    put_bits(&writer, 1, 0);
+    put_bits(&writer, 2, 0);
+    put_se(&writer, 0);
+    put_se(&writer, 0);
+    put_se(&writer, 0);
+    put_bits(&writer, 1, 1);
+    put_bits(&writer, 1, 0);
+    put_bits(&writer, 1, 0);
+    
+    return length + write_nal(out + length, rbsp, put_trailing_bits(&writer));
+}
+
+/**
+ * @brief slice header good enough for parsers to find key frames, slice data is payload
+ */
+static int write_slice(SynthSource *source, uint8_t *out, int key, int frame_num, int size) {
+    uint8_t   rbsp[16];
+    BitWriter writer = { rbsp, 0 };
+    int       length;
+    
+    memset(rbsp, 0, sizeof(rbsp));
+    
+    put_bits(&writer, 8, key ? 0x65 : 0x41);
+    put_ue(&writer, 0);
+    put_ue(&writer, key ? 7 : 5);
+    put_ue(&writer, 0);
+    put_bits(&writer, 4, frame_num & 0x0f);
+    
+    if (key) {
+        put_ue(&writer, 0);
+        put_bits(&writer, 1, 0);
+        put_bits(&writer, 1, 0);
+    } else {
+        put_bits(&writer, 1, 0);
+        put_bits(&writer, 1, 0);
+        put_bits(&writer, 1, 0);
+    }
+    
+    put_se(&writer, 0);
+    put_ue(&writer, 1);
+    
+    length = write_nal(out, rbsp, put_trailing_bits(&writer));
+    
+    // payload has no zero bytes, so it never needs emulation prevention
+    memcpy(out + length, source->payload, size);
+    
+    return length + size;
+}
+
+static int gop_frames(SynthSource *source) {
+    return max(1, (int)lround(source->params.gop * source->params.fps));
+}
+
+static int video_frame_size(SynthSource *source, int key) {
+    int average = source->params.video_bitrate / 8 / source->params.fps;
+    int frames  = gop_frames(source);
+    
+    if (frames == 1) {
+        return average;
+    }
+    
+    return key ? 3 * average : max(16, (average * frames - 3 * average) / (frames - 1));
+}
+
+static int audio_frame_size(SynthSource *source) {
+    return max(8, (int)((int64_t)source->params.audio_bitrate * kAudioFrameSize / kAudioSampleRate / 8));
+}
+
+/**
+ * @brief describe generated stream in codec context
+ */
+static void set_stream_params(SynthSource *source, AVStream *stream, int video) {
+    AVCodecContext *codec = stream->codec;
+    
+    if (video) {
+        codec->codec_type     = AVMEDIA_TYPE_VIDEO;
+        codec->codec_id       = AV_CODEC_ID_H264;
+        codec->width          = kVideoWidth;
+        codec->height         = kVideoHeight;
+        codec->pix_fmt        = AV_PIX_FMT_YUV420P;
+        codec->time_base      = (AVRational){ 1, source->params.fps };
+        codec->bit_rate       = source->params.video_bitrate;
+        stream->time_base     = (AVRational){ 1, kVideoTimeBase };
+        stream->avg_frame_rate = (AVRational){ source->params.fps, 1 };
+        
+        if ((codec->extradata = av_mallocz(source->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE))) {
+            memcpy(codec->extradata, source->extradata, source->extradata_size);
+            codec->extradata_size = source->extradata_size;
+        }
+    } else {
+        codec->codec_type     = AVMEDIA_TYPE_AUDIO;
+        codec->codec_id       = AV_CODEC_ID_AAC;
+        codec->sample_rate    = kAudioSampleRate;
+        codec->channels       = 2;
+        codec->channel_layout = AV_CH_LAYOUT_STEREO;
+        codec->sample_fmt     = AV_SAMPLE_FMT_FLTP;
+        codec->frame_size     = kAudioFrameSize;
+        codec->time_base      = (AVRational){ 1, kAudioSampleRate };
+        codec->bit_rate       = source->params.audio_bitrate;
+        stream->time_base     = (AVRational){ 1, kAudioSampleRate };
+        
+        if ((codec->extradata = av_mallocz(sizeof(kAudioConfig) + AV_INPUT_BUFFER_PADDING_SIZE))) {
+            memcpy(codec->extradata, kAudioConfig, sizeof(kAudioConfig));
+            codec->extradata_size = sizeof(kAudioConfig);
+        }
+    }
+}
+
+static int add_streams(SynthSource *source, AVFormatContext *context) {
+    AVStream *stream;
+    
+    if (source->params.video_bitrate) {
+        if (!(stream = avformat_new_stream(context, NULL))) {
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        set_stream_params(source, stream, 1);
+    }
+    
+    if (source->params.audio_bitrate) {
+        if (!(stream = avformat_new_stream(context, NULL))) {
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        set_stream_params(source, stream, 0);
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief open synthetic source, its context can be passed to segmenter as input
+ * @param source output source
+ * @param params generated media parameters
+ * @return 0 on success, negative error code on failure
+ */
+int sg_synth_open(SynthSource **source, const SynthParams *params) {
+    SynthSource  *_source = (SynthSource*)calloc(1, sizeof(SynthSource));
+    unsigned int seed = 1;
+    int          i, ret;
+    
+    if (!_source) {
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    _source->params      = *params;
+    _source->video_index = -1;
+    _source->audio_index = -1;
+    
+    if (!_source->params.fps) {
+        _source->params.fps = 25;
+    }
+    
+    _source->video_frames = params->video_bitrate ? (int64_t)(params->duration * _source->params.fps) : 0;
+    _source->audio_frames = params->audio_bitrate ? (int64_t)(params->duration * kAudioSampleRate / kAudioFrameSize) : 0;
+    
+    _source->payload_size = max(video_frame_size(_source, 1), audio_frame_size(_source));
+    
+    if (!(_source->payload = (uint8_t*)malloc(_source->payload_size)) || !(_source->extradata = (uint8_t*)malloc(64)) ||
+        !(_source->context = avformat_alloc_context())) {
+        sg_synth_close(_source);
+        return SGERROR(SGERROR_MEM_ALLOC);
+    }
+    
+    for (i = 0; i < _source->payload_size; i++) {
+        _source->payload[i] = 1 + rand_r(&seed) % 255;
+    }
+    
+    _source->extradata_size = write_parameter_sets(_source->extradata);
+    
+    if ((ret = add_streams(_source, _source->context))) {
+        sg_synth_close(_source);
+        return ret;
+    }
+    
+    _source->video_index = params->video_bitrate ? 0 : -1;
+    _source->audio_index = params->audio_bitrate ? (params->video_bitrate ? 1 : 0) : -1;
+    
+    *source = _source;
+    
+    return 0;
+}
+
+/**
+ * @brief read next packet in decoding order, streams are interleaved by timestamp
+ * @param source synthetic source
+ * @param pkt output packet, should be unreferenced by caller
+ * @return 0 on success, AVERROR_EOF at the end of source, negative error code on failure
+ */
+int sg_synth_read(SynthSource *source, AVPacket *pkt) {
+    int video = source->video_frame < source->video_frames;
+    int audio = source->audio_frame < source->audio_frames;
+    int size;
+    
+    if (!video && !audio) {
+        return AVERROR_EOF;
+    }
+    
+    if (video && audio) {
+        video = (double)source->video_frame / source->params.fps <= (double)source->audio_frame * kAudioFrameSize / kAudioSampleRate;
+    }
+    
+    if (video) {
+        int     frame = source->video_frame % gop_frames(source);
+        int     key   = frame == 0;
+        uint8_t *data;
+        
+        size = video_frame_size(source, key);
+        
+        if (av_new_packet(pkt, size + sizeof(kAccessUnit) + (key ? source->extradata_size : 0) + 64) < 0) {
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        data = pkt->data;
+        
+        memcpy(data, kAccessUnit, sizeof(kAccessUnit));
+        data += sizeof(kAccessUnit);
+        
+        if (key) {
+            memcpy(data, source->extradata, source->extradata_size);
+            data += source->extradata_size;
+        }
+        
+        data += write_slice(source, data, key, frame, size);
+        
+        pkt->size         = data - pkt->data;
+        pkt->stream_index = source->video_index;
+        pkt->flags        = key ? AV_PKT_FLAG_KEY : 0;
+        pkt->pts          = av_rescale(source->video_frame, kVideoTimeBase, source->params.fps);
+        pkt->dts          = pkt->pts;
+        pkt->duration     = av_rescale(1, kVideoTimeBase, source->params.fps);
+        
+        source->video_frame++;
+    } else {
+        size = audio_frame_size(source);
+        
+        if (av_new_packet(pkt, size) < 0) {
+            return SGERROR(SGERROR_MEM_ALLOC);
+        }
+        
+        memcpy(pkt->data, source->payload, size);
+        
+        pkt->stream_index = source->audio_index;
+        pkt->flags        = AV_PKT_FLAG_KEY;
+        pkt->pts          = source->audio_frame * kAudioFrameSize;
+        pkt->dts          = pkt->pts;
+        pkt->duration     = kAudioFrameSize;
+        
+        source->audio_frame++;
+    }
+    
+    return 0;
+}
+
+/**
+ * @brief free synthetic source
+ * @param source synthetic source
+ */
+void sg_synth_close(SynthSource *source) {
+    
+    if (source->context) {
+        avformat_free_context(source->context);
+    }
+    
+    free(source->payload);
+    free(source->extradata);
+    free(source);
+}
+
+/**
+ * @brief write synthetic media to file
+ * @param params generated media parameters, format selects MPEG-TS, MP4 or ADTS (audio only) container
+ * @param filename output file name
+ * @return 0 on success, negative error code on failure
+ */
+int sg_synth_write_file(const SynthParams *params, const char *filename) {
+    SynthSource     *source;
+    AVFormatContext *output = NULL;
+    AVPacket        pkt;
+    int             ret;
+    
+    if ((ret = sg_synth_open(&source, params))) {
+        return ret;
+    }
+    
+    if (avformat_alloc_output_context2(&output, NULL, kSynthFormats[params->format], filename) < 0) {
+        sg_synth_close(source);
+        return SGERROR(SGERROR_UNSUPPORTED_FORMAT);
+    }
+    
+    if ((ret = add_streams(source, output)) || avio_open(&output->pb, filename, AVIO_FLAG_WRITE) < 0) {
+        avformat_free_context(output);
+        sg_synth_close(source);
+        return ret ? ret : SGERROR(SGERROR_FILE_WRITE);
+    }
+    
+    if (avformat_write_header(output, NULL) < 0) {
+        ret = SGERROR(SGERROR_MUX);
+    }
+    
+    while (!ret && !sg_synth_read(source, &pkt)) {
+        AVRational time_base = source->context->streams[pkt.stream_index]->time_base;
+        AVStream   *stream   = output->streams[pkt.stream_index];
+        
+        pkt.pts      = av_rescale_q(pkt.pts, time_base, stream->time_base);
+        pkt.dts      = av_rescale_q(pkt.dts, time_base, stream->time_base);
+        pkt.duration = av_rescale_q(pkt.duration, time_base, stream->time_base);
+        
+        if (av_interleaved_write_frame(output, &pkt) < 0) {
+            ret = SGERROR(SGERROR_MUX);
+        }
+        
+        av_packet_unref(&pkt);
+    }
+    
+    if (!ret && av_write_trailer(output) < 0) {
+        ret = SGERROR(SGERROR_MUX);
+    }
+    
+    avio_closep(&output->pb);
+    avformat_free_context(output);
+    sg_synth_close(source);
+    
+    return ret;
+}
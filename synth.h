@@ -0,0 +1,67 @@
+// synth.h
+// Copyright (C) 2012  Iliya Grushevskiy <iliya.gr@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libavformat/avformat.h>
+
+#ifndef __SG_SYNTH__
+#define __SG_SYNTH__
+
+typedef enum {
+    SynthFormatTS,
+    SynthFormatMP4,
+    SynthFormatADTS
+} SynthFormat;
+
+typedef struct {
+    SynthFormat format;
+    
+    double      duration;
+    double      gop;
+    int         fps;
+    
+    int         video_bitrate;
+    int         audio_bitrate;
+} SynthParams;
+
+/**
+ * Synthetic H.264/AAC source. Video is a syntactically valid baseline
+ * bitstream (parameter sets and slice headers) with random slice data,
+ * audio is raw AAC-LC frames with random payload. Nothing is encoded,
+ * so generation is cheap and deterministic for given parameters.
+ */
+typedef struct {
+    SynthParams     params;
+    
+    AVFormatContext *context;
+    int             video_index, audio_index;
+    
+    int64_t         video_frame, audio_frame;
+    int64_t         video_frames, audio_frames;
+    
+    uint8_t         *extradata;
+    int             extradata_size;
+    
+    uint8_t         *payload;
+    int             payload_size;
+} SynthSource;
+
+int  sg_synth_open(SynthSource **source, const SynthParams *params);
+int  sg_synth_read(SynthSource *source, AVPacket *pkt);
+void sg_synth_close(SynthSource *source);
+
+int  sg_synth_write_file(const SynthParams *params, const char *filename);
+
+#endif
@@ -15,11 +15,10 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdlib.h>
-#include <string.h>
 #include "util.h"
 
-char *sg_strerror(int error) {
-    char* errstr = NULL;
+const char *sg_strerror(int error) {
+    const char* errstr = NULL;
     
     switch (error) {
         case SGERROR_MEM_ALLOC:
@@ -34,10 +33,28 @@ char *sg_strerror(int error) {
         case SGERROR_UNSUPPORTED_FORMAT:
             errstr = "unsupported output format";
             break;
+        case SGERROR_MUX:
+            errstr = "can't write media data";
+            break;
+        case SGERROR_CRYPT:
+            errstr = "can't encrypt segment";
+            break;
+        case SGERROR_NETWORK:
+            errstr = "network request failed";
+            break;
+        case SGERROR_INPUT:
+            errstr = "can't read input";
+            break;
+        case SGERROR_INVALID:
+            errstr = "invalid argument";
+            break;
+        case SGERROR_EXISTS:
+            errstr = "file already exists";
+            break;
         default:
             errstr = "unkown error";
             break;
     }
     
-    return strndup(errstr, strlen(errstr));
+    return errstr;
 }
\ No newline at end of file
@@ -25,7 +25,13 @@
 #define SGERROR_NO_STREAM          0x02
 #define SGERROR_UNSUPPORTED_FORMAT 0x03
 #define SGERROR_FILE_WRITE         0x04
+#define SGERROR_MUX                0x05
+#define SGERROR_CRYPT              0x06
+#define SGERROR_NETWORK            0x07
+#define SGERROR_INPUT              0x08
+#define SGERROR_INVALID            0x09
+#define SGERROR_EXISTS             0x0A
 
-char *sg_strerror(int error);
+const char *sg_strerror(int error);
 
 #endif